@@ -0,0 +1,1249 @@
+/////////////////////////////////////////////////////////////////////////////
+/// @file        luaport_bench.cpp
+/// @brief       microbenchmarks of luaport paths against the raw Lua C API
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+//
+// build:
+//   g++ -std=c++11 -O2 -I.. luaport_bench.cpp -llua -o luaport_bench
+//
+// usage:
+//   luaport_bench [filter [scale]] > result.jsonl
+//
+// every benchmark is run twice, once through luaport ("luaport") and once
+// through the plain Lua C API doing the same work ("raw"). one JSON object
+// is printed per line:
+//   {"bench": "call/free/2", "impl": "luaport", "iters": 1000000,
+//    "ns_per_op": 41.2}
+// "ns_per_op" is the best of several runs. only benchmarks whose name
+// contains "filter" are run, and "scale" multiplies the iteration counts.
+//
+// "call/many/64" calls 64 distinct bindings of one signature in turn and
+// shows the instruction cache effect of the per-binding code,
+// "call/many_shared/64" does the same with shared_function() bindings.
+// "json/decode" is also run with a plain C++ parser building C++
+// containers ("native"), the reference for the decoder outside of Lua.
+
+#include <luaport/luaport.hpp>
+#include <luaport/json.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+using namespace luaport;
+
+namespace bench
+{
+
+  const char *filter = "";
+  double scale = 1.0;
+
+
+  // ---------------------------------------------------------
+  // measurement and reporting
+  // ---------------------------------------------------------
+
+  typedef void (*body_t)(lua_State *L, long n);
+
+  inline bool selected(const std::string &name)
+  {
+    return name.find(filter) != std::string::npos;
+  }
+
+  inline double measure(lua_State *L, body_t body, long n)
+  {
+    // warm up (also triggers lazy allocations like registry tables)
+    body(L, n / 10 + 1);
+    double best = 0;
+    for (int run = 0; run < 3; run++)
+    {
+      std::chrono::steady_clock::time_point t0 =
+        std::chrono::steady_clock::now();
+      body(L, n);
+      std::chrono::steady_clock::time_point t1 =
+        std::chrono::steady_clock::now();
+      double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+      ns /= n;
+      if (run == 0 || ns < best) { best = ns; }
+    }
+    lua_settop(L, 0);
+    return best;
+  }
+
+  inline void report(const std::string &name, const char *impl,
+                     long n, double ns)
+  {
+    std::printf("{\"bench\": \"%s\", \"impl\": \"%s\", "
+                "\"iters\": %ld, \"ns_per_op\": %.2f}\n",
+                name.c_str(), impl, n, ns);
+    std::fflush(stdout);
+  }
+
+  /// run a baseline without luaport nor raw C API under the same name
+  inline void run_native(lua_State *L, const std::string &name, long n,
+                         body_t native_body)
+  {
+    if (! selected(name)) { return; }
+    n = (long)(n * scale);
+    if (n < 1) { n = 1; }
+    report(name, "native", n, measure(L, native_body, n));
+  }
+
+  /// run a luaport body and its raw C API baseline under the same name
+  inline void run(lua_State *L, const std::string &name, long n,
+                  body_t luaport_body, body_t raw_body)
+  {
+    if (! selected(name)) { return; }
+    n = (long)(n * scale);
+    if (n < 1) { n = 1; }
+    report(name, "luaport", n, measure(L, luaport_body, n));
+    report(name, "raw", n, measure(L, raw_body, n));
+  }
+
+
+  // run "for i = 1, n do <stmt> end" with the given upvalues
+  // stmt can refer to f (the bound function), o (the instance) and i
+  inline object loop(lua_State *L, const std::string &stmt)
+  {
+    std::string code =
+      "local f, o, n = ...\n"
+      "for i = 1, n do " + stmt + " end\n";
+    object chunk = luaport::load(L, code);
+    if (! chunk.is_valid())
+    {
+      throw luaport::exception("failed to compile: " + code);
+    }
+    return chunk;
+  }
+
+  inline void run_loop(lua_State *L, const char *chunk_name, long n)
+  {
+    object chunk = globals(L)["bench"][chunk_name];
+    chunk.push();
+    lua_getglobal(L, "f");
+    lua_getglobal(L, "o");
+    lua_pushinteger(L, n);
+    if (lua_pcall(L, 3, 0, 0) != LUA_OK)
+    {
+      std::fprintf(stderr, "%s: %s\n", chunk_name, lua_tostring(L, -1));
+      std::exit(1);
+    }
+  }
+
+
+  // ---------------------------------------------------------
+  // bound C++ code
+  // ---------------------------------------------------------
+
+  int f0() { return 0; }
+  int f1(int a) { return a; }
+  int f2(int a, int b) { return a + b; }
+  int f3(int a, int b, int c) { return a + b + c; }
+  int f4(int a, int b, int c, int d) { return a + b + c + d; }
+  int f5(int a, int b, int c, int d, int e) { return a + b + c + d + e; }
+  int f6(int a, int b, int c, int d, int e, int f)
+  { return a + b + c + d + e + f; }
+  int f7(int a, int b, int c, int d, int e, int f, int g)
+  { return a + b + c + d + e + f + g; }
+
+  template <int N>
+    int raw_sum(lua_State *L)
+  {
+    lua_Integer sum = 0;
+    for (int i = 1; i <= N; i++) { sum += lua_tointeger(L, i); }
+    lua_pushinteger(L, sum);
+    return 1;
+  }
+
+  // stateful function object
+  struct offset_sum
+  {
+    int offset;
+    int operator()(int a, int b) const { return offset + a + b; }
+  };
+
+  int raw_closure(lua_State *L)
+  {
+    offset_sum *fn = (offset_sum *)lua_touserdata(L, lua_upvalueindex(1));
+    lua_pushinteger(L, (*fn)((int)lua_tointeger(L, 1),
+                             (int)lua_tointeger(L, 2)));
+    return 1;
+  }
+
+  int raw_overload(lua_State *L)
+  {
+    switch (lua_gettop(L))
+    {
+      case 1:
+        if (lua_type(L, 1) == LUA_TNUMBER) { return raw_sum<1>(L); }
+        break;
+      case 2:
+        if (lua_type(L, 1) == LUA_TNUMBER && lua_type(L, 2) == LUA_TNUMBER)
+        {
+          return raw_sum<2>(L);
+        }
+        break;
+    }
+    return luaL_error(L, "no matching overload");
+  }
+
+  class counter
+  {
+    public:
+      counter() : v(0) { }
+      int get() const { return v; }
+      void set(int x) { v = x; }
+      int add1(int a) { return v += a; }
+      int add2(int a, int b) { return v += a + b; }
+      int add3(int a, int b, int c) { return v += a + b + c; }
+      int v;
+  };
+
+  // registered without properties (methods only)
+  class meter
+  {
+    public:
+      meter() : v(0) { }
+      int get() const { return v; }
+      int v;
+  };
+
+  // result returned by value
+  counter make_counter(int v)
+  {
+    counter c;
+    c.v = v;
+    return c;
+  }
+
+  // several results as separate values
+  std::tuple<int, int, int> f_multi(int a) { return std::make_tuple(a, a + 1, a + 2); }
+
+  inline counter *raw_self(lua_State *L)
+  {
+    return *(counter **)lua_touserdata(L, 1);
+  }
+
+  template <int N>
+    int raw_add(lua_State *L)
+  {
+    counter *c = raw_self(L);
+    lua_Integer sum = 0;
+    for (int i = 2; i <= N + 1; i++) { sum += lua_tointeger(L, i); }
+    c->v += sum;
+    lua_pushinteger(L, c->v);
+    return 1;
+  }
+
+  int raw_get(lua_State *L)
+  {
+    lua_pushinteger(L, raw_self(L)->get());
+    return 1;
+  }
+
+  int raw_multi(lua_State *L)
+  {
+    lua_Integer a = lua_tointeger(L, 1);
+    lua_pushinteger(L, a);
+    lua_pushinteger(L, a + 1);
+    lua_pushinteger(L, a + 2);
+    return 3;
+  }
+
+  // the counter held by the userdata itself
+  int raw_make_counter(lua_State *L)
+  {
+    counter *c = new(lua_newuserdata(L, sizeof(counter))) counter();
+    c->v = (int)lua_tointeger(L, 1);
+    luaL_getmetatable(L, "raw_counter_value");
+    lua_setmetatable(L, -2);
+    return 1;
+  }
+
+  int raw_index(lua_State *L)
+  {
+    const char *key = lua_tostring(L, 2);
+    if (key && std::strcmp(key, "v") == 0)
+    {
+      lua_pushinteger(L, raw_self(L)->v);
+      return 1;
+    }
+    return 0;
+  }
+
+  int raw_newindex(lua_State *L)
+  {
+    const char *key = lua_tostring(L, 2);
+    if (key && std::strcmp(key, "v") == 0)
+    {
+      raw_self(L)->v = (int)lua_tointeger(L, 3);
+    }
+    return 0;
+  }
+
+  int raw_gc(lua_State *L)
+  {
+    counter **u = (counter **)lua_touserdata(L, 1);
+    lua_getmetatable(L, 1);
+    lua_getfield(L, -1, "adopt");
+    if (lua_toboolean(L, -1)) { delete *u; }
+    return 0;
+  }
+
+  // push a raw userdata holding a counter pointer
+  inline void raw_push(lua_State *L, counter *c, bool adopt)
+  {
+    counter **u = (counter **)lua_newuserdata(L, sizeof(counter *));
+    *u = c;
+    luaL_getmetatable(L, adopt ? "raw_counter_adopt" : "raw_counter");
+    lua_setmetatable(L, -2);
+  }
+
+
+  // ---------------------------------------------------------
+  // benchmark bodies
+  // ---------------------------------------------------------
+
+  // calls of bound functions from lua (same loop, different f)
+  #define BENCH_CALL_BODY(N) \
+    void lp_call_##N(lua_State *L, long n) \
+    { \
+      globals(L)["f"] = object(globals(L)["bench"]["lp_f" #N]); \
+      run_loop(L, "call" #N, n); \
+    } \
+    void raw_call_##N(lua_State *L, long n) \
+    { \
+      globals(L)["f"] = object(globals(L)["bench"]["raw_f" #N]); \
+      run_loop(L, "call" #N, n); \
+    }
+  BENCH_CALL_BODY(0)
+  BENCH_CALL_BODY(1)
+  BENCH_CALL_BODY(2)
+  BENCH_CALL_BODY(3)
+  BENCH_CALL_BODY(4)
+  BENCH_CALL_BODY(5)
+  BENCH_CALL_BODY(6)
+  BENCH_CALL_BODY(7)
+  #undef BENCH_CALL_BODY
+
+  // overloaded call resolved by arity (2nd candidate)
+  void lp_call_overload(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["lp_overload"]);
+    run_loop(L, "call2", n);
+  }
+  void raw_call_overload(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["raw_overload"]);
+    run_loop(L, "call2", n);
+  }
+
+  // calls of function objects stored in the upvalue
+  void lp_call_closure(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["lp_closure"]);
+    run_loop(L, "call2", n);
+  }
+  void raw_call_closure(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["raw_closure"]);
+    run_loop(L, "call2", n);
+  }
+
+  // calls of bound member functions (f(o, ...) form)
+  #define BENCH_METHOD_BODY(N) \
+    void lp_method_##N(lua_State *L, long n) \
+    { \
+      globals(L)["f"] = object(globals(L)["bench"]["lp_m" #N]); \
+      globals(L)["o"] = object(globals(L)["bench"]["lp_obj"]); \
+      run_loop(L, "method" #N, n); \
+    } \
+    void raw_method_##N(lua_State *L, long n) \
+    { \
+      globals(L)["f"] = object(globals(L)["bench"]["raw_m" #N]); \
+      globals(L)["o"] = object(globals(L)["bench"]["raw_obj"]); \
+      run_loop(L, "method" #N, n); \
+    }
+  BENCH_METHOD_BODY(0)
+  BENCH_METHOD_BODY(1)
+  BENCH_METHOD_BODY(2)
+  BENCH_METHOD_BODY(3)
+  #undef BENCH_METHOD_BODY
+
+  // field access through __index / __newindex
+  void lp_field_get(lua_State *L, long n)
+  {
+    globals(L)["o"] = object(globals(L)["bench"]["lp_obj"]);
+    run_loop(L, "field_get", n);
+  }
+  void raw_field_get(lua_State *L, long n)
+  {
+    globals(L)["o"] = object(globals(L)["bench"]["raw_obj"]);
+    run_loop(L, "field_get", n);
+  }
+  void lp_field_set(lua_State *L, long n)
+  {
+    globals(L)["o"] = object(globals(L)["bench"]["lp_obj"]);
+    run_loop(L, "field_set", n);
+  }
+  void raw_field_set(lua_State *L, long n)
+  {
+    globals(L)["o"] = object(globals(L)["bench"]["raw_obj"]);
+    run_loop(L, "field_set", n);
+  }
+
+  // method lookup and call through __index (o:get() form)
+  void lp_dispatch(lua_State *L, long n)
+  {
+    globals(L)["o"] = object(globals(L)["bench"]["lp_meter"]);
+    run_loop(L, "dispatch", n);
+  }
+  void raw_dispatch(lua_State *L, long n)
+  {
+    globals(L)["o"] = object(globals(L)["bench"]["raw_meter"]);
+    run_loop(L, "dispatch", n);
+  }
+
+  // object_cast per type (raw: fetch the registry ref and convert)
+  volatile long sink = 0;
+
+  template <typename T>
+    void lp_cast(lua_State *L, long n)
+  {
+    object o = globals(L)["bench"]["cast_src"];
+    for (long i = 0; i < n; i++)
+    {
+      T v = object_cast<T>(o);
+      sink += (long)sizeof(v);
+    }
+  }
+  template <typename T>
+    void raw_cast(lua_State *L, long n);
+  template <>
+    void raw_cast<bool>(lua_State *L, long n)
+  {
+    object o = globals(L)["bench"]["cast_src"];
+    for (long i = 0; i < n; i++)
+    {
+      o.push();
+      sink += lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  template <>
+    void raw_cast<int>(lua_State *L, long n)
+  {
+    object o = globals(L)["bench"]["cast_src"];
+    for (long i = 0; i < n; i++)
+    {
+      o.push();
+      sink += (int)lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  template <>
+    void raw_cast<long>(lua_State *L, long n)
+  {
+    object o = globals(L)["bench"]["cast_src"];
+    for (long i = 0; i < n; i++)
+    {
+      o.push();
+      sink += (long)lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  template <>
+    void raw_cast<double>(lua_State *L, long n)
+  {
+    object o = globals(L)["bench"]["cast_src"];
+    for (long i = 0; i < n; i++)
+    {
+      o.push();
+      sink += (long)lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  template <>
+    void raw_cast<std::string>(lua_State *L, long n)
+  {
+    object o = globals(L)["bench"]["cast_src"];
+    for (long i = 0; i < n; i++)
+    {
+      size_t len;
+      o.push();
+      const char *s = lua_tolstring(L, -1, &len);
+      std::string str(s, len);
+      sink += (long)str.size();
+      lua_pop(L, 1);
+    }
+  }
+  template <>
+    void raw_cast<counter *>(lua_State *L, long n)
+  {
+    object o = globals(L)["bench"]["cast_src"];
+    for (long i = 0; i < n; i++)
+    {
+      o.push();
+      counter *c = *(counter **)lua_touserdata(L, -1);
+      sink += (long)(c != NULL);
+      lua_pop(L, 1);
+    }
+  }
+
+  template <typename T>
+    void set_cast_src(lua_State *L, const T &val)
+  {
+    globals(L)["bench"]["cast_src"] = val;
+  }
+
+  // pushing instances (object ctor = push + registry ref)
+  counter shared_counter;
+
+  void lp_push(lua_State *L, long n)
+  {
+    for (long i = 0; i < n; i++)
+    {
+      object o(L, &shared_counter);
+    }
+  }
+  void raw_push_ref(lua_State *L, long n)
+  {
+    for (long i = 0; i < n; i++)
+    {
+      raw_push(L, &shared_counter, false);
+      int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    }
+  }
+  void lp_push_adopt(lua_State *L, long n)
+  {
+    for (long i = 0; i < n; i++)
+    {
+      object o(L, new counter(), adopt);
+    }
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  }
+  void raw_push_adopt(lua_State *L, long n)
+  {
+    for (long i = 0; i < n; i++)
+    {
+      raw_push(L, new counter(), true);
+      int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    }
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  }
+
+  // instances returned by value from bindings
+  void lp_return_value(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["lp_make"]);
+    run_loop(L, "make", n);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  }
+  void raw_return_value(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["raw_make"]);
+    run_loop(L, "make", n);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  }
+
+  // proxy chains (globals.a.b.c)
+  void lp_proxy_get(lua_State *L, long n)
+  {
+    object g = globals(L);
+    for (long i = 0; i < n; i++)
+    {
+      sink += object_cast<int>(g["a"]["b"]["c"]);
+    }
+  }
+  void raw_proxy_get(lua_State *L, long n)
+  {
+    for (long i = 0; i < n; i++)
+    {
+      lua_getglobal(L, "a");
+      lua_getfield(L, -1, "b");
+      lua_getfield(L, -1, "c");
+      sink += (int)lua_tointeger(L, -1);
+      lua_pop(L, 3);
+    }
+  }
+  void lp_proxy_set(lua_State *L, long n)
+  {
+    object g = globals(L);
+    for (long i = 0; i < n; i++)
+    {
+      g["a"]["b"]["c"] = (int)i;
+    }
+  }
+  void raw_proxy_set(lua_State *L, long n)
+  {
+    for (long i = 0; i < n; i++)
+    {
+      lua_getglobal(L, "a");
+      lua_getfield(L, -1, "b");
+      lua_pushinteger(L, i);
+      lua_setfield(L, -2, "c");
+      lua_pop(L, 2);
+    }
+  }
+
+  // iterator traversal (per element)
+  const int iter_table_size = 1000;
+
+  void lp_iterate(lua_State *L, long n)
+  {
+    object t = globals(L)["bench"]["iter_src"];
+    for (long done = 0; done < n; done += iter_table_size)
+    {
+      for (iterator i(t); i; ++i)
+      {
+        sink += object_cast<int>(i.value());
+      }
+    }
+  }
+  void raw_iterate(lua_State *L, long n)
+  {
+    object t = globals(L)["bench"]["iter_src"];
+    for (long done = 0; done < n; done += iter_table_size)
+    {
+      t.push();
+      lua_pushnil(L);
+      while (lua_next(L, -2))
+      {
+        sink += (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+      }
+      lua_pop(L, 1);
+    }
+  }
+
+  // object::operator() callbacks
+  void lp_callback(lua_State *L, long n)
+  {
+    object f = globals(L)["bench"]["callback"];
+    for (long i = 0; i < n; i++)
+    {
+      sink += object_cast<int>(f((int)i, 1));
+    }
+  }
+  void raw_callback(lua_State *L, long n)
+  {
+    object f = globals(L)["bench"]["callback"];
+    for (long i = 0; i < n; i++)
+    {
+      f.push();
+      lua_pushinteger(L, i);
+      lua_pushinteger(L, 1);
+      lua_call(L, 2, 1);
+      sink += (int)lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+
+  // batches of batch_size inputs through the same callback
+  const int batch_size = 1024;
+  void lp_callback_batch(lua_State *L, long n)
+  {
+    object f = globals(L)["bench"]["callback1"];
+    double in[batch_size], out[batch_size];
+    for (int i = 0; i < batch_size; i++) { in[i] = i; }
+    for (long done = 0; done < n; done += batch_size)
+    {
+      long k = n - done < batch_size ? n - done : batch_size;
+      call_batch(f, in, k, out);
+      sink += (int)out[k - 1];
+    }
+  }
+  void raw_callback_batch(lua_State *L, long n)
+  {
+    object f = globals(L)["bench"]["callback1"];
+    double in[batch_size], out[batch_size];
+    for (int i = 0; i < batch_size; i++) { in[i] = i; }
+    f.push();
+    for (long done = 0; done < n; done += batch_size)
+    {
+      long k = n - done < batch_size ? n - done : batch_size;
+      for (long i = 0; i < k; i++)
+      {
+        lua_pushvalue(L, -1);
+        lua_pushnumber(L, in[i]);
+        if (lua_pcall(L, 1, 1, 0) == LUA_OK) { out[i] = lua_tonumber(L, -1); }
+        lua_pop(L, 1);
+      }
+      sink += (int)out[k - 1];
+    }
+    lua_pop(L, 1);
+  }
+
+
+  // json documents of json_records records
+  // ({"id": i, "name": "item i", "price": 1.5, "tags": ["a", "b"], "ok": true})
+  const int json_records = 64;
+  std::string json_doc;
+  inline void make_json_doc()
+  {
+    json_doc = "[";
+    char buf[128];
+    for (int i = 0; i < json_records; i++)
+    {
+      std::sprintf(buf, "%s{\"id\": %d, \"name\": \"item %d\", \"price\": 1.5, "
+                   "\"tags\": [\"a\", \"b\"], \"ok\": true}",
+                   i ? ", " : "", i, i);
+      json_doc += buf;
+    }
+    json_doc += "]";
+  }
+  // raw: the same values built directly (lower bound of the decoder)
+  void lp_json_decode(lua_State *L, long n)
+  {
+    for (long i = 0; i < n; i++)
+    {
+      object v = json_decode(L, json_doc);
+      sink += v.is_valid();
+    }
+  }
+  void raw_json_decode(lua_State *L, long n)
+  {
+    char name[32];
+    for (long k = 0; k < n; k++)
+    {
+      lua_createtable(L, json_records, 0);
+      for (int i = 0; i < json_records; i++)
+      {
+        lua_createtable(L, 0, 5);
+        lua_pushinteger(L, i);
+        lua_setfield(L, -2, "id");
+        std::sprintf(name, "item %d", i);
+        lua_pushstring(L, name);
+        lua_setfield(L, -2, "name");
+        lua_pushnumber(L, 1.5);
+        lua_setfield(L, -2, "price");
+        lua_createtable(L, 2, 0);
+        lua_pushliteral(L, "a");
+        lua_rawseti(L, -2, 1);
+        lua_pushliteral(L, "b");
+        lua_rawseti(L, -2, 2);
+        lua_setfield(L, -2, "tags");
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "ok");
+        lua_rawseti(L, -2, i + 1);
+      }
+      sink += lua_istable(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  // native: validating recursive descent parser into C++ containers,
+  // the same work as the decoder without creating lua values
+  struct json_node
+  {
+    enum kind_t { null_t, bool_t, number_t, string_t, array_t, object_t };
+    json_node() : kind(null_t), number(0) { }
+    kind_t kind;
+    double number;
+    std::string str;
+    std::vector<json_node> items;
+    std::vector<std::pair<std::string, json_node> > members;
+  };
+  class native_json_parser
+  {
+    public:
+      native_json_parser(const std::string &text)
+        : p(text.data()), end(text.data() + text.size())
+      { }
+
+      void parse(json_node &node)
+      {
+        value(node);
+        space();
+        if (p != end) { fail(); }
+      }
+
+    private:
+      static void fail()
+      {
+        throw luaport::exception("native json parser: bad document");
+      }
+
+      void space()
+      {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        {
+          p++;
+        }
+      }
+
+      void literal(const char *word, std::size_t len)
+      {
+        if ((std::size_t)(end - p) < len || std::memcmp(p, word, len) != 0) { fail(); }
+        p += len;
+      }
+
+      void string(std::string &out)
+      {
+        p++; // opening quote
+        for (;;)
+        {
+          const char *start = p;
+          while (p < end && *p != '"' && *p != '\\') { p++; }
+          out.append(start, p - start);
+          if (p == end) { fail(); }
+          if (*p++ == '"') { return; }
+          if (p == end) { fail(); }
+          char c = *p++;
+          switch (c)
+          {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u':
+            {
+              // basic multilingual plane only
+              if (end - p < 4) { fail(); }
+              unsigned cp = (unsigned)std::strtoul(std::string(p, 4).c_str(), NULL, 16);
+              p += 4;
+              if (cp < 0x80) { out += (char)cp; }
+              else if (cp < 0x800)
+              {
+                out += (char)(0xc0 | (cp >> 6));
+                out += (char)(0x80 | (cp & 0x3f));
+              }
+              else
+              {
+                out += (char)(0xe0 | (cp >> 12));
+                out += (char)(0x80 | ((cp >> 6) & 0x3f));
+                out += (char)(0x80 | (cp & 0x3f));
+              }
+              break;
+            }
+            default: out += c;
+          }
+        }
+      }
+
+      void value(json_node &node)
+      {
+        space();
+        if (p == end) { fail(); }
+        switch (*p)
+        {
+          case '{':
+            node.kind = json_node::object_t;
+            p++;
+            space();
+            if (p < end && *p == '}') { p++; return; }
+            for (;;)
+            {
+              space();
+              if (p == end || *p != '"') { fail(); }
+              node.members.push_back(std::make_pair(std::string(), json_node()));
+              string(node.members.back().first);
+              space();
+              if (p == end || *p++ != ':') { fail(); }
+              value(node.members.back().second);
+              space();
+              if (p == end) { fail(); }
+              if (*p == ',') { p++; continue; }
+              if (*p++ != '}') { fail(); }
+              return;
+            }
+          case '[':
+            node.kind = json_node::array_t;
+            p++;
+            space();
+            if (p < end && *p == ']') { p++; return; }
+            for (;;)
+            {
+              node.items.push_back(json_node());
+              value(node.items.back());
+              space();
+              if (p == end) { fail(); }
+              if (*p == ',') { p++; continue; }
+              if (*p++ != ']') { fail(); }
+              return;
+            }
+          case '"':
+            node.kind = json_node::string_t;
+            string(node.str);
+            return;
+          case 't':
+            literal("true", 4);
+            node.kind = json_node::bool_t;
+            node.number = 1;
+            return;
+          case 'f':
+            literal("false", 5);
+            node.kind = json_node::bool_t;
+            return;
+          case 'n':
+            literal("null", 4);
+            return;
+          default:
+          {
+            // the document is terminated by the std::string
+            char *stop;
+            node.number = std::strtod(p, &stop);
+            if (stop == p) { fail(); }
+            node.kind = json_node::number_t;
+            p = stop;
+          }
+        }
+      }
+
+      const char *p;
+      const char *end;
+  };
+  void native_json_decode(lua_State *L, long n)
+  {
+    for (long i = 0; i < n; i++)
+    {
+      json_node doc;
+      native_json_parser(json_doc).parse(doc);
+      sink += (int)doc.items.size();
+    }
+  }
+  // raw: traversal appending the keys and values without any escaping
+  // or validation (lower bound of the encoder)
+  inline void raw_json_walk(lua_State *L, int idx, std::string &out)
+  {
+    char buf[32];
+    switch (lua_type(L, idx))
+    {
+      case LUA_TTABLE:
+        out += '{';
+        lua_pushnil(L);
+        while (lua_next(L, idx))
+        {
+          raw_json_walk(L, lua_gettop(L) - 1, out);
+          out += ':';
+          raw_json_walk(L, lua_gettop(L), out);
+          out += ',';
+          lua_pop(L, 1);
+        }
+        out += '}';
+        break;
+      case LUA_TNUMBER:
+        std::sprintf(buf, "%.14g", lua_tonumber(L, idx));
+        out += buf;
+        break;
+      case LUA_TBOOLEAN:
+        out += lua_toboolean(L, idx) ? "true" : "false";
+        break;
+      default:
+        out += '"';
+        out += lua_tostring(L, idx);
+        out += '"';
+    }
+  }
+  void lp_json_encode(lua_State *L, long n)
+  {
+    object v = globals(L)["bench"]["json_src"];
+    std::string out;
+    for (long i = 0; i < n; i++)
+    {
+      out.clear();
+      json_encode(v, out);
+      sink += (int)out.size();
+    }
+  }
+  void raw_json_encode(lua_State *L, long n)
+  {
+    object v = globals(L)["bench"]["json_src"];
+    std::string out;
+    v.push();
+    for (long i = 0; i < n; i++)
+    {
+      out.clear();
+      raw_json_walk(L, lua_gettop(L), out);
+      sink += (int)out.size();
+    }
+    lua_pop(L, 1);
+  }
+
+
+  // many distinct bindings of the same signature
+  const int many_bindings = 64;
+  template <int N>
+    int many_f(int a, int b)
+  {
+    return a + b + N;
+  }
+  template <int N>
+    int raw_many_f(lua_State *L)
+  {
+    lua_pushinteger(L, lua_tointeger(L, 1) + lua_tointeger(L, 2) + N);
+    return 1;
+  }
+  template <int N>
+    struct many_registrar
+  {
+    static void add(object lp, object shared, object raw)
+    {
+      many_registrar<N - 1>::add(lp, shared, raw);
+      lp[N] = get_functype(&many_f<N>).template get_lfunc<&many_f<N> >();
+      shared[N] = get_functype(&many_f<N>).template get_shared<&many_f<N> >();
+      raw[N] = raw_many_f<N>;
+    }
+  };
+  template <>
+    struct many_registrar<0>
+  {
+    static void add(object lp, object shared, object raw) { }
+  };
+
+  void lp_call_many(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["lp_many"]);
+    run_loop(L, "call_many", n);
+  }
+  void lp_call_many_shared(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["lp_many_shared"]);
+    run_loop(L, "call_many", n);
+  }
+  void raw_call_many(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["raw_many"]);
+    run_loop(L, "call_many", n);
+  }
+
+  // std::tuple result pushed as 3 values
+  void lp_call_multi(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["lp_multi"]);
+    run_loop(L, "call_multi", n);
+  }
+  void raw_call_multi(lua_State *L, long n)
+  {
+    globals(L)["f"] = object(globals(L)["bench"]["raw_multi"]);
+    run_loop(L, "call_multi", n);
+  }
+
+
+  // ---------------------------------------------------------
+  // setup
+  // ---------------------------------------------------------
+
+  inline void setup(lua_State *L)
+  {
+    luaport::open(L);
+    object g = globals(L);
+    object b = g.table("bench");
+
+    // free functions
+    b["lp_f0"] = function(f0);
+    b["lp_f1"] = function(f1);
+    b["lp_f2"] = function(f2);
+    b["lp_f3"] = function(f3);
+    b["lp_f4"] = function(f4);
+    b["lp_f5"] = function(f5);
+    b["lp_f6"] = function(f6);
+    b["lp_f7"] = function(f7);
+    b["raw_f0"] = raw_sum<0>;
+    b["raw_f1"] = raw_sum<1>;
+    b["raw_f2"] = raw_sum<2>;
+    b["raw_f3"] = raw_sum<3>;
+    b["raw_f4"] = raw_sum<4>;
+    b["raw_f5"] = raw_sum<5>;
+    b["raw_f6"] = raw_sum<6>;
+    b["raw_f7"] = raw_sum<7>;
+    b["lp_overload"] = overload(function_as(int (*)(int), f1),
+                                function_as(int (*)(int, int), f2));
+    b["raw_overload"] = raw_overload;
+    offset_sum fn = { 1 };
+    b["lp_closure"] = closure<int (int, int)>(L, fn);
+    *(offset_sum *)lua_newuserdata(L, sizeof(offset_sum)) = fn;
+    lua_pushcclosure(L, raw_closure, 1);
+    b["raw_closure"] = object(from_stack(L, -1));
+    lua_pop(L, 1);
+    b["call0"] = loop(L, "f()");
+    b["call1"] = loop(L, "f(1)");
+    b["call2"] = loop(L, "f(1, 2)");
+    b["call3"] = loop(L, "f(1, 2, 3)");
+    b["call4"] = loop(L, "f(1, 2, 3, 4)");
+    b["call5"] = loop(L, "f(1, 2, 3, 4, 5)");
+    b["call6"] = loop(L, "f(1, 2, 3, 4, 5, 6)");
+    b["call7"] = loop(L, "f(1, 2, 3, 4, 5, 6, 7)");
+    object lp_many = b.table("lp_many");
+    object lp_many_shared = b.table("lp_many_shared");
+    object raw_many = b.table("raw_many");
+    many_registrar<many_bindings>::add(lp_many, lp_many_shared, raw_many);
+    b["call_many"] = loop(L, "f[i % 64 + 1](1, 2)");
+    b["lp_multi"] = function(f_multi);
+    b["raw_multi"] = raw_multi;
+    b["call_multi"] = loop(L, "local a, b, c = f(i)");
+
+    // member functions and properties
+    object c = newclass<counter>(L, "counter");
+    c["get_v"] = method(counter::get);
+    c["set_v"] = method(counter::set);
+    b["lp_m0"] = method(counter::get);
+    b["lp_m1"] = method(counter::add1);
+    b["lp_m2"] = method(counter::add2);
+    b["lp_m3"] = method(counter::add3);
+    b["raw_m0"] = raw_get;
+    b["raw_m1"] = raw_add<1>;
+    b["raw_m2"] = raw_add<2>;
+    b["raw_m3"] = raw_add<3>;
+    b["method0"] = loop(L, "f(o)");
+    b["method1"] = loop(L, "f(o, 1)");
+    b["method2"] = loop(L, "f(o, 1, 2)");
+    b["method3"] = loop(L, "f(o, 1, 2, 3)");
+    b["field_get"] = loop(L, "local x = o.v");
+    b["field_set"] = loop(L, "o.v = i");
+    b["lp_make"] = function(make_counter);
+    b["raw_make"] = raw_make_counter;
+    b["make"] = loop(L, "f(i)");
+    luaL_newmetatable(L, "raw_counter_value");
+    lua_pop(L, 1);
+
+    const char *raw_names[] = { "raw_counter", "raw_counter_adopt" };
+    for (int i = 0; i < 2; i++)
+    {
+      luaL_newmetatable(L, raw_names[i]);
+      lua_pushcfunction(L, raw_index);
+      lua_setfield(L, -2, "__index");
+      lua_pushcfunction(L, raw_newindex);
+      lua_setfield(L, -2, "__newindex");
+      lua_pushcfunction(L, raw_gc);
+      lua_setfield(L, -2, "__gc");
+      lua_pushboolean(L, i == 1);
+      lua_setfield(L, -2, "adopt");
+      lua_pop(L, 1);
+    }
+    b["lp_obj"] = object(L, &shared_counter);
+    raw_push(L, &shared_counter, false);
+    b["raw_obj"] = object(from_stack(L, -1));
+    lua_pop(L, 1);
+
+    // method dispatch (raw: __index is the method table)
+    static meter shared_meter;
+    object mc = newclass<meter>(L, "meter");
+    mc["get"] = method(meter::get);
+    b["lp_meter"] = object(L, &shared_meter);
+    *(counter **)lua_newuserdata(L, sizeof(counter *)) = &shared_counter;
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushcfunction(L, raw_get);
+    lua_setfield(L, -2, "get");
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    b["raw_meter"] = object(from_stack(L, -1));
+    lua_pop(L, 1);
+    b["dispatch"] = loop(L, "o:get()");
+
+    // proxy chains
+    g["a"] = newtable(L);
+    g["a"]["b"] = newtable(L);
+    g["a"]["b"]["c"] = 1;
+
+    // iteration source
+    object t = newtable(L);
+    for (int i = 1; i <= iter_table_size; i++) { t[i] = i; }
+    b["iter_src"] = t;
+
+    // json documents
+    make_json_doc();
+    b["json_src"] = json_decode(L, json_doc);
+
+    // callbacks
+    luaL_dostring(L, "bench.callback = function(a, b) return a + b end");
+    luaL_dostring(L, "bench.callback1 = function(a) return a * 2 end");
+  }
+
+  inline void run_all(lua_State *L)
+  {
+    const long calls = 2000000;
+    const long casts = 1000000;
+    const long pushes = 200000;
+
+    run(L, "call/free/0", calls, lp_call_0, raw_call_0);
+    run(L, "call/free/1", calls, lp_call_1, raw_call_1);
+    run(L, "call/free/2", calls, lp_call_2, raw_call_2);
+    run(L, "call/free/3", calls, lp_call_3, raw_call_3);
+    run(L, "call/free/4", calls, lp_call_4, raw_call_4);
+    run(L, "call/free/5", calls, lp_call_5, raw_call_5);
+    run(L, "call/free/6", calls, lp_call_6, raw_call_6);
+    run(L, "call/free/7", calls, lp_call_7, raw_call_7);
+    run(L, "call/overload/2", calls, lp_call_overload, raw_call_overload);
+    run(L, "call/closure/2", calls, lp_call_closure, raw_call_closure);
+    run(L, "call/many/64", calls, lp_call_many, raw_call_many);
+    run(L, "call/many_shared/64", calls, lp_call_many_shared, raw_call_many);
+    run(L, "call/multi/3", calls, lp_call_multi, raw_call_multi);
+
+    run(L, "call/method/0", calls, lp_method_0, raw_method_0);
+    run(L, "call/method/1", calls, lp_method_1, raw_method_1);
+    run(L, "call/method/2", calls, lp_method_2, raw_method_2);
+    run(L, "call/method/3", calls, lp_method_3, raw_method_3);
+
+    run(L, "field/get", calls, lp_field_get, raw_field_get);
+    run(L, "field/set", calls, lp_field_set, raw_field_set);
+    run(L, "dispatch/method", calls, lp_dispatch, raw_dispatch);
+
+    if (selected("cast/"))
+    {
+      set_cast_src(L, true);
+      run(L, "cast/bool", casts, lp_cast<bool>, raw_cast<bool>);
+      set_cast_src(L, 42);
+      run(L, "cast/int", casts, lp_cast<int>, raw_cast<int>);
+      run(L, "cast/long", casts, lp_cast<long>, raw_cast<long>);
+      set_cast_src(L, 0.5);
+      run(L, "cast/double", casts, lp_cast<double>, raw_cast<double>);
+      set_cast_src(L, std::string("a short string"));
+      run(L, "cast/string", casts,
+          lp_cast<std::string>, raw_cast<std::string>);
+      set_cast_src(L, object(L, &shared_counter));
+      run(L, "cast/instance", casts,
+          lp_cast<counter *>, raw_cast<counter *>);
+    }
+
+    run(L, "push/instance", pushes, lp_push, raw_push_ref);
+    run(L, "push/instance_adopt", pushes, lp_push_adopt, raw_push_adopt);
+    run(L, "return/value", pushes, lp_return_value, raw_return_value);
+
+    run(L, "proxy/get3", casts, lp_proxy_get, raw_proxy_get);
+    run(L, "proxy/set3", casts, lp_proxy_set, raw_proxy_set);
+
+    run(L, "iterator/element", casts, lp_iterate, raw_iterate);
+
+    run(L, "callback/2", casts, lp_callback, raw_callback);
+    run(L, "callback/batch", casts, lp_callback_batch, raw_callback_batch);
+
+    // per document of json_records records
+    run(L, "json/decode", pushes / 20, lp_json_decode, raw_json_decode);
+    run_native(L, "json/decode", pushes / 20, native_json_decode);
+    run(L, "json/encode", pushes / 20, lp_json_encode, raw_json_encode);
+  }
+
+} // namespace bench
+
+
+int main(int argc, char **argv)
+{
+  if (argc > 1) { bench::filter = argv[1]; }
+  if (argc > 2) { bench::scale = std::atof(argv[2]); }
+
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  try {
+    bench::setup(L);
+    bench::run_all(L);
+  }
+  catch (std::exception &e) {
+    std::fprintf(stderr, "error: %s\n", e.what());
+    lua_close(L);
+    return 1;
+  }
+  lua_close(L);
+  return 0;
+}
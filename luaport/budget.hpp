@@ -0,0 +1,178 @@
+#ifndef _LUAPORT_BUDGET_HPP
+#define _LUAPORT_BUDGET_HPP
+
+/////////////////////////////////////////////////////////////////////////////
+/// @file        budget.hpp
+/// @brief       instruction budgets and deadlines of script execution
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @author      spinor (\@tplantd)
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+//
+// usage:
+//   {
+//     luaport::budget b(L, 1000000, 0.05); // 1M instructions or 50 ms
+//     f.push();
+//     b.pcall(0, 1);                      // throws luaport::timeout
+//   }
+// the limits are checked by a count hook installed only while a budget
+// exists, so execution without budget costs nothing. coroutines created
+// by the thread while its budget exists inherit the hook and are charged
+// to the innermost budget alive (budgets nest as C++ scopes do). with
+// time slicing, a coroutine exhausting the instruction count yields
+// (resume returns no values) and gets a new slice when it is resumed,
+// deadlines always raise the error.
+// deadlines are wall time with C++11 (steady_clock), but the processor
+// time of the process (std::clock) otherwise: time spent blocked or
+// sleeping is not counted without C++11.
+
+#include "luaport.hpp"
+
+namespace luaport
+{
+
+  /// thrown by budget::pcall when the budget is exceeded
+  class timeout : public luaport::exception
+  {
+    public:
+      timeout(const std::string &msg) : luaport::exception(msg) { }
+  };
+
+
+  /// limits of the execution on the lua thread (RAII)
+  /**
+   * installs a count hook on the thread, and restores the previous hook on
+   * destruction. an exceeded budget raises a lua error (catchable with
+   * pcall, but raised again at the next check), or yields the running
+   * coroutine when time slicing is enabled.
+   */
+  class budget
+  {
+    public:
+      /// Constructor
+      /**
+       * @param L : lua thread (main thread or coroutine)
+       * @param instructions : instruction count (0 for unlimited)
+       * @param seconds : wall time from now (0 for unlimited), processor
+       *                  time without C++11
+       * @param slicing : instead of raising the error, coroutines yield
+       *                  each time they spend the instruction count
+       */
+      budget(lua_State *L, long instructions, double seconds = 0,
+             bool slicing = false)
+        : L(L), limit(instructions), executed(0), slice_start(0),
+          has_deadline(seconds > 0), slicing(slicing), over(false),
+          prev((budget *)detail::get_thread_object(L, budgets(), L)),
+          outer((budget *)detail::get_thread_object(L, budgets(), NULL)),
+          prev_hook(lua_gethook(L)), prev_mask(lua_gethookmask(L)),
+          prev_count(lua_gethookcount(L))
+      {
+        if (has_deadline) { deadline = detail::clock_seconds() + seconds; }
+        // the deadline is checked every 1000 instructions
+        period = 1000;
+        if (limit > 0 && limit < period) { period = (int)limit; }
+        detail::set_thread_object(L, budgets(), L, this);
+        detail::set_thread_object(L, budgets(), NULL, this);
+        lua_sethook(L, hook, LUA_MASKCOUNT, period);
+      }
+
+      ~budget()
+      {
+        // the budget of an outer scope on the same thread is charged again
+        detail::set_thread_object(L, budgets(), L, prev);
+        detail::set_thread_object(L, budgets(), NULL, outer);
+        lua_sethook(L, prev_hook, prev_mask, prev_count);
+      }
+
+      /// number of instructions executed so far (by the count of the hook)
+      long instructions() const { return executed; }
+
+      /// whether the budget has been exceeded
+      bool exceeded() const { return over; }
+
+      /// lua_pcall throwing luaport::timeout when the budget is exceeded
+      /**
+       * timeout is thrown also when the script caught the error itself.
+       * on other errors throws luaport::exception with the error message.
+       * in both cases the error object (or the results) are popped.
+       * @param nargs : number of arguments on the stack
+       * @param nresults : number of results (LUA_MULTRET allowed)
+       */
+      void pcall(int nargs, int nresults)
+      {
+        int base = lua_gettop(L) - nargs - 1;
+        if (lua_pcall(L, nargs, nresults, 0) == LUA_OK)
+        {
+          // the script may have caught the error with pcall
+          if (! over) { return; }
+          lua_settop(L, base);
+          throw luaport::timeout("timeout: budget exceeded");
+        }
+        const char *msg = lua_tostring(L, -1);
+        std::string err = msg ? msg : "(error object is not a string)";
+        lua_pop(L, 1);
+        if (over) { throw luaport::timeout(err); }
+        throw luaport::exception(err);
+      }
+
+    private:
+      budget(const budget &);
+      budget& operator=(const budget &);
+
+      // registry[&budgets] is the table of thread -> budget
+      // (see detail::set_thread_object)
+      static char *budgets()
+      {
+        static char tag;
+        return &tag;
+      }
+
+      static void hook(lua_State *L, lua_Debug *ar)
+      {
+        if (ar->event != LUA_HOOKCOUNT) { return; }
+        // coroutines inheriting the hook are charged to the innermost budget
+        budget *b = (budget *)detail::find_thread_object(L, budgets());
+        if (! b) { return; }
+        b->executed += b->period;
+        if (b->has_deadline && detail::clock_seconds() >= b->deadline)
+        {
+          b->over = true;
+          luaL_error(L, "timeout: deadline exceeded");
+          return;
+        }
+        if (b->limit > 0 && b->executed - b->slice_start >= b->limit)
+        {
+          int main = lua_pushthread(L);
+          lua_pop(L, 1);
+          if (b->slicing && ! main)
+          {
+            // next slice starts when the coroutine is resumed
+            b->slice_start = b->executed;
+            lua_yield(L, 0);
+            return;
+          }
+          b->over = true;
+          luaL_error(L, "timeout: instruction budget exceeded");
+        }
+      }
+
+      lua_State *L;
+      long limit;
+      long executed;
+      long slice_start;
+      int period;
+      bool has_deadline;
+      double deadline;
+      bool slicing;
+      bool over;
+      budget *prev;
+      budget *outer;
+      lua_Hook prev_hook;
+      int prev_mask;
+      int prev_count;
+  };
+
+} // namespace luaport
+
+#endif // _LUAPORT_BUDGET_HPP
@@ -0,0 +1,499 @@
+#ifndef _LUAPORT_CHANNEL_HPP
+#define _LUAPORT_CHANNEL_HPP
+
+/////////////////////////////////////////////////////////////////////////////
+/// @file        channel.hpp
+/// @brief       lock-free channels passing lua values between interpreters
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @author      spinor (\@tplantd)
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+//
+// values are encoded once by the serializer (serialize.hpp) on send and
+// decoded directly onto the stack of the receiver. channels are shared by
+// std::shared_ptr, e.g.
+//   std::shared_ptr<channel> ch = std::make_shared<channel>(1024);
+//   globals(L1)["ch"] = object(L1, ch);
+//   globals(L2)["ch"] = object(L2, ch);
+// lua methods (after open_channel):
+//   channel.new(capacity) -> channel
+//   ch:send(value)       blocks while the channel is full
+//   ch:try_send(value)   -> boolean
+//   ch:recv()            blocks until a value arrives, nil if closed
+//   ch:poll()            -> true, value | false
+//   ch:wait()            yields the running coroutine until a value arrives
+//                        (blocks on the main thread), nil if closed
+//   ch:close(), ch:size(), ch:closed()
+
+#if __cplusplus < 201103L
+#  error "luaport/channel.hpp requires C++11"
+#endif
+
+// standard headers first, as luaport.hpp defines function(func) macro
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "serialize.hpp"
+
+namespace luaport
+{
+
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // bounded multi-producer multi-consumer queue (D. Vyukov's algorithm),
+    // each cell has a sequence number telling whose turn it is
+    template <typename T>
+      class mpmc_queue
+    {
+      public:
+        explicit mpmc_queue(std::size_t capacity)
+          : mask(0), enqueue_pos(0), dequeue_pos(0)
+        {
+          std::size_t n = 2;
+          while (n < capacity) { n <<= 1; }
+          mask = n - 1;
+          cells.reset(new cell[n]);
+          for (std::size_t i = 0; i < n; i++)
+          {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+          }
+        }
+
+        bool try_push(T &val)
+        {
+          cell *c;
+          std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+          for (;;)
+          {
+            c = &cells[pos & mask];
+            std::size_t seq = c->seq.load(std::memory_order_acquire);
+            std::ptrdiff_t dif = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+            if (dif == 0)
+            {
+              if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+              {
+                break;
+              }
+            }
+            else if (dif < 0)
+            {
+              return false; // full
+            }
+            else
+            {
+              pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+          }
+          c->data = std::move(val);
+          c->seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+
+        bool try_pop(T &val)
+        {
+          cell *c;
+          std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+          for (;;)
+          {
+            c = &cells[pos & mask];
+            std::size_t seq = c->seq.load(std::memory_order_acquire);
+            std::ptrdiff_t dif = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+            if (dif == 0)
+            {
+              if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+              {
+                break;
+              }
+            }
+            else if (dif < 0)
+            {
+              return false; // empty
+            }
+            else
+            {
+              pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+          }
+          val = std::move(c->data);
+          c->seq.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+
+        std::size_t size() const
+        {
+          std::size_t e = enqueue_pos.load(std::memory_order_relaxed);
+          std::size_t d = dequeue_pos.load(std::memory_order_relaxed);
+          return e > d ? e - d : 0;
+        }
+
+        std::size_t capacity() const { return mask + 1; }
+
+      private:
+        struct cell
+        {
+          std::atomic<std::size_t> seq;
+          T data;
+        };
+
+        mpmc_queue(const mpmc_queue &);
+        mpmc_queue& operator=(const mpmc_queue &);
+
+        std::unique_ptr<cell[]> cells;
+        std::size_t mask;
+        // producers and consumers on separate cache lines, padded rather
+        // than aligned (alignas isn't honored by make_shared before C++17)
+        char pad0[64];
+        std::atomic<std::size_t> enqueue_pos;
+        char pad1[64 - sizeof(std::atomic<std::size_t>)];
+        std::atomic<std::size_t> dequeue_pos;
+        char pad2[64 - sizeof(std::atomic<std::size_t>)];
+    };
+
+    // spin, then yield, then sleep while waiting on the queue
+    class backoff
+    {
+      public:
+        backoff() : count(0) { }
+
+        void operator()()
+        {
+          if (count < 64) { }
+          else if (count < 128) { std::this_thread::yield(); }
+          else
+          {
+            std::this_thread::sleep_for(std::chrono::microseconds(
+              count < 1024 ? 10 : 200));
+          }
+          count++;
+        }
+
+      private:
+        int count;
+    };
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+
+  /// channel of lua values between interpreters
+  /**
+   * bounded lock-free MPMC queue of encoded values. any number of threads
+   * and interpreters may send and receive at the same time.
+   */
+  class channel
+  {
+    public:
+      /// Constructor
+      /**
+       * @param capacity : maximum number of queued values (rounded up to
+       *                   a power of 2)
+       */
+      explicit channel(std::size_t capacity = 1024)
+        : queue(capacity), is_closed(false)
+      { }
+
+      /// send the value at the stack index without waiting
+      /**
+       * @return false if the channel is full or closed
+       */
+      bool try_send(lua_State *L, int idx)
+      {
+        if (closed()) { return false; }
+        std::string msg = encode(L, idx);
+        return queue.try_push(msg);
+      }
+
+      /// @overload
+      bool try_send(const object &obj)
+      {
+        lua_State *L = obj.interpreter();
+        if (! L) { throw luaport::exception("given invalid interpreter"); }
+        obj.push();
+        bool sent;
+        try {
+          sent = try_send(L, -1);
+        }
+        catch (...) {
+          lua_pop(L, 1);
+          throw;
+        }
+        lua_pop(L, 1);
+        return sent;
+      }
+
+      /// send the value at the stack index, waiting while the channel is full
+      /**
+       * throws luaport::exception if the channel is closed
+       */
+      void send(lua_State *L, int idx)
+      {
+        std::string msg = encode(L, idx);
+        detail::backoff wait;
+        for (;;)
+        {
+          if (closed()) { throw luaport::exception("error on channel::send - closed channel"); }
+          if (queue.try_push(msg)) { return; }
+          wait();
+        }
+      }
+
+      /// @overload
+      void send(const object &obj)
+      {
+        lua_State *L = obj.interpreter();
+        if (! L) { throw luaport::exception("given invalid interpreter"); }
+        obj.push();
+        try {
+          send(L, -1);
+        }
+        catch (...) {
+          lua_pop(L, 1);
+          throw;
+        }
+        lua_pop(L, 1);
+      }
+
+      /// push the next value onto the stack without waiting
+      /**
+       * @return false (pushing nothing) if the channel is empty
+       */
+      bool try_recv(lua_State *L)
+      {
+        std::string msg;
+        if (! queue.try_pop(msg)) { return false; }
+        string_source in(msg);
+        detail::deserializer(L, in).run();
+        return true;
+      }
+
+      /// push the next value, waiting until one arrives
+      /**
+       * @return false (pushing nothing) if the channel is closed and empty
+       */
+      bool recv(lua_State *L)
+      {
+        detail::backoff wait;
+        for (;;)
+        {
+          if (try_recv(L)) { return true; }
+          if (closed() && queue.size() == 0) { return try_recv(L); }
+          wait();
+        }
+      }
+
+      /// @overload
+      /**
+       * @return received value (nil if the channel is closed and empty)
+       */
+      object recv_object(lua_State *L)
+      {
+        if (! recv(L)) { return object(L); }
+        object result = from_stack(L, -1);
+        lua_pop(L, 1);
+        return result;
+      }
+
+      /// reject further sends, queued values can still be received
+      void close() { is_closed.store(true, std::memory_order_release); }
+
+      bool closed() const { return is_closed.load(std::memory_order_acquire); }
+
+      /// number of queued values (approximate under concurrent use)
+      std::size_t size() const { return queue.size(); }
+
+      std::size_t capacity() const { return queue.capacity(); }
+
+    private:
+      channel(const channel &);
+      channel& operator=(const channel &);
+
+      static std::string encode(lua_State *L, int idx)
+      {
+        std::string msg;
+        string_sink out(msg);
+        detail::serializer(L, out).run(idx);
+        return msg;
+      }
+
+      detail::mpmc_queue<std::string> queue;
+      std::atomic<bool> is_closed;
+  };
+
+
+  /// register channel class (channel.new and the methods) in globals
+  /**
+   * @param L : lua interpreter (luaport::open should be called already)
+   * @return the class object
+   */
+  extern object open_channel(lua_State *L);
+
+
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    inline channel *lua_check_channel(lua_State *L)
+    {
+      return object_cast<channel *>(object(from_stack(L, 1)));
+    }
+
+    // argument checks raising lua errors, made out of the try block
+    template <int N>
+      inline void lua_channel_check_args(lua_State *L)
+    {
+      for (int i = 1; i <= N; i++) { luaL_checkany(L, i); }
+    }
+
+    inline void lua_channel_check_capacity(lua_State *L)
+    {
+      if (luaL_optinteger(L, 1, 1024) < 1)
+      {
+        luaL_argerror(L, 1, "positive capacity expected");
+      }
+    }
+
+    // lua_CFunction body catching C++ exceptions as lua errors
+    template <int (*F)(lua_State *), void (*Check)(lua_State *)>
+      inline int lua_channel_call(lua_State *L)
+    {
+      Check(L);
+      try {
+        return F(L);
+      }
+      catch (std::exception &e) {
+        lua_pushstring(L, e.what());
+      }
+      return lua_error(L);
+    }
+
+    inline int lua_channel_new(lua_State *L)
+    {
+      lua_Integer n = luaL_optinteger(L, 1, 1024);
+      push(L, std::make_shared<channel>((std::size_t)n));
+      return 1;
+    }
+
+    inline int lua_channel_send(lua_State *L)
+    {
+      lua_check_channel(L)->send(L, 2);
+      return 0;
+    }
+
+    inline int lua_channel_try_send(lua_State *L)
+    {
+      lua_pushboolean(L, lua_check_channel(L)->try_send(L, 2));
+      return 1;
+    }
+
+    inline int lua_channel_recv(lua_State *L)
+    {
+      if (! lua_check_channel(L)->recv(L)) { lua_pushnil(L); }
+      return 1;
+    }
+
+    inline int lua_channel_poll(lua_State *L)
+    {
+      lua_pushboolean(L, 1);
+      if (lua_check_channel(L)->try_recv(L)) { return 2; }
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+
+    inline int lua_channel_wait(lua_State *L);
+
+#if LUA_VERSION_NUM >= 503
+    inline int lua_channel_wait_k(lua_State *L, int, lua_KContext)
+#else
+    inline int lua_channel_wait_k(lua_State *L)
+#endif
+    {
+      // the resume arguments are dropped
+      lua_settop(L, 1);
+      return lua_channel_wait(L);
+    }
+
+    // pushes the value and returns 1, or returns 0 if it should yield
+    inline int lua_channel_wait_step(lua_State *L)
+    {
+      channel *ch = lua_check_channel(L);
+      if (ch->try_recv(L)) { return 1; }
+      if (ch->closed() && ch->size() == 0)
+      {
+        lua_pushnil(L);
+        return 1;
+      }
+      // blocks on the main thread, which can't yield
+      int main = lua_pushthread(L);
+      lua_pop(L, 1);
+      if (main)
+      {
+        if (! ch->recv(L)) { lua_pushnil(L); }
+        return 1;
+      }
+      return 0;
+    }
+
+    inline int lua_channel_wait(lua_State *L)
+    {
+      // lua_yieldk must not be called inside of the try block
+      int status;
+      std::string msg;
+      try {
+        status = lua_channel_wait_step(L);
+      }
+      catch (std::exception &e) {
+        msg = e.what();
+        status = -1;
+      }
+      if (status < 0) { return luaL_error(L, "%s", msg.c_str()); }
+      if (status > 0) { return 1; }
+      return lua_yieldk(L, 0, 0, lua_channel_wait_k);
+    }
+
+    inline int lua_channel_close(lua_State *L)
+    {
+      lua_check_channel(L)->close();
+      return 0;
+    }
+
+    inline int lua_channel_closed(lua_State *L)
+    {
+      lua_pushboolean(L, lua_check_channel(L)->closed());
+      return 1;
+    }
+
+    inline int lua_channel_size(lua_State *L)
+    {
+      lua_pushinteger(L, (lua_Integer)lua_check_channel(L)->size());
+      return 1;
+    }
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+
+  inline object open_channel(lua_State *L)
+  {
+    object c = newclass<channel>(L, "channel");
+    c["new"] = lua_channel_call<lua_channel_new, lua_channel_check_capacity>;
+    c["send"] = lua_channel_call<lua_channel_send, lua_channel_check_args<2> >;
+    c["try_send"] = lua_channel_call<lua_channel_try_send, lua_channel_check_args<2> >;
+    c["recv"] = lua_channel_call<lua_channel_recv, lua_channel_check_args<1> >;
+    c["poll"] = lua_channel_call<lua_channel_poll, lua_channel_check_args<1> >;
+    c["wait"] = lua_channel_wait;
+    c["close"] = lua_channel_call<lua_channel_close, lua_channel_check_args<1> >;
+    c["closed"] = lua_channel_call<lua_channel_closed, lua_channel_check_args<1> >;
+    c["size"] = lua_channel_call<lua_channel_size, lua_channel_check_args<1> >;
+    globals(L)["channel"] = c;
+    return c;
+  }
+
+} // namespace luaport
+
+#endif // _LUAPORT_CHANNEL_HPP
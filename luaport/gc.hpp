@@ -0,0 +1,274 @@
+#ifndef _LUAPORT_GC_HPP
+#define _LUAPORT_GC_HPP
+
+/////////////////////////////////////////////////////////////////////////////
+/// @file        gc.hpp
+/// @brief       garbage collection controller with pause instrumentation
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @author      spinor (\@tplantd)
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+//
+// usage (collecting only while idle):
+//   luaport::gc_controller gc(L);
+//   gc.stop();                 // no automatic steps in request handling
+//   ...
+//   gc.idle(0.002);            // in the event loop, when there is no work
+//   std::string stats = gc.to_json();
+
+#include "luaport.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+namespace luaport
+{
+
+  /// histogram with power of 2 buckets
+  /**
+   * bucket 0 counts values below 1, bucket i (i > 0) counts values in
+   * [2^(i-1), 2^i).
+   */
+  class histogram
+  {
+    public:
+      static const int nbuckets = 64;
+
+      histogram() { clear(); }
+
+      void clear()
+      {
+        for (int i = 0; i < nbuckets; i++) { buckets[i] = 0; }
+        n = 0;
+        total = 0;
+        lo = 0;
+        hi = 0;
+      }
+
+      void record(double value)
+      {
+        int i = 0;
+        if (value >= 1)
+        {
+          int e;
+          std::frexp(value, &e);
+          i = e < nbuckets ? e : nbuckets - 1;
+        }
+        buckets[i]++;
+        if (n == 0 || value < lo) { lo = value; }
+        if (n == 0 || value > hi) { hi = value; }
+        n++;
+        total += value;
+      }
+
+      unsigned long count() const { return n; }
+      double sum() const { return total; }
+      double min() const { return lo; }
+      double max() const { return hi; }
+      double mean() const { return n ? total / n : 0; }
+
+      /// count of the bucket
+      unsigned long bucket(int i) const { return buckets[i]; }
+
+      /// upper bound of the bucket
+      static double bound(int i) { return std::ldexp(1.0, i); }
+
+      /// upper bound of the bucket containing the percentile
+      /**
+       * @param p : percentile (0 - 100)
+       */
+      double percentile(double p) const
+      {
+        if (n == 0) { return 0; }
+        unsigned long rank = (unsigned long)std::ceil(p / 100 * n);
+        if (rank == 0) { rank = 1; }
+        unsigned long seen = 0;
+        for (int i = 0; i < nbuckets; i++)
+        {
+          seen += buckets[i];
+          if (seen >= rank) { return bound(i) < hi ? bound(i) : hi; }
+        }
+        return hi;
+      }
+
+      /// JSON representation {"count", "sum", "min", "max", "p50", "p99",
+      /// "p999", "buckets": [[upper bound, count], ...]}
+      std::string to_json() const
+      {
+        char buf[256];
+        std::sprintf(buf, "{\"count\": %lu, \"sum\": %.17g, \"min\": %.17g, "
+                     "\"max\": %.17g, \"p50\": %.17g, \"p99\": %.17g, "
+                     "\"p999\": %.17g, \"buckets\": [",
+                     n, total, lo, hi, percentile(50), percentile(99),
+                     percentile(99.9));
+        std::string json = buf;
+        bool first = true;
+        for (int i = 0; i < nbuckets; i++)
+        {
+          if (buckets[i] == 0) { continue; }
+          std::sprintf(buf, "%s[%.17g, %lu]", first ? "" : ", ",
+                       bound(i), buckets[i]);
+          json += buf;
+          first = false;
+        }
+        return json + "]}";
+      }
+
+    private:
+      unsigned long buckets[nbuckets];
+      unsigned long n;
+      double total;
+      double lo;
+      double hi;
+  };
+
+
+  /// controller of the garbage collection of the interpreter
+  /**
+   * runs the collector in bounded steps at the times the host chooses, and
+   * records the duration of each step (in microseconds) and the heap size
+   * after it (in kilobytes).
+   */
+  class gc_controller
+  {
+    public:
+      gc_controller(lua_State *L) : L(L), cycles(0) { }
+
+      /// stop the automatic collection (steps only through this controller)
+      void stop() { lua_gc(L, LUA_GCSTOP, 0); }
+
+      /// restart the automatic collection
+      void restart() { lua_gc(L, LUA_GCRESTART, 0); }
+
+      /// switch to the generational mode
+      /**
+       * @return false if the lua version doesn't support it
+       */
+      bool generational()
+      {
+#ifdef LUA_GCGEN
+        lua_gc(L, LUA_GCGEN, 0);
+        return true;
+#else
+        return false;
+#endif
+      }
+
+      /// switch to the incremental mode
+      /**
+       * @return false if the lua version doesn't support switching modes
+       */
+      bool incremental()
+      {
+#ifdef LUA_GCINC
+        lua_gc(L, LUA_GCINC, 0);
+        return true;
+#else
+        return false;
+#endif
+      }
+
+      /// set the pause and the step multiplier of the incremental mode
+      /**
+       * @param pause : percentage of the heap growth before a new cycle
+       *                (negative to leave it unchanged)
+       * @param stepmul : speed of the collector relative to the allocation
+       *                  (negative to leave it unchanged)
+       */
+      void tune(int pause, int stepmul)
+      {
+        if (pause >= 0) { lua_gc(L, LUA_GCSETPAUSE, pause); }
+        if (stepmul >= 0) { lua_gc(L, LUA_GCSETSTEPMUL, stepmul); }
+      }
+
+      /// run one incremental step
+      /**
+       * @param kbytes : amount of work (0 for one basic step)
+       * @return true if the step finished a collection cycle
+       */
+      bool step(int kbytes = 0)
+      {
+        double t0 = now();
+        bool done = lua_gc(L, LUA_GCSTEP, kbytes) != 0;
+        pause_us.record((now() - t0) * 1e6);
+        heap_kb.record(heap_bytes() / 1024.0);
+        if (done) { cycles++; }
+        return done;
+      }
+
+      /// run incremental steps during the idle window
+      /**
+       * stops after the time is used up or at the end of a cycle. a step
+       * started before the end is not interrupted.
+       * @param seconds : length of the idle window
+       * @param kbytes : amount of work per step
+       * @return true if a collection cycle finished
+       */
+      bool idle(double seconds, int kbytes = 0)
+      {
+        double end = now() + seconds;
+        do
+        {
+          if (step(kbytes)) { return true; }
+        } while (now() < end);
+        return false;
+      }
+
+      /// run a full collection (recorded as one step)
+      void full()
+      {
+        double t0 = now();
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        pause_us.record((now() - t0) * 1e6);
+        heap_kb.record(heap_bytes() / 1024.0);
+        cycles++;
+      }
+
+      /// current heap size of the interpreter
+      std::size_t heap_bytes() const
+      {
+        return (std::size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+               (std::size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+      }
+
+      /// step durations in microseconds
+      const histogram &pauses() const { return pause_us; }
+
+      /// heap sizes after steps in kilobytes
+      const histogram &heap() const { return heap_kb; }
+
+      /// number of finished cycles
+      unsigned long finished_cycles() const { return cycles; }
+
+      /// clear the histograms and the counter
+      void reset_stats()
+      {
+        pause_us.clear();
+        heap_kb.clear();
+        cycles = 0;
+      }
+
+      /// JSON representation {"heap_bytes", "cycles", "pause_us": {...},
+      /// "heap_kb": {...}}
+      std::string to_json() const
+      {
+        char buf[96];
+        std::sprintf(buf, "{\"heap_bytes\": %lu, \"cycles\": %lu, ",
+                     (unsigned long)heap_bytes(), cycles);
+        return std::string(buf) + "\"pause_us\": " + pause_us.to_json() +
+               ", \"heap_kb\": " + heap_kb.to_json() + "}";
+      }
+
+    private:
+      static double now() { return detail::clock_seconds(); }
+
+      lua_State *L;
+      histogram pause_us;
+      histogram heap_kb;
+      unsigned long cycles;
+  };
+
+} // namespace luaport
+
+#endif // _LUAPORT_GC_HPP
@@ -0,0 +1,776 @@
+#ifndef _LUAPORT_JSON_HPP
+#define _LUAPORT_JSON_HPP
+
+/////////////////////////////////////////////////////////////////////////////
+/// @file        json.hpp
+/// @brief       JSON decoder/encoder building lua values directly
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @author      spinor (\@tplantd)
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+//
+// mapping:
+//   object <-> table with string keys
+//   array  <-> sequence table (empty tables are encoded as {})
+//   null   <-> light userdata NULL (json.null), nil is also encoded as null
+//   number <-> number (integers without fraction/exponent are exact up to
+//              2^53, or within 64 bits as lua 5.3 integers)
+// the decoder rejects numbers with leading zeros, the encoder rejects
+// tables having both a number key and the same key as a string ([1] and
+// ["1"]) which would be written twice.
+//   true/false, string <-> boolean, string (UTF-8, \u escapes decoded)
+
+#include "luaport.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#  include <emmintrin.h>
+#  define LUAPORT_JSON_SSE2
+#endif
+
+namespace luaport
+{
+
+  /// decode JSON text into lua value
+  /**
+   * throws luaport::exception on syntax error
+   * @param L : lua interpreter
+   * @param data : JSON text
+   * @param len : length of data
+   * @return decoded value
+   */
+  extern object json_decode(lua_State *L, const char *data, size_t len);
+  /// @overload
+  extern object json_decode(lua_State *L, const std::string &text);
+
+  /// encode lua value into JSON text
+  /**
+   * throws luaport::exception for values having no JSON representation
+   * (functions, userdata, non-string/number keys, nan, inf, too deep or
+   * cyclic tables)
+   * @param obj : value to encode
+   * @param out : the text is appended to it
+   */
+  extern void json_encode(const object &obj, std::string &out);
+  /// @overload
+  /**
+   * @return JSON text
+   */
+  extern std::string json_encode(const object &obj);
+
+  /// register json table (json.decode, json.encode, json.null) in globals
+  /**
+   * @param L : lua interpreter
+   * @return the json table
+   */
+  extern object open_json(lua_State *L);
+
+
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    const int json_max_depth = 1000;
+    // number of elements collected on the stack to presize the table
+    const int json_batch = 32;
+
+    // returns the first position in [p, end) of '"', '\\' or a control
+    // character, or end
+    inline const char *json_scan_string(const char *p, const char *end)
+    {
+#ifdef LUAPORT_JSON_SSE2
+      const __m128i quote = _mm_set1_epi8('"');
+      const __m128i backslash = _mm_set1_epi8('\\');
+      const __m128i ctrl = _mm_set1_epi8(0x1f);
+      while (end - p >= 16)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+          _mm_cmpeq_epi8(_mm_max_epu8(x, ctrl), ctrl));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask)
+        {
+          return p + __builtin_ctz(mask);
+        }
+        p += 16;
+      }
+#endif
+      for (; p < end; p++)
+      {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\' || c < 0x20) { return p; }
+      }
+      return end;
+    }
+
+
+    class json_parser
+    {
+      public:
+        json_parser(lua_State *L, const char *data, size_t len)
+          : L(L), begin(data), p(data), end(data + len), depth(0)
+        { }
+
+        void run()
+        {
+          int top = lua_gettop(L);
+          try {
+            ws();
+            value();
+            ws();
+            if (p != end) { error("trailing characters"); }
+          }
+          catch (...) {
+            lua_settop(L, top);
+            throw;
+          }
+        }
+
+      private:
+        void error(const char *msg)
+        {
+          char pos[32];
+          std::sprintf(pos, "%lu", (unsigned long)(p - begin));
+          throw luaport::exception(std::string("error on json_decode - ") +
+                                   msg + " at offset " + pos);
+        }
+
+        void ws()
+        {
+          while (p < end &&
+                 (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+          {
+            p++;
+          }
+        }
+
+        void literal(const char *word, size_t len)
+        {
+          if ((size_t)(end - p) < len || std::memcmp(p, word, len) != 0)
+          {
+            error("invalid literal");
+          }
+          p += len;
+        }
+
+        static int hex(char c)
+        {
+          if (c >= '0' && c <= '9') { return c - '0'; }
+          if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+          if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+          return -1;
+        }
+
+        unsigned long codepoint()
+        {
+          if (end - p < 4) { error("invalid unicode escape"); }
+          unsigned long cp = 0;
+          for (int i = 0; i < 4; i++)
+          {
+            int h = hex(p[i]);
+            if (h < 0) { error("invalid unicode escape"); }
+            cp = (cp << 4) | h;
+          }
+          p += 4;
+          return cp;
+        }
+
+        void utf8(unsigned long cp)
+        {
+          if (cp < 0x80)
+          {
+            buf += (char)cp;
+          }
+          else if (cp < 0x800)
+          {
+            buf += (char)(0xc0 | (cp >> 6));
+            buf += (char)(0x80 | (cp & 0x3f));
+          }
+          else if (cp < 0x10000)
+          {
+            buf += (char)(0xe0 | (cp >> 12));
+            buf += (char)(0x80 | ((cp >> 6) & 0x3f));
+            buf += (char)(0x80 | (cp & 0x3f));
+          }
+          else
+          {
+            buf += (char)(0xf0 | (cp >> 18));
+            buf += (char)(0x80 | ((cp >> 12) & 0x3f));
+            buf += (char)(0x80 | ((cp >> 6) & 0x3f));
+            buf += (char)(0x80 | (cp & 0x3f));
+          }
+        }
+
+        void string()
+        {
+          p++; // skip '"'
+          const char *q = json_scan_string(p, end);
+          if (q < end && *q == '"')
+          {
+            // no escapes, push straight from the input
+            lua_pushlstring(L, p, q - p);
+            p = q + 1;
+            return;
+          }
+          buf.assign(p, q - p);
+          p = q;
+          for (;;)
+          {
+            if (p >= end) { error("unterminated string"); }
+            char c = *p;
+            if (c == '"')
+            {
+              p++;
+              break;
+            }
+            if ((unsigned char)c < 0x20) { error("control character in string"); }
+            // c == '\\'
+            if (++p >= end) { error("unterminated string"); }
+            switch (*p++)
+            {
+              case '"':  buf += '"'; break;
+              case '\\': buf += '\\'; break;
+              case '/':  buf += '/'; break;
+              case 'b':  buf += '\b'; break;
+              case 'f':  buf += '\f'; break;
+              case 'n':  buf += '\n'; break;
+              case 'r':  buf += '\r'; break;
+              case 't':  buf += '\t'; break;
+              case 'u':
+              {
+                unsigned long cp = codepoint();
+                if (cp >= 0xd800 && cp <= 0xdbff &&
+                    end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+                {
+                  p += 2;
+                  unsigned long lo = codepoint();
+                  if (lo >= 0xdc00 && lo <= 0xdfff)
+                  {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                  }
+                  else
+                  {
+                    utf8(cp);
+                    cp = lo;
+                  }
+                }
+                utf8(cp);
+                break;
+              }
+              default:
+                p--;
+                error("invalid escape");
+            }
+            q = json_scan_string(p, end);
+            buf.append(p, q - p);
+            p = q;
+          }
+          lua_pushlstring(L, buf.data(), buf.length());
+        }
+
+        void number()
+        {
+          const char *start = p;
+          bool neg = false;
+          if (*p == '-')
+          {
+            neg = true;
+            p++;
+          }
+          if (p >= end || *p < '0' || *p > '9') { error("invalid number"); }
+          if (*p == '0' && p + 1 < end && p[1] >= '0' && p[1] <= '9')
+          {
+            error("invalid number (leading zero)");
+          }
+          unsigned long long mant = 0;
+          int digits = 0;
+          while (p < end && *p >= '0' && *p <= '9')
+          {
+            mant = mant * 10 + (*p - '0');
+            digits++;
+            p++;
+          }
+          bool integral = true;
+          if (p < end && *p == '.')
+          {
+            integral = false;
+            p++;
+            if (p >= end || *p < '0' || *p > '9') { error("invalid number"); }
+            while (p < end && *p >= '0' && *p <= '9') { p++; }
+          }
+          if (p < end && (*p == 'e' || *p == 'E'))
+          {
+            integral = false;
+            p++;
+            if (p < end && (*p == '+' || *p == '-')) { p++; }
+            if (p >= end || *p < '0' || *p > '9') { error("invalid number"); }
+            while (p < end && *p >= '0' && *p <= '9') { p++; }
+          }
+#if LUA_VERSION_NUM >= 503
+          // integers of 64 bits (19 digits never overflow the mantissa)
+          if (integral && digits <= 19 &&
+              mant <= (neg ? 9223372036854775808ULL : 9223372036854775807ULL))
+          {
+            lua_pushinteger(L, neg ? (lua_Integer)(0 - mant) : (lua_Integer)mant);
+            return;
+          }
+#else
+          // fast path for integers fitting in 53 bits (strtod is exact
+          // for the longer ones up to 2^53 too)
+          if (integral && digits <= 15)
+          {
+            long long i = neg ? -(long long)mant : (long long)mant;
+            lua_pushnumber(L, (lua_Number)i);
+            return;
+          }
+#endif
+          char tmp[64];
+          size_t len = p - start;
+          if (len >= sizeof(tmp))
+          {
+            std::string s(start, len);
+            lua_pushnumber(L, std::strtod(s.c_str(), NULL));
+            return;
+          }
+          std::memcpy(tmp, start, len);
+          tmp[len] = '\0';
+          lua_pushnumber(L, std::strtod(tmp, NULL));
+        }
+
+        void array()
+        {
+          p++; // skip '['
+          ws();
+          if (p < end && *p == ']')
+          {
+            p++;
+            lua_createtable(L, 0, 0);
+            return;
+          }
+          // the first elements are kept on the stack so that small arrays
+          // are created with the exact size
+          int base = lua_gettop(L);
+          int t = 0;
+          int n = 0;
+          for (;;)
+          {
+            value();
+            n++;
+            if (t)
+            {
+              lua_rawseti(L, t, n);
+            }
+            else if (n == json_batch)
+            {
+              lua_createtable(L, json_batch * 4, 0);
+              lua_insert(L, base + 1);
+              t = base + 1;
+              for (int i = n; i >= 1; i--) { lua_rawseti(L, t, i); }
+            }
+            ws();
+            if (p >= end) { error("unterminated array"); }
+            if (*p == ',')
+            {
+              p++;
+              ws();
+              continue;
+            }
+            if (*p == ']')
+            {
+              p++;
+              break;
+            }
+            error("expected ',' or ']'");
+          }
+          if (! t)
+          {
+            lua_createtable(L, n, 0);
+            lua_insert(L, base + 1);
+            for (int i = n; i >= 1; i--) { lua_rawseti(L, base + 1, i); }
+          }
+        }
+
+        // sets the pairs above t in order (later duplicated keys win)
+        void flush_pairs(int t)
+        {
+          int top = lua_gettop(L);
+          for (int i = t + 1; i < top; i += 2)
+          {
+            lua_pushvalue(L, i);
+            lua_pushvalue(L, i + 1);
+            lua_rawset(L, t);
+          }
+          lua_settop(L, t);
+        }
+
+        void object()
+        {
+          p++; // skip '{'
+          ws();
+          if (p < end && *p == '}')
+          {
+            p++;
+            lua_createtable(L, 0, 0);
+            return;
+          }
+          int base = lua_gettop(L);
+          int t = 0;
+          int n = 0;
+          for (;;)
+          {
+            if (p >= end || *p != '"') { error("expected string key"); }
+            string();
+            ws();
+            if (p >= end || *p != ':') { error("expected ':'"); }
+            p++;
+            ws();
+            value();
+            n++;
+            if (t)
+            {
+              lua_rawset(L, t);
+            }
+            else if (n == json_batch)
+            {
+              lua_createtable(L, 0, json_batch * 4);
+              lua_insert(L, base + 1);
+              t = base + 1;
+              flush_pairs(t);
+            }
+            ws();
+            if (p >= end) { error("unterminated object"); }
+            if (*p == ',')
+            {
+              p++;
+              ws();
+              continue;
+            }
+            if (*p == '}')
+            {
+              p++;
+              break;
+            }
+            error("expected ',' or '}'");
+          }
+          if (! t)
+          {
+            lua_createtable(L, 0, n);
+            lua_insert(L, base + 1);
+            flush_pairs(base + 1);
+          }
+        }
+
+        void value()
+        {
+          if (++depth > json_max_depth) { error("nesting too deep"); }
+          // array/object batches need room for json_batch pairs
+          if (! lua_checkstack(L, json_batch * 2 + 8)) { error("stack overflow"); }
+          if (p >= end) { error("unexpected end of text"); }
+          switch (*p)
+          {
+            case '{': object(); break;
+            case '[': array(); break;
+            case '"': string(); break;
+            case 't': literal("true", 4); lua_pushboolean(L, 1); break;
+            case 'f': literal("false", 5); lua_pushboolean(L, 0); break;
+            case 'n': literal("null", 4); lua_pushlightuserdata(L, NULL); break;
+            default:  number(); break;
+          }
+          depth--;
+        }
+
+        lua_State *L;
+        const char *begin;
+        const char *p;
+        const char *end;
+        int depth;
+        std::string buf;
+    };
+
+
+    class json_writer
+    {
+      public:
+        json_writer(lua_State *L, std::string &out)
+          : L(L), out(out), depth(0)
+        { }
+
+        void run(int idx)
+        {
+          value(lua_absindex(L, idx));
+        }
+
+      private:
+        void error(const std::string &msg)
+        {
+          throw luaport::exception("error on json_encode - " + msg);
+        }
+
+        void string(int idx)
+        {
+          static const char hexdigits[] = "0123456789abcdef";
+          size_t len;
+          const char *p = lua_tolstring(L, idx, &len);
+          const char *end = p + len;
+          out += '"';
+          for (;;)
+          {
+            const char *q = json_scan_string(p, end);
+            out.append(p, q - p);
+            if (q == end) { break; }
+            unsigned char c = *q;
+            switch (c)
+            {
+              case '"':  out += "\\\""; break;
+              case '\\': out += "\\\\"; break;
+              case '\b': out += "\\b"; break;
+              case '\f': out += "\\f"; break;
+              case '\n': out += "\\n"; break;
+              case '\r': out += "\\r"; break;
+              case '\t': out += "\\t"; break;
+              default:
+                out += "\\u00";
+                out += hexdigits[c >> 4];
+                out += hexdigits[c & 0xf];
+            }
+            p = q + 1;
+          }
+          out += '"';
+        }
+
+        void number(int idx)
+        {
+          char tmp[64];
+#if LUA_VERSION_NUM >= 503
+          if (lua_isinteger(L, idx))
+          {
+            std::sprintf(tmp, "%lld", (long long)lua_tointeger(L, idx));
+            out += tmp;
+            return;
+          }
+#endif
+          double d = lua_tonumber(L, idx);
+          if (d != d || d - d != 0) { error("nan or inf"); }
+          if (d >= -9e15 && d <= 9e15 && d == (double)(long long)d)
+          {
+            std::sprintf(tmp, "%lld", (long long)d);
+          }
+          else
+          {
+            std::sprintf(tmp, "%.17g", d);
+          }
+          out += tmp;
+        }
+
+        // returns the length if the table is a non-empty sequence, else 0
+        size_t sequence(int idx)
+        {
+          size_t n = lua_rawlen(L, idx);
+          if (n == 0) { return 0; }
+          size_t count = 0;
+          lua_pushnil(L);
+          while (lua_next(L, idx))
+          {
+            lua_pop(L, 1);
+            if (++count > n)
+            {
+              lua_pop(L, 1);
+              return 0;
+            }
+          }
+          return count == n ? n : 0;
+        }
+
+        void table(int idx)
+        {
+          size_t n = sequence(idx);
+          if (n > 0)
+          {
+            out += '[';
+            for (size_t i = 1; i <= n; i++)
+            {
+              if (i > 1) { out += ','; }
+              lua_rawgeti(L, idx, i);
+              value(lua_gettop(L));
+              lua_pop(L, 1);
+            }
+            out += ']';
+            return;
+          }
+          out += '{';
+          bool first = true;
+          lua_pushnil(L);
+          while (lua_next(L, idx))
+          {
+            int k = lua_gettop(L) - 1;
+            if (! first) { out += ','; }
+            first = false;
+            switch (lua_type(L, k))
+            {
+              case LUA_TSTRING:
+                string(k);
+                break;
+              case LUA_TNUMBER:
+              {
+                // number keys become strings (keeping the key intact),
+                // which must not be a string key of the table as well
+                out += '"';
+                size_t start = out.size();
+                lua_pushvalue(L, k);
+                number(lua_gettop(L));
+                lua_pop(L, 1);
+                lua_pushlstring(L, out.data() + start, out.size() - start);
+                lua_rawget(L, idx);
+                bool duplicated = ! lua_isnil(L, -1);
+                lua_pop(L, 1);
+                if (duplicated)
+                {
+                  error("duplicated key \"" + out.substr(start) + "\"");
+                }
+                out += '"';
+                break;
+              }
+              default:
+                error(std::string("unable to encode key of type ") +
+                      luaL_typename(L, k));
+            }
+            out += ':';
+            value(k + 1);
+            lua_pop(L, 1);
+          }
+          out += '}';
+        }
+
+        void value(int idx)
+        {
+          if (++depth > json_max_depth) { error("nesting too deep (cyclic table?)"); }
+          luaL_checkstack(L, 4, "json_encode");
+          switch (lua_type(L, idx))
+          {
+            case LUA_TNIL:
+              out += "null";
+              break;
+            case LUA_TBOOLEAN:
+              out += lua_toboolean(L, idx) ? "true" : "false";
+              break;
+            case LUA_TNUMBER:
+              number(idx);
+              break;
+            case LUA_TSTRING:
+              string(idx);
+              break;
+            case LUA_TTABLE:
+              table(idx);
+              break;
+            case LUA_TLIGHTUSERDATA:
+              if (lua_touserdata(L, idx) == NULL)
+              {
+                out += "null";
+                break;
+              }
+              // fall through
+            default:
+              error(std::string("unable to encode ") + luaL_typename(L, idx));
+          }
+          depth--;
+        }
+
+        lua_State *L;
+        std::string &out;
+        int depth;
+    };
+
+
+    inline int lua_json_decode(lua_State *L)
+    {
+      size_t len;
+      const char *text = luaL_checklstring(L, 1, &len);
+      std::string msg;
+      try {
+        json_parser(L, text, len).run();
+        return 1;
+      }
+      catch (std::exception &e) {
+        msg = e.what();
+      }
+      return luaL_error(L, "%s", msg.c_str());
+    }
+
+
+    inline int lua_json_encode(lua_State *L)
+    {
+      luaL_checkany(L, 1);
+      std::string msg;
+      try {
+        std::string out;
+        json_writer(L, out).run(1);
+        lua_pushlstring(L, out.data(), out.length());
+        return 1;
+      }
+      catch (std::exception &e) {
+        msg = e.what();
+      }
+      return luaL_error(L, "%s", msg.c_str());
+    }
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+
+  inline object json_decode(lua_State *L, const char *data, size_t len)
+  {
+    detail::json_parser(L, data, len).run();
+    object result = from_stack(L, -1);
+    lua_pop(L, 1);
+    return result;
+  }
+
+
+  inline object json_decode(lua_State *L, const std::string &text)
+  {
+    return json_decode(L, text.data(), text.length());
+  }
+
+
+  inline void json_encode(const object &obj, std::string &out)
+  {
+    lua_State *L = obj.interpreter();
+    if (! L) { throw luaport::exception("given invalid interpreter"); }
+    int top = lua_gettop(L);
+    obj.push();
+    try {
+      detail::json_writer(L, out).run(-1);
+    }
+    catch (...) {
+      lua_settop(L, top);
+      throw;
+    }
+    lua_settop(L, top);
+  }
+
+
+  inline std::string json_encode(const object &obj)
+  {
+    std::string out;
+    json_encode(obj, out);
+    return out;
+  }
+
+
+  inline object open_json(lua_State *L)
+  {
+    object json = globals(L).table("json");
+    json["decode"] = detail::lua_json_decode;
+    json["encode"] = detail::lua_json_encode;
+    json["null"] = lightuserdata(L, (void *)NULL);
+    return json;
+  }
+
+} // namespace luaport
+
+#endif // _LUAPORT_JSON_HPP
@@ -13,10 +13,64 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #include <lua.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <new>
+#include <sstream>
 #include <string>
 #include <typeinfo>
+#include <utility>
+#include <vector>
 #include <cassert>
 
+// C++11 only features (lambda signature deduction, etc.)
+#if __cplusplus >= 201103L
+#  define LUAPORT_CXX11
+#  include <chrono>
+#  include <memory>
+#  include <mutex>
+#  include <tuple>
+#endif
+
+// profiler of bindings and callbacks (define LUAPORT_PROFILE to enable)
+#ifdef LUAPORT_PROFILE
+#  if __cplusplus < 201103L
+#    error "LUAPORT_PROFILE requires C++11"
+#  endif
+#  include <algorithm>
+#  include <atomic>
+#  include <chrono>
+#  include <cstdio>
+#  include <map>
+#  include <unordered_map>
+#endif
+
+// debug tracing (define LUAPORT_DEBUG to enable)
+#ifdef LUAPORT_DEBUG
+#  include <cstdio>
+#  define LUAPORT_TRACE(args) std::printf args
+#else
+#  define LUAPORT_TRACE(args) ((void)0)
+#endif
+
+// binding strategies
+//   function()/method(): each binding gets its own lua_CFunction with the
+//            argument conversion inlined (fastest call, largest code)
+//   shared_function()/shared_method(): bindings of the same signature share
+//            one lua_CFunction taking the target from its upvalue (smaller
+//            code)
+
+// out of line error paths, kept away from the call paths
+#if defined(__GNUC__)
+#  define LUAPORT_COLD __attribute__((cold, noinline))
+#elif defined(_MSC_VER)
+#  define LUAPORT_COLD __declspec(noinline)
+#else
+#  define LUAPORT_COLD
+#endif
+
 /// luaport main namespace
 namespace luaport
 {
@@ -24,6 +78,31 @@ namespace luaport
   // constants
   const bool adopt = true;
 
+  /// return value policies of the bindings
+  /**
+   * the policy applies to the instances of registered classes returned by
+   * reference or by pointer. instances returned by value are always moved
+   * (copied without C++11) into the userdata itself, without a separate
+   * allocation. other results are converted to lua values.
+   * @see function_policy, method_policy
+   */
+  namespace policy
+  {
+    /// references are copied, pointers are borrowed (bindings without policy)
+    struct automatic { };
+    /// copy the instance into a new userdata
+    struct copy { };
+    /// move the instance into a new userdata (copied without C++11)
+    struct move { };
+    /// non-owning userdata, C++ keeps the instance alive
+    struct reference { };
+    /// non-owning userdata keeping the first argument (self) alive,
+    /// e.g. for the members of the instance
+    struct internal_reference { };
+    /// lua adopts the instance (pointers to new instances)
+    struct take_ownership { };
+  }
+
   // ---------------------------------------------------------
   // library function declarations
   // ---------------------------------------------------------
@@ -47,6 +126,11 @@ namespace luaport
 
   /// register new class
   /**
+   * the derived class gets copies of the members (methods and properties)
+   * the base has at the registration, so register the base completely
+   * first. members added to the base later are still found through the
+   * __index of the class metatable. instances are converted to any
+   * ancestor class by the upcasts precomputed here.
    * @param T : C++ class to register
    * @param Derived : C++ derived class to register
    * @param Base : C++ base class (should be already registred)
@@ -62,10 +146,189 @@ namespace luaport
 
 
   extern class object newtable(lua_State *L);
+
+
+  /// declare the size function of the registered class
+  /**
+   * the size of the memory owned by each adopted instance (outside of lua)
+   * is measured once when it is first adopted and counted until the
+   * instance is released. the adopted bytes are a debt paid by extra steps
+   * of the collector (in 256 KB steps, until a cycle completes), so large
+   * external buffers make the collector run sooner. lua's own pacing
+   * (pause and step multiplier) still sees only the lua heap, and nothing is
+   * paid while the collector is stopped or for memory the instance grows
+   * after the adoption.
+   * @param T : registered C++ class
+   * @param L : lua interpreter
+   * @param size : function returning the external size of the instance
+   * @see external_size
+   */
+  template <typename T>
+    extern void set_external_size(lua_State *L, std::size_t (*size)(const T *));
+
+  /// get the external size of the adopted instances alive
+  /**
+   * @param T : registered C++ class
+   * @param L : lua interpreter
+   * @return total bytes of the instances of T
+   */
+  template <typename T>
+    extern std::size_t external_size(lua_State *L);
+  /// @overload
+  /**
+   * @return total bytes of the instances of all classes
+   */
+  extern std::size_t external_size(lua_State *L);
+
+
+  /// instance statistics of a class registered by newclass
+  struct class_stats
+  {
+    std::string name;           ///< registered class name
+    std::size_t live;           ///< userdata alive
+    std::size_t pushes;         ///< userdata created so far
+    std::size_t adopted;        ///< live userdata owning the instance
+    std::size_t borrowed;       ///< live userdata not owning the instance
+    std::size_t shared;         ///< live userdata holding a std::shared_ptr
+    /// lua memory of one userdata holding a pointer to the instance (the
+    /// metatables are shared by the class)
+    std::size_t instance_bytes;
+    std::size_t member_bytes;   ///< estimated size of the members tables
+    std::size_t external_bytes; ///< @see external_size
+    /// lua memory of the live userdata (values returned by copy hold the
+    /// whole instance), member_bytes and external_bytes
+    std::size_t bytes;
+  };
+
+  /// get the instance statistics of the registered class
+  /**
+   * the sizes are computed with the layout of 64 bit lua 5.2
+   * @param T : registered C++ class
+   * @param L : lua interpreter
+   */
+  template <typename T>
+    extern class_stats get_class_stats(lua_State *L);
+  /// @overload
+  /**
+   * @return statistics of all classes registered by newclass
+   */
+  extern std::vector<class_stats> get_class_stats(lua_State *L);
+
+
+  /// table or string found by heap_dump
+  struct heap_entry
+  {
+    std::string path;   ///< first path found, e.g. "_G.config.items[3]"
+    std::size_t bytes;  ///< estimated size (of the table itself, not contents)
+    std::size_t length; ///< number of entries or characters
+  };
+
+  /// result of heap_dump
+  struct heap_report
+  {
+    std::vector<heap_entry> tables;  ///< largest tables, in descending order
+    std::vector<heap_entry> strings; ///< largest strings, in descending order
+    std::size_t table_count;         ///< reachable tables
+    std::size_t table_bytes;         ///< estimated size of them
+    std::size_t string_count;        ///< reachable strings
+    std::size_t string_bytes;        ///< estimated size of them
+  };
+
+  /// find the largest tables and strings reachable from globals and registry
+  /**
+   * walks keys, values and metatables of tables, upvalues of functions,
+   * metatables and user values of userdata, and the stack slots, locals and
+   * functions of the frames of threads (coroutines and the running thread
+   * below the caller of heap_dump). the sizes are estimated from
+   * the number of entries with the layout of 64 bit lua 5.2.
+   * @param L : lua interpreter
+   * @param top : maximum number of the reported tables (and strings)
+   */
+  extern heap_report heap_dump(lua_State *L, std::size_t top = 20);
+
+
+  /// defer the deletion of adopted instances to the given queue
+  /**
+   * after this call, the garbage collector only unregisters the collected
+   * adopted instances and pushes them to the queue, and the C++ destructors
+   * run when the host drains it.
+   * @param L : lua interpreter
+   * @param q : queue receiving the instances (NULL to delete immediately)
+   * @see finalize_queue
+   */
+  extern void set_finalize_queue(lua_State *L, class finalize_queue *q);
+  extern class finalize_queue *get_finalize_queue(lua_State *L);
+
+
+  /// make lua function from C++ function object
+  /**
+   * the function object is copied into a userdata stored as an upvalue of
+   * the returned lua function, and is destroyed when the function is
+   * collected. the call is statically dispatched to F::operator().
+   * @param S : signature of the call, e.g. int (int, int)
+   * @param L : lua interpreter
+   * @param fn : function object (functor, capturing lambda, ...)
+   * @return lua function object calling fn
+   */
+  template <typename S, typename F>
+    extern class object closure(lua_State *L, const F &fn);
+#ifdef LUAPORT_CXX11
+  /// @overload
+  /**
+   * deduces the signature from F::operator() (lambdas and functors having
+   * exactly one operator())
+   */
+  template <typename F>
+    extern class object closure(lua_State *L, const F &fn);
+#endif
+  /// @overload
+  /**
+   * binds the member function to the specified instance
+   * @param self : instance to call the method on
+   * @param m : member function pointer, e.g. &Vec::length
+   */
+  template <typename C, typename M>
+    extern class object closure(lua_State *L, C *self, M m);
+
+
   template <typename T>
     extern T object_cast(const object &obj);
   extern int type(const class object &obj);
 
+
+  /// error of one element in call_batch
+  struct batch_error
+  {
+    std::size_t index;   ///< position of the input
+    std::string message; ///< lua error message or conversion error
+  };
+
+  /// call the lua function for each input
+  /**
+   * the function stays on the stack during the whole batch and each result
+   * is converted directly from the stack into the output. errors (lua
+   * errors and unconvertible results) don't stop the batch, they are
+   * recorded and the output element is left unchanged.
+   * @param func : lua function taking one argument
+   * @param in : inputs
+   * @param n : number of inputs
+   * @param out : outputs (n elements)
+   * @param errors : errors are appended to it if given
+   * @return number of successful calls
+   */
+  template <typename R, typename T>
+    extern std::size_t call_batch(const object &func, const T *in,
+                                  std::size_t n, R *out,
+                                  std::vector<batch_error> *errors = NULL);
+  /// @overload
+  /**
+   * @return outputs (value initialized on errors)
+   */
+  template <typename R, typename T>
+    extern std::vector<R> call_batch(const object &func,
+                                     const std::vector<T> &in,
+                                     std::vector<batch_error> *errors = NULL);
+
   /// get registry table
   /**
    * @param L : lua interpreter
@@ -73,8 +336,111 @@ namespace luaport
    */
   extern class object registry(lua_State *L);
 
+
+#ifdef LUAPORT_PROFILE
+  /// profile of one binding or lua callback (merged over threads)
+  /**
+   * callbacks are recorded by the place of their definition, so the
+   * closures made from one function share the record (and so do the
+   * functions defined on the same line)
+   */
+  struct profile_record
+  {
+    std::string name;         ///< "Class.method", "function" or "lua:src:line"
+    unsigned long long calls; ///< number of calls
+    double total_ns;          ///< cumulative time
+    double p50_ns;            ///< median (upper bound of the bucket)
+    double p99_ns;            ///< 99th percentile (upper bound of the bucket)
+    /// latency histogram, [i] counts calls shorter than bucket_ns(i)
+    std::vector<unsigned long long> buckets;
+  };
+
+  /// get the profiles, sorted by the cumulative time
+  extern std::vector<profile_record> profile_snapshot();
+  /// upper bound of the latency bucket in nanoseconds
+  extern double profile_bucket_ns(int i);
+  /// clear the profiles of all threads
+  extern void profile_reset();
+  /// profiles as lua table (array of {name, calls, total_ns, p50_ns, p99_ns})
+  extern class object profile_snapshot(lua_State *L);
+#endif
+
+  /// binding of the function (or method)
+  /**
+   * the lua_CFunction made for the function
+   */
   #define function(func) get_functype(func).get_lfunc<func>()
   #define method(func) get_functype(&func).get_lfunc<&func>()
+  /// binding of the function (or method) by the thunk shared by the signature
+  /**
+   * a value pushed as the C closure of the thunk with the target as the
+   * upvalue (assign it to a table field or pass it to luaport::push, it is
+   * not a lua_CFunction). smaller code for many bindings of one signature,
+   * at the cost of an indirect call.
+   */
+  #define shared_function(func) get_functype(func).get_shared<func>()
+  #define shared_method(func) get_functype(&func).get_shared<&func>()
+  /// binding of the function (or method) pushing the result by the policy
+  /**
+   * e.g. method_policy(Mesh::bounds, luaport::policy::internal_reference)
+   * @see policy
+   */
+  #define function_policy(func, P) get_functype(func).get_lfunc<func, P>()
+  #define method_policy(func, P) get_functype(&func).get_lfunc<&func, P>()
+  #define shared_function_policy(func, P) get_functype(func).get_shared<func, P>()
+  #define shared_method_policy(func, P) get_functype(&func).get_shared<&func, P>()
+  /// binding of the function (or method) with the explicit signature
+  /**
+   * selects one of overloaded C++ functions by the signature type,
+   * e.g. function_as(int (*)(int, int), add) or
+   * function_as(void (Vec::*)(double), Vec::scale).
+   * the result is usable as lua_CFunction and as an argument of overload()
+   */
+  #define function_as(type, func) get_functype((type)&func).get_binding<&func>()
+
+
+  /// bind multiple overloaded C++ functions under one lua function
+  /**
+   * the generated dispatcher selects the first overload whose arity
+   * matches the number of passed arguments and whose argument types match
+   * the lua types of them. the error message is built only if no overload
+   * matches.
+   * @param bN : N-th overload, made by function_as macro
+   * @return lua function dispatching to the overloads
+   * @see function_as
+   */
+  template <typename B1, typename B2>
+    extern lua_CFunction overload(B1 b1, B2 b2);
+  /// @overload
+  template <typename B1, typename B2, typename B3>
+    extern lua_CFunction overload(B1 b1, B2 b2, B3 b3);
+  /// @overload
+  template <typename B1, typename B2, typename B3, typename B4>
+    extern lua_CFunction overload(B1 b1, B2 b2, B3 b3, B4 b4);
+  /// @overload
+  template <typename B1, typename B2, typename B3, typename B4,
+            typename B5>
+    extern lua_CFunction overload(B1 b1, B2 b2, B3 b3, B4 b4, B5 b5);
+  /// @overload
+  template <typename B1, typename B2, typename B3, typename B4,
+            typename B5, typename B6>
+    extern lua_CFunction overload(B1 b1, B2 b2, B3 b3, B4 b4, B5 b5, B6 b6);
+
+
+  /// set the metamethod of the instances of the registered class
+  /**
+   * the metamethod is put on the metatables of the instances pushed
+   * afterwards, and is inherited by the classes derived afterwards.
+   * __gc, __index and __newindex are reserved by luaport.
+   * @param c : class object returned by newclass
+   * @param event : metamethod name, e.g. "__add", "__eq" or "__call"
+   * @param f : lua function, e.g. op::add<Vec, const Vec&, const Vec&>(),
+   *            overload(...) of them, or method(Vec::operator())
+   * @see op
+   */
+  template <typename F>
+    extern void set_metamethod(const class object &c, const std::string &event,
+                               const F &f);
 
 
   // template class declarations
@@ -82,6 +448,7 @@ namespace luaport
   {
     template <typename T>
       class managed;
+    struct finalize_token;
   }
   template <typename T>
     class reference;
@@ -325,6 +692,18 @@ namespace luaport
       template <typename T>
         object(lua_State *L, T *ptr, bool adopt = false);
 
+#ifdef LUAPORT_CXX11
+      /// Constructor (object of registered class owned by unique_ptr)
+      /**
+       * the ownership moves into a shared_ptr held by the userdata.
+       * @param L : lua interpreter
+       * @param ptr : owner of the class instance (released)
+       * @see object::object(lua_State *L, const T &val)
+       */
+      template <typename T>
+        object(lua_State *L, std::unique_ptr<T> &&ptr);
+#endif
+
 
       ~object()
       {
@@ -409,6 +788,21 @@ namespace luaport
       }
 
 
+      /// deep copy of the referred value into another interpreter
+      /**
+       * tables are rebuilt (presized) in dst keeping shared and cyclic
+       * references, strings are copied and instances of registered classes
+       * are pushed through the class registry of dst without ownership
+       * (the class should be registered in dst, and the source keeps
+       * owning adopted instances). metatables of plain tables are not
+       * copied. throws luaport::exception for values which can't be copied
+       * (lua functions, C closures, threads, unregistered userdata).
+       * @param dst : destination lua interpreter
+       * @return copied object in dst
+       */
+      object copy_to(lua_State *dst) const;
+
+
       bool setmetatable(const object &t)
       {
         assert(t.type() == LUA_TTABLE || t.type() == LUA_TNIL);
@@ -695,21 +1089,21 @@ namespace luaport
 
       virtual bool is_valid() const
       {
-printf("IS VALID?\n");
+LUAPORT_TRACE(("IS VALID?\n"));
         return p != NULL;
       }
 
 
       bool reset(lua_State *L, T *p, bool adopt = false)
       {
-printf("REF FROM PTER!\n");
+LUAPORT_TRACE(("REF FROM PTER!\n"));
         object::operator=(object(L, p, adopt));
         this->p = p;
         return true;
       }
       bool reset(const object &src)
       {
-printf("REF FROM OBJECT!\n");
+LUAPORT_TRACE(("REF FROM OBJECT!\n"));
         try {
           p = object_cast<T *>(src);
           object::operator=(src);
@@ -722,7 +1116,7 @@ printf("REF FROM OBJECT!\n");
       template <typename From>
         bool reset(const reference<From> &src)
       {
-printf("REF FROM REF!\n");
+LUAPORT_TRACE(("REF FROM REF!\n"));
         object::operator=(src);
         p = src.get();
         return true;
@@ -746,7 +1140,7 @@ printf("REF FROM REF!\n");
       template <typename From>
         void operator=(const reference<From> &src)
       {
-printf("COPYING FROM REFERENCE!\n");
+LUAPORT_TRACE(("COPYING FROM REFERENCE!\n"));
         reset(src);
       }
       void operator=(const object &src)
@@ -822,6 +1216,231 @@ printf("COPYING FROM REFERENCE!\n");
   };
 
 
+  /// queue of adopted instances waiting for deletion
+  /**
+   * filled by the garbage collector when set by set_finalize_queue().
+   * the queue doesn't touch lua; with C++11, push and drain are
+   * synchronized and it may be drained on another thread, without C++11
+   * it must be drained on the thread running lua.
+   * on destruction, the queue is unset from the lua states (they delete
+   * the instances immediately again) and the remaining instances are
+   * deleted. destroy it while no state using it is collecting (after
+   * lua_close, or on the thread running lua).
+   */
+  class finalize_queue
+  {
+    public:
+      typedef void (*destroy_func)(void *p);
+
+      finalize_queue() : items(), tokens() { }
+
+      ~finalize_queue()
+      {
+        {
+#ifdef LUAPORT_CXX11
+          std::lock_guard<std::mutex> lock(mutex);
+#endif
+          // the tokens live in the lua states still referring to the queue
+          for (std::size_t i = 0; i < tokens.size(); i++) { detach(tokens[i]); }
+          tokens.clear();
+        }
+        drain();
+      }
+
+      /// queue the instance
+      /**
+       * @param p : instance to delete
+       * @param destroy : function deleting p with the right type
+       */
+      void push(void *p, destroy_func destroy)
+      {
+#ifdef LUAPORT_CXX11
+        std::lock_guard<std::mutex> lock(mutex);
+#endif
+        items.push_back(item(p, destroy));
+      }
+
+      /// delete queued instances
+      /**
+       * instances are taken out of the queue in one batch and deleted
+       * outside of the lock.
+       * @param max : maximum number of instances to delete
+       * @return number of deleted instances
+       */
+      std::size_t drain(std::size_t max = (std::size_t)-1)
+      {
+        std::deque<item> batch;
+        {
+#ifdef LUAPORT_CXX11
+          std::lock_guard<std::mutex> lock(mutex);
+#endif
+          if (max >= items.size())
+          {
+            batch.swap(items);
+          }
+          else
+          {
+            batch.assign(items.begin(), items.begin() + max);
+            items.erase(items.begin(), items.begin() + max);
+          }
+        }
+        for (std::size_t i = 0; i < batch.size(); i++)
+        {
+          batch[i].second(batch[i].first);
+        }
+        return batch.size();
+      }
+
+      /// get the number of queued instances
+      std::size_t size() const
+      {
+#ifdef LUAPORT_CXX11
+        std::lock_guard<std::mutex> lock(mutex);
+#endif
+        return items.size();
+      }
+
+    private:
+      typedef std::pair<void *, destroy_func> item;
+      friend struct detail::finalize_token;
+
+      // noncopyable
+      finalize_queue(const finalize_queue &);
+      finalize_queue& operator=(const finalize_queue &);
+
+      static void detach(detail::finalize_token *t);
+
+      std::deque<item> items;
+      // set_finalize_queue tokens of the states using the queue
+      std::vector<detail::finalize_token *> tokens;
+#ifdef LUAPORT_CXX11
+      mutable std::mutex mutex;
+#endif
+  };
+
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // userdata in registry.luaport.finalize_queue, unregistered from the
+    // queue when the state is closed (or set to another queue)
+    struct finalize_token
+    {
+      finalize_queue *q;
+
+      void set(finalize_queue *queue)
+      {
+        if (q)
+        {
+#ifdef LUAPORT_CXX11
+          std::lock_guard<std::mutex> lock(q->mutex);
+#endif
+          std::vector<finalize_token *> &v = q->tokens;
+          v.erase(std::remove(v.begin(), v.end(), this), v.end());
+        }
+        q = queue;
+        if (q)
+        {
+#ifdef LUAPORT_CXX11
+          std::lock_guard<std::mutex> lock(q->mutex);
+#endif
+          q->tokens.push_back(this);
+        }
+      }
+
+      static int gc(lua_State *L)
+      {
+        ((finalize_token *)lua_touserdata(L, 1))->set(NULL);
+        return 0;
+      }
+    };
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+  inline void finalize_queue::detach(detail::finalize_token *t)
+  {
+    t->q = NULL;
+  }
+
+
+  // helpers of the hook based add-ons (budget, sampler, gc_controller)
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // seconds of the steady clock, or the processor time of the process
+    // (std::clock) without C++11
+    inline double clock_seconds()
+    {
+#ifdef LUAPORT_CXX11
+      return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+      return (double)std::clock() / CLOCKS_PER_SEC;
+#endif
+    }
+
+    // registry[tag] is the table of thread -> object (light userdata),
+    // the innermost object alive is kept at [tag] itself (th = NULL)
+    inline void set_thread_object(lua_State *L, void *tag, lua_State *th,
+                                  void *p)
+    {
+      lua_rawgetp(L, LUA_REGISTRYINDEX, tag);
+      if (! lua_istable(L, -1))
+      {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, tag);
+      }
+      if (p) { lua_pushlightuserdata(L, p); }
+      else { lua_pushnil(L); }
+      lua_rawsetp(L, -2, th ? (void *)th : tag);
+      lua_pop(L, 1);
+    }
+
+    inline void *get_thread_object(lua_State *L, void *tag, lua_State *th)
+    {
+      lua_rawgetp(L, LUA_REGISTRYINDEX, tag);
+      if (! lua_istable(L, -1))
+      {
+        lua_pop(L, 1);
+        return NULL;
+      }
+      lua_rawgetp(L, -1, th ? (void *)th : tag);
+      void *p = lua_touserdata(L, -1);
+      lua_pop(L, 2);
+      return p;
+    }
+
+    // object of the thread, or the innermost one for inherited hooks
+    // (coroutines created by a thread having an object, at any depth)
+    inline void *find_thread_object(lua_State *L, void *tag)
+    {
+      lua_rawgetp(L, LUA_REGISTRYINDEX, tag);
+      if (! lua_istable(L, -1))
+      {
+        lua_pop(L, 1);
+        return NULL;
+      }
+      lua_rawgetp(L, -1, L);
+      void *p = lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      if (! p)
+      {
+        lua_rawgetp(L, -1, tag);
+        p = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+      }
+      lua_pop(L, 1);
+      return p;
+    }
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+
   // ---------------------------------------------------------
   // detail function declaration
 
@@ -833,6 +1452,8 @@ printf("COPYING FROM REFERENCE!\n");
 
     static int lua_class_get_member(lua_State *L);
     static int lua_class_set_member(lua_State *L);
+    static void release_members(lua_State *L, int idx);
+    static int lua_class_define(lua_State *L);
 
     // get string representation of all stack elements from bottom to top
     // results in "([...,] function, arg1, ..., argN)" for function call
@@ -850,8 +1471,61 @@ printf("COPYING FROM REFERENCE!\n");
     static void push(lua_State *L, const std::string &value);
     static void push(lua_State *L, const object &value);
     static void push(lua_State *L, const proxy &value);
+    struct shared_binding;
+    static void push(lua_State *L, const shared_binding &value);
     template <typename T>
       static void push(lua_State *L, T *val, bool adopt);
+    // push the copy (or the moved instance) held by the userdata itself
+    template <typename T>
+      static void push_value(lua_State *L, const T &val);
+#ifdef LUAPORT_CXX11
+    template <typename T>
+      static void push_value(lua_State *L, T &&val);
+#endif
+    // push the instance referred by the result of the binding
+    template <typename T>
+      static void push_result(lua_State *L, T *p, policy::copy);
+    template <typename T>
+      static void push_result(lua_State *L, T *p, policy::move);
+    template <typename T>
+      static void push_result(lua_State *L, T *p, policy::reference);
+    template <typename T>
+      static void push_result(lua_State *L, T *p, policy::internal_reference);
+    template <typename T>
+      static void push_result(lua_State *L, T *p, policy::take_ownership);
+
+    // type erased pusher of registered class instance, taking the userdata
+    // (managed<T> pushes non-owning, shared_holder<T> shares the ownership)
+    typedef void (*instance_pusher)(lua_State *L, void *u);
+    template <typename T>
+      static void push_instance(lua_State *L, void *u);
+#ifdef LUAPORT_CXX11
+    template <typename T>
+      static void push(lua_State *L, const std::shared_ptr<T> &val);
+    template <typename T>
+      static void push(lua_State *L, std::unique_ptr<T> &&val);
+    template <typename T>
+      static void push_shared_instance(lua_State *L, void *u);
+#endif
+    template <typename T>
+      static void push_value_instance(lua_State *L, void *u);
+    // set the metatable of the class instance on the stack top
+    static void set_instance_metatable(lua_State *L, const object &c,
+                                       lua_CFunction gc, bool shared = false);
+
+    // add (or remove) the external size of the adopted instance
+    template <typename T>
+      static void account_external(lua_State *L, T *p, bool add);
+    static void account_external(lua_State *L, lua_CFunction key, double bytes);
+    static void pay_external_debt(lua_State *L, std::size_t bytes);
+
+    // counters of the class instances (NULL before luaport::open)
+    static struct instance_counter *get_instance_counter(lua_State *L,
+                                                         lua_CFunction key);
+    static struct instance_counter *class_counter(lua_State *L, const object &c,
+                                                  lua_CFunction key);
+    static int lua_heap_classes(lua_State *L);
+    static int lua_heap_dump(lua_State *L);
   //  template <typename T>
   //    static void push(lua_State *L, T *val, bool adopt = false);
 
@@ -869,69 +1543,336 @@ printf("COPYING FROM REFERENCE!\n");
     template <typename T>
       struct cast_traits;
 
-    template <typename T, T arg>
+    template <typename T, T arg, typename P = policy::automatic>
       struct cfunc_traits;
 
+    // arithmetic types, converted from lua numbers
     template <typename T>
-      struct finalizer
-    {
-      static int lfunc(lua_State *L);
-    };
-    template <typename T>
-      struct finalizer<T *>
-    {
-      static int lfunc(lua_State *L);
-    };
+      struct is_number { static const bool value = false; };
+    #define LUAPORT_NUMBER(T) \
+      template <> \
+        struct is_number<T> { static const bool value = true; };
+    LUAPORT_NUMBER(char)
+    LUAPORT_NUMBER(signed char)
+    LUAPORT_NUMBER(unsigned char)
+    LUAPORT_NUMBER(short)
+    LUAPORT_NUMBER(unsigned short)
+    LUAPORT_NUMBER(int)
+    LUAPORT_NUMBER(unsigned int)
+    LUAPORT_NUMBER(long)
+    LUAPORT_NUMBER(unsigned long)
+#ifdef LUAPORT_CXX11
+    LUAPORT_NUMBER(long long)
+    LUAPORT_NUMBER(unsigned long long)
+#endif
+    LUAPORT_NUMBER(float)
+    LUAPORT_NUMBER(double)
+    LUAPORT_NUMBER(long double)
+    #undef LUAPORT_NUMBER
+
+    template <typename T, bool N = is_number<T>::value>
+      struct check_traits;
+
+    inline bool to_instance(lua_State *L, int idx, lua_CFunction key,
+                            void **p);
 
     template <typename T>
-      struct functype_hold
+      struct args_traits;
+
+    template <typename T, T func, typename P = policy::automatic>
+      struct binding
     {
-      template <T func>
-        lua_CFunction get_lfunc()
+      typedef args_traits<T> args;
+      static int lfunc(lua_State *L)
       {
-        return cfunc_traits<T, func>::lfunc;
+        return cfunc_traits<T, func, P>::lfunc(L);
+      }
+      operator lua_CFunction() const
+      {
+        return lfunc;
       }
     };
 
-    template <typename T>
-      class managed
+    // placeholder for the unused overload slots
+    struct no_binding
     {
-      public:
-        managed(lua_State *L, T *p, bool adopt)
-          : L(L), p(p), adopt(adopt) { }
-        virtual ~managed();
+      struct args
+      {
+        static const int nargs = -1;
+        static bool check(lua_State *L) { return false; }
+        static std::string sign(lua_State *L) { return ""; }
+      };
+      static int lfunc(lua_State *L) { return 0; }
+    };
 
-        // placement new
-        static void* operator new(std::size_t, lua_State *L);
+    // any function pointer, converted back to its type by shared_target
+    typedef void (*shared_target_func)();
 
-        T *p;
-        lua_State *L;
-        bool adopt;
-    };
-    template <>
-      class managed<void>
+    // binding made of the thunk of the signature and the target function,
+    // pushed as a C closure with the target as the upvalue (full userdata
+    // holding the function pointer, as it isn't an object pointer)
+    struct shared_binding
     {
-      public:
-        void *p;
+      template <typename F>
+        shared_binding(lua_CFunction thunk, F target)
+          : thunk(thunk), target(reinterpret_cast<shared_target_func>(target)) { }
+      lua_CFunction thunk;
+      shared_target_func target;
     };
 
+    // the target of the running shared thunk
+    template <typename F>
+      inline F shared_target(lua_State *L)
+    {
+      return reinterpret_cast<F>(
+        *(shared_target_func *)lua_touserdata(L, lua_upvalueindex(1)));
+    }
 
-    template <typename T>
-      struct type_traits
+    template <typename T, typename P = policy::automatic>
+      struct shared_thunk;
+
+    template <typename T, T func, typename P = policy::automatic>
+      struct thunk_traits;
+
+    // C++ operators as functions bindable by cfunc_traits
+    template <typename R, typename A, typename B>
+      struct binary_operators
     {
-      typedef T natural;
-      static std::string name(lua_State *L);
+      static R add(A a, B b) { return a + b; }
+      static R sub(A a, B b) { return a - b; }
+      static R mul(A a, B b) { return a * b; }
+      static R div(A a, B b) { return a / b; }
+      static R mod(A a, B b) { return a % b; }
     };
-    template <typename T>
-      struct type_traits<T &>
+    template <typename R, typename A>
+      struct unary_operators
     {
-      typedef T natural;
-      static std::string name(lua_State *L);
+      // lua passes the operand twice
+      static R unm(A a) { return -a; }
     };
-    template <typename T>
-      struct type_traits<const T>
+    template <typename A, typename B>
+      struct compare_operators
     {
-      typedef T natural;
+      static bool eq(A a, B b) { return a == b; }
+      static bool lt(A a, B b) { return a < b; }
+      static bool le(A a, B b) { return a <= b; }
+    };
+    template <typename A>
+      struct object_operators
+    {
+      static unsigned long len(A a) { return (unsigned long)a.size(); }
+      static std::string tostring(A a)
+      {
+        std::ostringstream s;
+        s << a;
+        return s.str();
+      }
+    };
+    // tostring(a) .. tostring(b), through __tostring of the instances
+    inline int lua_op_concat(lua_State *L)
+    {
+      luaL_tolstring(L, 1, NULL);
+      luaL_tolstring(L, 2, NULL);
+      lua_concat(L, 2);
+      return 1;
+    }
+
+    template <typename B1, typename B2,
+              typename B3 = no_binding, typename B4 = no_binding,
+              typename B5 = no_binding, typename B6 = no_binding>
+      struct overload_traits;
+
+    // F: function object type, S: call signature (function type)
+    template <typename F, typename S>
+      struct functor_traits;
+
+    template <typename F>
+      struct functor_holder
+    {
+      static int gc(lua_State *L)
+      {
+        F *fn = (F *)lua_touserdata(L, 1);
+        fn->~F();
+        return 0;
+      }
+    };
+
+    // function object calling the member function of the instance
+    template <typename M>
+      struct bound_method;
+
+    template <typename T>
+      struct finalizer
+    {
+      static int lfunc(lua_State *L);
+    };
+    template <typename T>
+      struct finalizer<T *>
+    {
+      static int lfunc(lua_State *L);
+    };
+
+    template <typename T>
+      struct functype_hold
+    {
+      template <T func>
+        lua_CFunction get_lfunc()
+      {
+        return cfunc_traits<T, func>::lfunc;
+      }
+      template <T func, typename P>
+        lua_CFunction get_lfunc()
+      {
+        return cfunc_traits<T, func, P>::lfunc;
+      }
+      template <T func>
+        shared_binding get_shared()
+      {
+        return thunk_traits<T, func>::get();
+      }
+      template <T func, typename P>
+        shared_binding get_shared()
+      {
+        return thunk_traits<T, func, P>::get();
+      }
+      template <T func>
+        binding<T, func> get_binding()
+      {
+        return binding<T, func>();
+      }
+    };
+
+    template <typename T>
+      class managed
+    {
+      public:
+        managed(lua_State *L, T *p, bool adopt, struct instance_counter *counter)
+          : L(L), p(p), adopt(adopt), counter(counter) { }
+        ~managed();
+
+        // finalize_queue::destroy_func deleting the instance
+        static void destroy(void *p) { delete (T *)p; }
+
+        // placement new
+        static void* operator new(std::size_t, lua_State *L);
+
+        T *p;
+        lua_State *L;
+        bool adopt;
+        struct instance_counter *counter;  // of the class (may be NULL)
+    };
+    template <>
+      class managed<void>
+    {
+      public:
+        void *p;
+    };
+
+    // conversions of the instance pointer from the derived class to an
+    // ancestor, applied in order (userdata in class metatable "upcasts")
+    typedef void *(*upcast_func)(void *);
+    struct upcast_chain
+    {
+      static const int max_depth = 16;
+      int n;
+      upcast_func f[max_depth];
+    };
+
+    // sizes of 64 bit lua 5.2 (Table, TValue, Node, TString and Udata)
+    static const std::size_t heap_table_size = 56;
+    static const std::size_t heap_array_slot = 16;
+    static const std::size_t heap_node_size = 40;
+    static const std::size_t heap_string_size = 24;
+    static const std::size_t heap_udata_size = 40;
+
+    // per class counters (userdata in registry luaport.func_to_stats)
+    struct instance_counter
+    {
+      std::size_t live;
+      std::size_t pushes;
+      std::size_t adopted;
+      std::size_t borrowed;
+      std::size_t shared;
+      std::size_t instance_bytes;  // of managed<T>, set by newclass
+      std::size_t bytes;           // of the live userdata
+      std::size_t member_bytes;
+    };
+
+    // kind is adopted, borrowed or shared, size of the holder
+    inline void count_push(instance_counter *n,
+                           std::size_t instance_counter::*kind, std::size_t size)
+    {
+      if (! n) { return; }
+      n->live++;
+      n->pushes++;
+      n->*kind += 1;
+      n->bytes += heap_udata_size + size;
+    }
+    inline void count_release(instance_counter *n,
+                              std::size_t instance_counter::*kind, std::size_t size)
+    {
+      if (! n || n->live == 0) { return; }
+      n->live--;
+      n->*kind -= 1;
+      n->bytes -= heap_udata_size + size;
+    }
+
+    // userdata holding the instance itself (results returned by value)
+    // p comes first so as to be read through managed<void>
+    template <typename T>
+      struct value_holder
+    {
+      value_holder(lua_State *L, const T &v)
+        : p(&value), L(L), counter(NULL), value(v) { }
+#ifdef LUAPORT_CXX11
+      value_holder(lua_State *L, T &&v)
+        : p(&value), L(L), counter(NULL), value(std::move(v)) { }
+#endif
+      ~value_holder();
+
+      T *p;
+      lua_State *L;
+      struct instance_counter *counter;  // set by init_value (may be NULL)
+      T value;
+    };
+
+#ifdef LUAPORT_CXX11
+    // userdata sharing the ownership with C++ (and other lua states)
+    // p comes first so as to be read through managed<void>
+    struct shared_holder_base
+    {
+      shared_holder_base() : p(NULL), counter(NULL) { }
+      void *p;
+      std::shared_ptr<void> sp;
+      instance_counter *counter;  // of the class (may be NULL)
+    };
+    template <typename T>
+      struct shared_holder : public shared_holder_base
+    {
+      ~shared_holder()
+      {
+        count_release(counter, &instance_counter::shared, sizeof(shared_holder<T>));
+      }
+    };
+#endif
+
+
+    template <typename T>
+      struct type_traits
+    {
+      typedef T natural;
+      static std::string name(lua_State *L);
+    };
+    template <typename T>
+      struct type_traits<T &>
+    {
+      typedef T natural;
+      static std::string name(lua_State *L);
+    };
+    template <typename T>
+      struct type_traits<const T>
+    {
+      typedef T natural;
       static std::string name(lua_State *L);
     };
     template <typename T>
@@ -940,6 +1881,21 @@ printf("COPYING FROM REFERENCE!\n");
       typedef T natural;
       static std::string name(lua_State *L);
     };
+    // multiple results, named as "A, B"
+    template <typename A, typename B>
+      struct type_traits<std::pair<A, B> >
+    {
+      typedef std::pair<A, B> natural;
+      static std::string name(lua_State *L);
+    };
+#ifdef LUAPORT_CXX11
+    template <typename... E>
+      struct type_traits<std::tuple<E...> >
+    {
+      typedef std::tuple<E...> natural;
+      static std::string name(lua_State *L);
+    };
+#endif
 
     /// @endcond DETAIL
   }
@@ -979,7 +1935,7 @@ namespace luaport
 
     inline static int lua_class_create(lua_State *L)
     {
-      printf("CALL!\n");
+      LUAPORT_TRACE(("CALL!\n"));
       luaL_checktype(L, 1, LUA_TTABLE);
       object c = from_stack(L, 1);
       object init = c["__init"];
@@ -990,10 +1946,11 @@ namespace luaport
       }
 
       lua_newuserdata(L, 0);
+      lua_newtable(L);
+      lua_setuservalue(L, -2);
       object m = newtable(L);
       m["class"] = c;
       m["luaport"] = true;
-      m["members"] = newtable(L);
       m["__gc"] = finalizer<void>::lfunc;
       m["__index"] = lua_class_get_member;
       m["__newindex"] = lua_class_set_member;
@@ -1001,7 +1958,7 @@ namespace luaport
       lua_setmetatable(L, -2);
 
       object u = from_stack(L, -1);
-      printf("U: %s\n", (const char *)u);
+      LUAPORT_TRACE(("U: %s\n", (const char *)u));
       init(u);
       return 1;
     }
@@ -1017,6 +1974,24 @@ namespace luaport
     }
 
 
+    // the signature is built only when the error is raised
+    LUAPORT_COLD inline static void lua_error_signature_of
+      (lua_State *L, std::string (*sign)(lua_State *))
+    {
+      lua_error_signature(L, sign(L));
+    }
+
+
+    inline static void lua_error_overload
+      (lua_State *L, const std::string &candidates)
+    {
+      std::string msg;
+      msg += "no matching overload, candidates are:\n" + candidates;
+      msg += "but got: " + lua_get_args_string(L);
+      luaL_error(L, "%s", msg.c_str());
+    }
+
+
     inline static std::string lua_get_args_string(lua_State *L)
     {
       int nargs = lua_gettop(L);
@@ -1062,9 +2037,8 @@ namespace luaport
       // field (arg2) is field name
       // meta (stack3) = getmetatable(ins)
       lua_getmetatable(L, 1);
-      // mem (stack4) = rawget(meta, "members")
-      lua_pushstring(L, "members");
-      lua_rawget(L, 3);
+      // mem (stack4) = members of the instance (user value)
+      lua_getuservalue(L, 1);
       // if type(mem) == "table" then
       if (lua_type(L, 4) == LUA_TTABLE)
       {
@@ -1156,9 +2130,35 @@ namespace luaport
         lua_pop(L, 4);
         return 0;
       }
-      // mem (arg8) = rawget(meta, "members")
-      lua_pushstring(L, "members");
+      // mem (arg8) = members of the instance (user value)
+      lua_getuservalue(L, 1);
+      // instance members are made on demand, and are looked up first, so
+      // the metatable (shared by the class) is indexed by the C function
+      lua_pushstring(L, "counter");
       lua_rawget(L, 4);
+      instance_counter *n = (instance_counter *)lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      if (! lua_istable(L, 8))
+      {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, 8);
+        lua_setuservalue(L, 1);
+        lua_pushstring(L, "__index");
+        lua_pushcfunction(L, lua_class_get_member);
+        lua_rawset(L, 4);
+        if (n) { n->member_bytes += heap_table_size; }
+      }
+      if (n)
+      {
+        // estimated by node, see release_members
+        lua_pushvalue(L, 2);
+        lua_rawget(L, 8);
+        bool had = ! lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (! had && ! lua_isnil(L, 3)) { n->member_bytes += heap_node_size; }
+        if (had && lua_isnil(L, 3)) { n->member_bytes -= heap_node_size; }
+      }
       // mem[field] = val
       lua_pushvalue(L, 2);
       lua_pushvalue(L, 3);
@@ -1169,6 +2169,121 @@ namespace luaport
       return 0;
     }
 
+
+    // uncounts the members table of the collected instance (at idx)
+    inline static void release_members(lua_State *L, int idx)
+    {
+      lua_getuservalue(L, idx);
+      if (! lua_istable(L, -1) || ! lua_getmetatable(L, idx))
+      {
+        lua_pop(L, 1);
+        return;
+      }
+      lua_pushstring(L, "counter");
+      lua_rawget(L, -2);
+      instance_counter *n = (instance_counter *)lua_touserdata(L, -1);
+      lua_pop(L, 2);
+      if (n)
+      {
+        std::size_t size = heap_table_size;
+        lua_pushnil(L);
+        while (lua_next(L, -2))
+        {
+          size += heap_node_size;
+          lua_pop(L, 1);
+        }
+        n->member_bytes -= size < n->member_bytes ? size : n->member_bytes;
+      }
+      lua_pop(L, 1);
+    }
+
+
+    // instances of classes having properties are indexed by C function,
+    // the instance metatables of the class (and of the derived classes)
+    // already made are switched
+    inline static void enable_properties(lua_State *L, int c)
+    {
+      c = lua_absindex(L, c);
+      if (! lua_getmetatable(L, c)) { return; }
+      lua_pushliteral(L, "properties");
+      lua_rawget(L, -2);
+      bool enabled = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      if (enabled)
+      {
+        lua_pop(L, 1);
+        return;
+      }
+      lua_pushliteral(L, "properties");
+      lua_pushboolean(L, 1);
+      lua_rawset(L, -3);
+      // shared instance metatables, see set_instance_metatable
+      lua_pushliteral(L, "instance_metatables");
+      lua_rawget(L, -2);
+      if (lua_istable(L, -1))
+      {
+        lua_pushnil(L);
+        while (lua_next(L, -2))
+        {
+          lua_pushliteral(L, "__index");
+          lua_pushcfunction(L, lua_class_get_member);
+          lua_rawset(L, -3);
+          lua_pop(L, 1);
+        }
+      }
+      lua_pop(L, 1);
+      // derived classes are listed by newclass<Derived, Base>
+      lua_pushliteral(L, "derived");
+      lua_rawget(L, -2);
+      if (lua_istable(L, -1))
+      {
+        int n = (int)lua_rawlen(L, -1);
+        for (int i = 1; i <= n; i++)
+        {
+          lua_rawgeti(L, -1, i);
+          enable_properties(L, -1);
+          lua_pop(L, 1);
+        }
+      }
+      lua_pop(L, 2);
+    }
+
+
+    inline static int lua_class_define(lua_State *L)
+    {
+      // class (arg1), field (arg2), val (arg3)
+      if (lua_type(L, 2) == LUA_TSTRING &&
+          std::string(lua_tostring(L, 2)).compare(0, 4, "get_") == 0)
+      {
+        enable_properties(L, 1);
+      }
+#ifdef LUAPORT_PROFILE
+      // bindings are profiled under the name of the registration
+      if (lua_type(L, 2) == LUA_TSTRING && lua_isfunction(L, 3))
+      {
+        lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+        lua_getfield(L, -1, "class_to_name");
+        lua_pushvalue(L, 1);
+        lua_rawget(L, -2);
+        if (lua_isstring(L, -1))
+        {
+          lua_pushliteral(L, ".");
+          lua_pushvalue(L, 2);
+          lua_concat(L, 3);
+          lua_getfield(L, -3, "func_to_name");
+          lua_pushvalue(L, 3);
+          lua_pushvalue(L, -3);
+          lua_rawset(L, -3);
+          lua_pop(L, 1);
+        }
+        lua_settop(L, 3);
+      }
+#endif
+      lua_settop(L, 3);
+      lua_rawset(L, 1);
+      return 0;
+    }
+
   } // namespace detail
 
 } // namespace luaport
@@ -1216,399 +2331,2548 @@ namespace luaport
     {
       return object(val).push(L);
     }
+    inline void push(lua_State *L, const shared_binding &val)
+    {
+      *(shared_target_func *)lua_newuserdata(L, sizeof(shared_target_func)) = val.target;
+      lua_pushcclosure(L, val.thunk, 1);
+    }
     inline void push(lua_State *L, const std::string &val)
     {
       lua_pushlstring(L, val.data(), val.length());
     }
-    // avoiding from the compiler confusing
-    template <>
-      inline void push(lua_State *L, lua_CFunction val, bool adopt)
+    template <typename T>
+      inline void push_instance(lua_State *L, void *u)
     {
-      lua_pushcfunction(L, val);
+      push(L, ((managed<T> *)u)->p, false);
     }
     template <typename T>
-      inline void push(lua_State *L, T *val, bool adopt)
+      inline void account_external(lua_State *L, T *p, bool add)
     {
-  printf("PUSH UDATA: %p\n", val);
-      managed<T> *u = new(L) managed<T>(L, val, adopt);
-      object c = get_class<T>(L);
-      if (! c.is_valid())
+      lua_CFunction key = finalizer<managed<T>*>::lfunc;
+      // most classes have no size function, looked up on the raw stack
+      lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+      if (! lua_istable(L, -1))
       {
-        std::string msg = "unregistered class: ";
-        throw luaport::exception(msg + typeid(T).name());
+        lua_pop(L, 1);
+        return;
       }
-      object m = newtable(L);
-      m["class"] = c;
-      m["luaport"] = true;
-      m["members"] = newtable(L);
-      m["__gc"] = finalizer<managed<T>*>::lfunc;
-      m["__index"] = lua_class_get_member;
-      m["__newindex"] = lua_class_set_member;
-      m.push();
-      lua_setmetatable(L, -2);
-
-      printf("REGISTER REFERENCE: %p\n", val);
-      object ref = registry(L)["luaport"]["references"];
-      object count = ref[lightuserdata(L, val)];
-      if (adopt)
+      if (add)
       {
-        if (count.type() == LUA_TNUMBER)
+        lua_getfield(L, -1, "func_to_size");
+        if (! lua_istable(L, -1))
         {
-          int c = object_cast<int>(count);
-          printf("COUNT (BEFORE): %d\n", c);
-          c++;
-          ref[lightuserdata(L, val)] = c;
-          printf("COUNT (AFTER): %d\n", c);
+          lua_pop(L, 2);
+          return;
         }
-        else
+        lua_pushcfunction(L, key);
+        lua_rawget(L, -2);
+        typedef std::size_t (*size_func)(const T *);
+        size_func size = (size_func)lua_touserdata(L, -1);
+        lua_pop(L, 2);
+        if (! size)
         {
-          printf("COUNT (BEFORE): NIL\n");
-          ref[lightuserdata(L, val)] = 1;
-          printf("COUNT (AFTER): 1\n");
+          lua_pop(L, 1);
+          return;
+        }
+        std::size_t bytes = size(p);
+        if (bytes == 0)
+        {
+          lua_pop(L, 1);
+          return;
         }
+        lua_getfield(L, -1, "external_sizes");
+        lua_pushlightuserdata(L, (void *)p);
+        lua_pushnumber(L, (lua_Number)bytes);
+        lua_rawset(L, -3);
+        lua_pop(L, 2);
+        account_external(L, key, (double)bytes);
+        pay_external_debt(L, bytes);
       }
       else
       {
-        if (! ref[lightuserdata(L, val)])
+        lua_getfield(L, -1, "external_sizes");
+        lua_pushlightuserdata(L, (void *)p);
+        lua_rawget(L, -2);
+        if (lua_type(L, -1) != LUA_TNUMBER)
         {
-          ref[lightuserdata(L, val)] = 0;
+          lua_pop(L, 3);
+          return;
         }
+        double bytes = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        lua_pushlightuserdata(L, (void *)p);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+        lua_pop(L, 2);
+        account_external(L, key, - bytes);
       }
-  //printf("TYPE: %s\n", lua_typename(L, lua_type(L, -1)));
     }
 
-  } // namespace detail
-
-} // namespace luaport
 
+    inline void account_external(lua_State *L, lua_CFunction key, double bytes)
+    {
+      object port = registry(L)["luaport"];
+      object totals = port["func_to_bytes"];
+      totals[key] = object_cast<double>(totals[key]) + bytes;
+      port["external_bytes"] = object_cast<double>(port["external_bytes"]) + bytes;
+    }
 
-// -----------------------------------------------------
-// inner class implementation
-// -----------------------------------------------------
 
-namespace luaport
-{
+    // the external bytes adopted since the last completed cycle are a debt
+    // paid by the collector steps of 256 KB, until it is paid or a cycle
+    // completes (which has collected what could be collected anyway).
+    // while the host has stopped the collector, the debt is kept and paid
+    // on the next adoption after the restart.
+    inline void pay_external_debt(lua_State *L, std::size_t bytes)
+    {
+      lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+      lua_getfield(L, -1, "external_debt");
+      double debt = lua_tonumber(L, -1) + (double)bytes;
+      lua_pop(L, 1);
+      int running = 1;
+#ifdef LUA_GCISRUNNING
+      running = lua_gc(L, LUA_GCISRUNNING, 0);
+#endif
+      if (running)
+      {
+        const double step = 256 * 1024;
+        while (debt > 0)
+        {
+          double pay = debt < step ? debt : step;
+          if (lua_gc(L, LUA_GCSTEP, (int)(pay / 1024)))
+          {
+            debt = 0;
+            break;
+          }
+          debt -= pay;
+        }
+      }
+      lua_pushnumber(L, (lua_Number)debt);
+      lua_setfield(L, -2, "external_debt");
+      lua_pop(L, 1);
+    }
 
-  // cfunc_traits struct implementation
-  namespace detail
-  {
-    /// @cond DETAIL
 
-    // cfunc_traits 0
-    template <typename R, R (*f)(lua_State*)>
-      struct cfunc_traits<R (*)(lua_State*), f>
+    inline instance_counter *get_instance_counter(lua_State *L,
+                                                  lua_CFunction key)
     {
-      static std::string sign(lua_State *L)
+      lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+      if (! lua_istable(L, -1))
       {
-        return get_typename<R>(L) + " ()";
+        lua_pop(L, 1);
+        return NULL;
       }
-      static int call(void (*)(lua_State *), lua_State *L)
+      lua_getfield(L, -1, "func_to_stats");
+      if (! lua_istable(L, -1))
       {
-        (*f)(L);
-        return 0;
+        lua_pop(L, 2);
+        return NULL;
+      }
+      lua_pushcfunction(L, key);
+      lua_rawget(L, -2);
+      instance_counter *n = (instance_counter *)lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      if (! n)
+      {
+        lua_pushcfunction(L, key);
+        n = (instance_counter *)lua_newuserdata(L, sizeof(instance_counter));
+        n->live = n->pushes = n->adopted = n->borrowed = n->shared = 0;
+        n->instance_bytes = n->bytes = n->member_bytes = 0;
+        lua_rawset(L, -3);
+      }
+      lua_pop(L, 2);
+      return n;
+    }
+
+    // counter cached in the class metatable by newclass
+    inline instance_counter *class_counter(lua_State *L, const object &c,
+                                           lua_CFunction key)
+    {
+      instance_counter *n = NULL;
+      c.push();
+      if (lua_getmetatable(L, -1))
+      {
+        lua_pushliteral(L, "counter");
+        lua_rawget(L, -2);
+        n = (instance_counter *)lua_touserdata(L, -1);
+        lua_pop(L, 2);
+      }
+      lua_pop(L, 1);
+      return n ? n : get_instance_counter(L, key);
+    }
+
+
+    // makes the metatable of the instances of the class (at c) having the
+    // finalizer, the class metatable is at cm
+    inline void new_instance_metatable(lua_State *L, int c, int cm,
+                                       lua_CFunction gc, bool shared)
+    {
+      lua_createtable(L, 0, 8);
+      lua_pushvalue(L, c);
+      lua_setfield(L, -2, "class");
+      lua_pushboolean(L, 1);
+      lua_setfield(L, -2, "luaport");
+      if (shared)
+      {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "shared");
+      }
+      lua_pushcfunction(L, gc);
+      lua_setfield(L, -2, "__gc");
+      // for the members accounting
+      lua_pushliteral(L, "counter");
+      lua_rawget(L, cm);
+      lua_setfield(L, -2, "counter");
+      // methods are looked up by the VM directly from the class table,
+      // properties (get_xxx) and instance members need the C function
+      lua_pushliteral(L, "properties");
+      lua_rawget(L, cm);
+      if (lua_toboolean(L, -1)) { lua_pushcfunction(L, lua_class_get_member); }
+      else { lua_pushvalue(L, c); }
+      lua_setfield(L, -3, "__index");
+      lua_pop(L, 1);
+      lua_pushcfunction(L, lua_class_set_member);
+      lua_setfield(L, -2, "__newindex");
+      // operators and the other metamethods set by set_metamethod
+      lua_pushliteral(L, "metamethods");
+      lua_rawget(L, cm);
+      if (lua_istable(L, -1))
+      {
+        lua_pushnil(L);
+        while (lua_next(L, -2))
+        {
+          lua_pushvalue(L, -2);
+          lua_insert(L, -2);
+          lua_rawset(L, -5);
+        }
+      }
+      lua_pop(L, 1);
+    }
+
+
+    // sets the metamethod (at f) on the class metatable (at cm) and on its
+    // instance metatables made so far, and so on the derived classes still
+    // inheriting the previous one (at old)
+    inline void set_class_metamethod(lua_State *L, int cm, const char *event,
+                                     int f, int old)
+    {
+      luaL_checkstack(L, 6, "set_metamethod");
+      cm = lua_absindex(L, cm);
+      f = lua_absindex(L, f);
+      old = lua_absindex(L, old);
+      lua_pushliteral(L, "metamethods");
+      lua_rawget(L, cm);
+      if (! lua_istable(L, -1))
+      {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushliteral(L, "metamethods");
+        lua_pushvalue(L, -2);
+        lua_rawset(L, cm);
+      }
+      lua_pushstring(L, event);
+      lua_pushvalue(L, f);
+      lua_rawset(L, -3);
+      lua_pop(L, 1);
+      lua_pushliteral(L, "instance_metatables");
+      lua_rawget(L, cm);
+      if (lua_istable(L, -1))
+      {
+        lua_pushnil(L);
+        while (lua_next(L, -2))
+        {
+          lua_pushstring(L, event);
+          lua_pushvalue(L, f);
+          lua_rawset(L, -3);
+          lua_pop(L, 1);
+        }
+      }
+      lua_pop(L, 1);
+      // derived classes copied the metamethods at the registration
+      lua_pushliteral(L, "derived");
+      lua_rawget(L, cm);
+      if (lua_istable(L, -1))
+      {
+        int n = (int)lua_rawlen(L, -1);
+        for (int i = 1; i <= n; i++)
+        {
+          lua_rawgeti(L, -1, i);
+          if (lua_getmetatable(L, -1))
+          {
+            lua_pushliteral(L, "metamethods");
+            lua_rawget(L, -2);
+            if (lua_istable(L, -1)) { lua_getfield(L, -1, event); }
+            else { lua_pushnil(L); }
+            if (lua_isnil(L, -1) || lua_rawequal(L, -1, old))
+            {
+              set_class_metamethod(L, -3, event, f, -1);
+            }
+            lua_pop(L, 3);
+          }
+          lua_pop(L, 1);
+        }
+      }
+      lua_pop(L, 1);
+    }
+
+
+    // the instances of a class share one metatable for each finalizer
+    // (class metatable "instance_metatables"[gc]), made on the first push
+    inline void set_instance_metatable(lua_State *L, const object &c,
+                                       lua_CFunction gc, bool shared)
+    {
+      luaL_checkstack(L, 8, "set_instance_metatable");
+      int u = lua_gettop(L);
+      c.push();
+      if (! lua_getmetatable(L, u + 1))
+      {
+        // not registered by newclass, nothing to cache the metatable in
+        lua_newtable(L);
+        new_instance_metatable(L, u + 1, u + 2, gc, shared);
+        lua_setmetatable(L, u);
+        lua_settop(L, u);
+        return;
+      }
+      lua_pushliteral(L, "instance_metatables");
+      lua_rawget(L, u + 2);
+      if (! lua_istable(L, -1))
+      {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushliteral(L, "instance_metatables");
+        lua_pushvalue(L, -2);
+        lua_rawset(L, u + 2);
+      }
+      lua_pushcfunction(L, gc);
+      lua_rawget(L, u + 3);
+      if (lua_isnil(L, -1))
+      {
+        lua_pop(L, 1);
+        new_instance_metatable(L, u + 1, u + 2, gc, shared);
+        lua_pushcfunction(L, gc);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, u + 3);
+      }
+      lua_setmetatable(L, u);
+      lua_settop(L, u);
+    }
+
+
+#ifdef LUAPORT_CXX11
+    template <typename T>
+      inline void push(lua_State *L, const std::shared_ptr<T> &val)
+    {
+      if (! val)
+      {
+        lua_pushnil(L);
+        return;
+      }
+      object c = get_class<T>(L);
+      if (! c.is_valid())
+      {
+        std::string msg = "unregistered class: ";
+        throw luaport::exception(msg + typeid(T).name());
+      }
+      // the count is kept by the control block, no registry bookkeeping
+      void *mem = lua_newuserdata(L, sizeof(shared_holder<T>));
+      shared_holder<T> *u = new(mem) shared_holder<T>();
+      u->p = val.get();
+      u->sp = val;
+      set_instance_metatable(L, c, finalizer<shared_holder<T>*>::lfunc, true);
+      u->counter = class_counter(L, c, finalizer<managed<T>*>::lfunc);
+      count_push(u->counter, &instance_counter::shared, sizeof(shared_holder<T>));
+    }
+    template <typename T>
+      inline void push(lua_State *L, std::unique_ptr<T> &&val)
+    {
+      push(L, std::shared_ptr<T>(std::move(val)));
+    }
+    template <typename T>
+      inline void push_shared_instance(lua_State *L, void *u)
+    {
+      shared_holder<T> *h = (shared_holder<T> *)u;
+      push(L, std::shared_ptr<T>(h->sp, (T *)h->p));
+    }
+#endif
+
+
+    // avoiding from the compiler confusing
+    template <>
+      inline void push(lua_State *L, lua_CFunction val, bool adopt)
+    {
+      lua_pushcfunction(L, val);
+    }
+    template <typename T>
+      inline void push(lua_State *L, T *val, bool adopt)
+    {
+  LUAPORT_TRACE(("PUSH UDATA: %p\n", val));
+      object c = get_class<T>(L);
+      if (! c.is_valid())
+      {
+        std::string msg = "unregistered class: ";
+        throw luaport::exception(msg + typeid(T).name());
+      }
+      instance_counter *n = class_counter(L, c, finalizer<managed<T>*>::lfunc);
+      new(L) managed<T>(L, val, adopt, n);
+      set_instance_metatable(L, c, finalizer<managed<T>*>::lfunc);
+      count_push(n, adopt ? &instance_counter::adopted : &instance_counter::borrowed,
+                 sizeof(managed<T>));
+
+      LUAPORT_TRACE(("REGISTER REFERENCE: %p\n", val));
+      object ref = registry(L)["luaport"]["references"];
+      object count = ref[lightuserdata(L, val)];
+      if (adopt)
+      {
+        if (count.type() == LUA_TNUMBER)
+        {
+          int c = object_cast<int>(count);
+          LUAPORT_TRACE(("COUNT (BEFORE): %d\n", c));
+          c++;
+          ref[lightuserdata(L, val)] = c;
+          LUAPORT_TRACE(("COUNT (AFTER): %d\n", c));
+        }
+        else
+        {
+          LUAPORT_TRACE(("COUNT (BEFORE): NIL\n"));
+          ref[lightuserdata(L, val)] = 1;
+          LUAPORT_TRACE(("COUNT (AFTER): 1\n"));
+        }
+        if (object_cast<int>(ref[lightuserdata(L, val)]) == 1)
+        {
+          account_external(L, val, true);
+        }
+      }
+      else
+      {
+        if (! ref[lightuserdata(L, val)])
+        {
+          ref[lightuserdata(L, val)] = 0;
+        }
+      }
+  //printf("TYPE: %s\n", lua_typename(L, lua_type(L, -1)));
+    }
+
+
+    // class of the value_holder<T> to be pushed (checked before allocating)
+    template <typename T>
+      inline object value_class(lua_State *L)
+    {
+      object c = get_class<T>(L);
+      if (! c.is_valid())
+      {
+        std::string msg = "unregistered class: ";
+        throw luaport::exception(msg + typeid(T).name());
+      }
+      return c;
+    }
+    // set the metatable of the value_holder<T> on the stack top
+    template <typename T>
+      inline void init_value(lua_State *L, const object &c)
+    {
+      lua_CFunction gc = finalizer<value_holder<T>*>::lfunc;
+      set_instance_metatable(L, c, gc);
+      instance_counter *n = class_counter(L, c, finalizer<managed<T>*>::lfunc);
+      ((value_holder<T> *)lua_touserdata(L, -1))->counter = n;
+      count_push(n, &instance_counter::adopted, sizeof(value_holder<T>));
+      // registered on the first value, as the copy needs the copy constructor
+      lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+      lua_getfield(L, -1, "func_to_push");
+      lua_pushcfunction(L, gc);
+      lua_rawget(L, -2);
+      if (lua_isnil(L, -1))
+      {
+        lua_pushcfunction(L, gc);
+        lua_pushlightuserdata(L, (void *)push_value_instance<T>);
+        lua_rawset(L, -4);
+      }
+      lua_pop(L, 3);
+    }
+    template <typename T>
+      inline void push_value(lua_State *L, const T &val)
+    {
+      object c = value_class<T>(L);
+      new(lua_newuserdata(L, sizeof(value_holder<T>))) value_holder<T>(L, val);
+      init_value<T>(L, c);
+    }
+#ifdef LUAPORT_CXX11
+    template <typename T>
+      inline void push_value(lua_State *L, T &&val)
+    {
+      object c = value_class<T>(L);
+      new(lua_newuserdata(L, sizeof(value_holder<T>))) value_holder<T>(L, std::move(val));
+      init_value<T>(L, c);
+    }
+#endif
+    template <typename T>
+      inline void push_value_instance(lua_State *L, void *u)
+    {
+      push_value<T>(L, *((value_holder<T> *)u)->p);
+    }
+
+
+    template <typename T>
+      inline void push_result(lua_State *L, T *p, policy::copy)
+    {
+      push_value<T>(L, *p);
+    }
+    template <typename T>
+      inline void push_result(lua_State *L, T *p, policy::move)
+    {
+#ifdef LUAPORT_CXX11
+      push_value<T>(L, std::move(*p));
+#else
+      push_value<T>(L, *p);
+#endif
+    }
+    template <typename T>
+      inline void push_result(lua_State *L, T *p, policy::reference)
+    {
+      push(L, p, false);
+    }
+    template <typename T>
+      inline void push_result(lua_State *L, T *p, policy::internal_reference)
+    {
+      push(L, p, false);
+      // the instance metatable refers to the first argument
+      lua_getmetatable(L, -1);
+      lua_pushvalue(L, 1);
+      lua_setfield(L, -2, "parent");
+      lua_pop(L, 1);
+    }
+    template <typename T>
+      inline void push_result(lua_State *L, T *p, policy::take_ownership)
+    {
+      push(L, p, true);
+    }
+
+  } // namespace detail
+
+} // namespace luaport
+
+
+// -----------------------------------------------------
+// inner class implementation
+// -----------------------------------------------------
+
+namespace luaport
+{
+
+#ifdef LUAPORT_PROFILE
+  // profiler implementation
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    const int profile_nbuckets = 64;
+
+    // time stamp counter (or nanoseconds where it isn't available)
+    inline unsigned long long profile_ticks()
+    {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+      return __builtin_ia32_rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // measured once against the steady clock
+    inline double profile_ns_per_tick()
+    {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+      struct measure
+      {
+        static void run(double *ratio)
+        {
+          std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+          unsigned long long c0 = profile_ticks();
+          std::chrono::steady_clock::time_point t1;
+          do {
+            t1 = std::chrono::steady_clock::now();
+          } while (t1 - t0 < std::chrono::milliseconds(2));
+          unsigned long long c1 = profile_ticks();
+          *ratio = std::chrono::duration<double, std::nano>(t1 - t0).count() / (c1 - c0);
+        }
+      };
+      // snapshots may be taken by several threads at once
+      static std::once_flag once;
+      static double ratio = 0;
+      std::call_once(once, measure::run, &ratio);
+      return ratio;
+#else
+      return 1;
+#endif
+    }
+
+    // counters of one binding in one thread, written only by the thread
+    struct profile_entry
+    {
+      profile_entry() : calls(0), ticks(0)
+      {
+        for (int i = 0; i < profile_nbuckets; i++) { buckets[i] = 0; }
+      }
+
+      void add(unsigned long long dt)
+      {
+        int b = 0;
+        while (b < profile_nbuckets - 1 && (dt >> b) > 0) { b++; }
+        // single writer, relaxed load + store is enough
+        calls.store(calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        ticks.store(ticks.load(std::memory_order_relaxed) + dt, std::memory_order_relaxed);
+        buckets[b].store(buckets[b].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      }
+
+      std::string name;
+      std::atomic<unsigned long long> calls;
+      std::atomic<unsigned long long> ticks;
+      // bucket i counts durations below 2^i ticks
+      std::atomic<unsigned long long> buckets[profile_nbuckets];
+    };
+
+    // accumulators of one thread
+    struct profile_thread
+    {
+      std::mutex mutex; // guards inserting into the maps against snapshots
+      // bindings by the C function
+      std::unordered_map<const void *, std::unique_ptr<profile_entry> > entries;
+      // lua callbacks by the name of the prototype, as the closures may be
+      // made per call and their addresses reused after the collection
+      std::unordered_map<std::string, std::unique_ptr<profile_entry> > callbacks;
+    };
+
+    struct profile_threads
+    {
+      std::mutex mutex;
+      std::vector<std::shared_ptr<profile_thread> > list;
+    };
+
+    inline profile_threads &profile_all()
+    {
+      static profile_threads all;
+      return all;
+    }
+
+    inline profile_thread &profile_local()
+    {
+      thread_local std::shared_ptr<profile_thread> local;
+      if (! local)
+      {
+        local = std::make_shared<profile_thread>();
+        profile_threads &all = profile_all();
+        std::lock_guard<std::mutex> lock(all.mutex);
+        all.list.push_back(local);
+      }
+      return *local;
+    }
+
+    typedef std::string (*profile_namer)(lua_State *L);
+
+    // "Class.method" given by the registration of the running C function
+    // (see lua_class_define), or the name at the call site otherwise
+    inline std::string profile_binding_name(lua_State *L)
+    {
+      lua_Debug ar;
+      ar.name = NULL;
+      ar.namewhat = NULL;
+      std::string name = "?";
+      if (lua_getstack(L, 0, &ar) && lua_getinfo(L, "f", &ar))
+      {
+        lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+        if (lua_istable(L, -1))
+        {
+          lua_getfield(L, -1, "func_to_name");
+          if (lua_istable(L, -1))
+          {
+            lua_pushvalue(L, -3);
+            lua_rawget(L, -2);
+            if (lua_isstring(L, -1)) { name = lua_tostring(L, -1); }
+            lua_pop(L, 1);
+          }
+          lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+        if (name != "?") { return name; }
+      }
+      if (lua_getstack(L, 0, &ar) && lua_getinfo(L, "n", &ar) && ar.name)
+      {
+        name = ar.name;
+      }
+      if (ar.namewhat && std::string(ar.namewhat) == "method" &&
+          lua_getmetatable(L, 1))
+      {
+        lua_getfield(L, -1, "class");
+        lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+        if (lua_istable(L, -1))
+        {
+          lua_getfield(L, -1, "class_to_name");
+          lua_pushvalue(L, -3);
+          lua_rawget(L, -2);
+          if (lua_isstring(L, -1))
+          {
+            name = std::string(lua_tostring(L, -1)) + "." + name;
+          }
+          lua_pop(L, 2);
+        }
+        lua_pop(L, 3);
+      }
+      return name;
+    }
+
+    // "lua:source:line" of the lua function on the stack top
+    inline std::string profile_callback_name(lua_State *L)
+    {
+      lua_Debug ar;
+      lua_pushvalue(L, -1);
+      if (! lua_getinfo(L, ">S", &ar)) { return "lua:?"; }
+      char line[32];
+      std::sprintf(line, ":%d", ar.linedefined);
+      return std::string("lua:") + ar.short_src + line;
+    }
+
+    inline profile_entry *profile_entry_for(const void *key, lua_State *L,
+                                            profile_namer namer)
+    {
+      profile_thread &local = profile_local();
+      std::unordered_map<const void *, std::unique_ptr<profile_entry> >::iterator i =
+        local.entries.find(key);
+      if (i != local.entries.end()) { return i->second.get(); }
+      // named once per thread, on the first call
+      std::unique_ptr<profile_entry> e(new profile_entry());
+      e->name = namer(L);
+      profile_entry *p = e.get();
+      std::lock_guard<std::mutex> lock(local.mutex);
+      local.entries[key] = std::move(e);
+      return p;
+    }
+
+    // entry of the lua function on the stack top
+    inline profile_entry *profile_callback_entry(lua_State *L)
+    {
+      profile_thread &local = profile_local();
+      std::string name = profile_callback_name(L);
+      std::unordered_map<std::string, std::unique_ptr<profile_entry> >::iterator i =
+        local.callbacks.find(name);
+      if (i != local.callbacks.end()) { return i->second.get(); }
+      std::unique_ptr<profile_entry> e(new profile_entry());
+      e->name = name;
+      profile_entry *p = e.get();
+      std::lock_guard<std::mutex> lock(local.mutex);
+      local.callbacks[name] = std::move(e);
+      return p;
+    }
+
+    // measures the scope (not recorded when left by a lua error)
+    class profile_scope
+    {
+      public:
+        explicit profile_scope(profile_entry *e)
+          : e(e), t0(profile_ticks())
+        { }
+        ~profile_scope() { e->add(profile_ticks() - t0); }
+
+      private:
+        profile_entry *e;
+        unsigned long long t0;
+    };
+
+    inline int lua_profile_snapshot(lua_State *L)
+    {
+      luaport::profile_snapshot(L).push();
+      return 1;
+    }
+
+    inline int lua_profile_reset(lua_State *L)
+    {
+      luaport::profile_reset();
+      return 0;
+    }
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+#  define LUAPORT_PROFILE_BINDING(L, func) \
+     detail::profile_scope luaport_profile_scope_(detail::profile_entry_for( \
+       reinterpret_cast<const void *>(func), L, detail::profile_binding_name))
+#  define LUAPORT_PROFILE_CALLBACK(L) \
+     detail::profile_scope luaport_profile_scope_(detail::profile_callback_entry(L))
+#else
+#  define LUAPORT_PROFILE_BINDING(L, func) ((void)0)
+#  define LUAPORT_PROFILE_CALLBACK(L) ((void)0)
+#endif // LUAPORT_PROFILE
+
+  // cfunc_traits struct implementation
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // class types other than the ones converted to lua values by push,
+    // the results of these types are pushed as instances
+    template <typename T>
+      struct is_instance
+    {
+      template <typename U> static char test(int U::*);
+      template <typename U> static long test(...);
+      static const bool value = sizeof(test<T>(0)) == 1;
+    };
+    template <typename T>
+      struct is_instance<const T> : public is_instance<T> { };
+    #define LUAPORT_NOT_INSTANCE(T) \
+      template <> \
+        struct is_instance<T> { static const bool value = false; };
+    LUAPORT_NOT_INSTANCE(std::string)
+    LUAPORT_NOT_INSTANCE(luaport::object)
+    LUAPORT_NOT_INSTANCE(luaport::proxy)
+    LUAPORT_NOT_INSTANCE(shared_binding)
+    #undef LUAPORT_NOT_INSTANCE
+    template <typename T>
+      struct is_instance<luaport::reference<T> > { static const bool value = false; };
+#ifdef LUAPORT_CXX11
+    template <typename T>
+      struct is_instance<std::shared_ptr<T> > { static const bool value = false; };
+    template <typename T>
+      struct is_instance<std::unique_ptr<T> > { static const bool value = false; };
+#endif
+
+    // 0: converted by push, 1: instance by value, 2: by reference,
+    // 3: by pointer, 4: multiple values
+    template <typename R>
+      struct result_kind
+    {
+      static const int value = is_instance<R>::value ? 1 : 0;
+    };
+    template <typename T>
+      struct result_kind<T &>
+    {
+      static const int value = is_instance<T>::value ? 2 : 0;
+    };
+    template <typename T>
+      struct result_kind<T *>
+    {
+      static const int value = is_instance<T>::value ? 3 : 0;
+    };
+    template <typename A, typename B>
+      struct result_kind<std::pair<A, B> >
+    {
+      static const int value = 4;
+    };
+#ifdef LUAPORT_CXX11
+    template <typename... E>
+      struct result_kind<std::tuple<E...> >
+    {
+      static const int value = 4;
+    };
+#endif
+
+    // P, or D for policy::automatic
+    template <typename P, typename D>
+      struct policy_or
+    {
+      typedef P type;
+    };
+    template <typename D>
+      struct policy_or<policy::automatic, D>
+    {
+      typedef D type;
+    };
+
+    // pushes the result of the binding by the return value policy P,
+    // returns the number of the pushed values
+    template <typename R, typename P, int K = result_kind<R>::value>
+      struct return_traits
+    {
+#ifdef LUAPORT_CXX11
+      template <typename U>
+        static int push(lua_State *L, U &&r)
+      {
+        luaport::push(L, std::forward<U>(r));
+        return 1;
+      }
+#else
+      template <typename U>
+        static int push(lua_State *L, const U &r)
+      {
+        luaport::push(L, r);
+        return 1;
+      }
+#endif
+    };
+    // the temporary is moved whatever the policy is
+    template <typename R, typename P>
+      struct return_traits<R, P, 1>
+    {
+      typedef typename type_traits<R>::natural T;
+      static int push(lua_State *L, const T &r)
+      {
+        push_value<T>(L, r);
+        return 1;
+      }
+#ifdef LUAPORT_CXX11
+      static int push(lua_State *L, T &&r)
+      {
+        push_value<T>(L, std::move(r));
+        return 1;
+      }
+#endif
+    };
+    template <typename R, typename P>
+      struct return_traits<R &, P, 2>
+    {
+      typedef typename type_traits<R>::natural T;
+      static int push(lua_State *L, R &r)
+      {
+        push_result(L, const_cast<T *>(&r),
+                    typename policy_or<P, policy::copy>::type());
+        return 1;
+      }
+    };
+    template <typename R, typename P>
+      struct return_traits<R *, P, 3>
+    {
+      typedef typename type_traits<R>::natural T;
+      static int push(lua_State *L, R *r)
+      {
+        if (! r)
+        {
+          lua_pushnil(L);
+          return 1;
+        }
+        push_result(L, const_cast<T *>(r),
+                    typename policy_or<P, policy::reference>::type());
+        return 1;
+      }
+    };
+    // the elements are pushed as separate values (local a, b = f())
+    template <typename A, typename B, typename P>
+      struct return_traits<std::pair<A, B>, P, 4>
+    {
+      static int push(lua_State *L, const std::pair<A, B> &r)
+      {
+        int n = return_traits<A, P>::push(L, r.first);
+        return n + return_traits<B, P>::push(L, r.second);
+      }
+#ifdef LUAPORT_CXX11
+      static int push(lua_State *L, std::pair<A, B> &&r)
+      {
+        int n = return_traits<A, P>::push(L, std::forward<A>(r.first));
+        return n + return_traits<B, P>::push(L, std::forward<B>(r.second));
+      }
+#endif
+    };
+#ifdef LUAPORT_CXX11
+    // pushes the elements from I-th of the tuple (Tu may be const)
+    template <typename Tu, typename P, std::size_t I, std::size_t N>
+      struct tuple_pusher
+    {
+      static int push(lua_State *L, Tu &t)
+      {
+        typedef typename std::tuple_element<I, Tu>::type E;
+        int n = return_traits<E, P>::push(L, std::forward<E>(std::get<I>(t)));
+        return n + tuple_pusher<Tu, P, I + 1, N>::push(L, t);
+      }
+    };
+    template <typename Tu, typename P, std::size_t N>
+      struct tuple_pusher<Tu, P, N, N>
+    {
+      static int push(lua_State *, Tu &) { return 0; }
+    };
+    template <typename P, typename... E>
+      struct return_traits<std::tuple<E...>, P, 4>
+    {
+      static int push(lua_State *L, const std::tuple<E...> &r)
+      {
+        return tuple_pusher<const std::tuple<E...>, P, 0, sizeof...(E)>::push(L, r);
+      }
+      static int push(lua_State *L, std::tuple<E...> &&r)
+      {
+        return tuple_pusher<std::tuple<E...>, P, 0, sizeof...(E)>::push(L, r);
+      }
+    };
+#endif
+
+    // local variable receiving the argument of the binding, instances are
+    // referred in place for T, T& and const T& parameters (not copied)
+    template <typename T,
+              bool I = is_instance<typename type_traits<T>::natural>::value>
+      struct param_traits
+    {
+      typedef typename type_traits<T>::natural type;
+      static type get(lua_State *L, int i)
+      {
+        return object_cast<type>(from_stack(L, i));
+      }
+    };
+    template <typename T>
+      struct param_traits<T, true>
+    {
+      typedef typename type_traits<T>::natural natural;
+      typedef natural &type;
+      static type get(lua_State *L, int i)
+      {
+        void *p;
+        if (! to_instance(L, i, finalizer<managed<natural>*>::lfunc, &p))
+        {
+          throw std::bad_cast();
+        }
+        return *(natural *)p;
+      }
+    };
+    // pointers to instances (including self of the methods) are read
+    // directly from the stack, without making any object
+    template <typename T,
+              bool I = is_instance<typename type_traits<T>::natural>::value>
+      struct pointer_param
+    {
+      typedef T *type;
+      static type get(lua_State *L, int i)
+      {
+        return object_cast<T *>(from_stack(L, i));
+      }
+    };
+    template <typename T>
+      struct pointer_param<T, true>
+    {
+      typedef T *type;
+      static type get(lua_State *L, int i)
+      {
+        typedef typename type_traits<T>::natural natural;
+        void *p;
+        if (! to_instance(L, i, finalizer<managed<natural>*>::lfunc, &p))
+        {
+          throw std::bad_cast();
+        }
+        return (T *)p;
+      }
+    };
+    template <typename T>
+      struct param_traits<T *, false> : public pointer_param<T>
+    {
+    };
+
+    // cfunc_traits 0
+    template <typename R, R (*f)(lua_State*), typename P>
+      struct cfunc_traits<R (*)(lua_State*), f, P>
+    {
+      static std::string sign(lua_State *L)
+      {
+        return get_typename<R>(L) + " ()";
+      }
+      static int call(void (*)(lua_State *), lua_State *L)
+      {
+        (*f)(L);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State *), lua_State *L)
+      {
+        return return_traits<T0, P>::push(L, (*f)(L));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, lfunc);
+        try {
+          return call(f, L);
+        }
+        catch (...) {
+          lua_error_signature_of(L, sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, R (*f)(), typename P>
+      struct cfunc_traits<R (*)(), f, P>
+    {
+      typedef cfunc_traits<R (*)(),f, P> thisclass;
+      static R wrap(lua_State *L)
+      {
+        return f();
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(lua_State*), thisclass::wrap, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, R (C::*m)(), typename P>
+      struct cfunc_traits<R (C::*)(), m, P>
+    {
+      typedef cfunc_traits<R (C::*)(),m, P> thisclass;
+      static R flatten(C *c)
+      {
+        return (c->*m)();
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, R (C::*m)() const, typename P>
+      struct cfunc_traits<R (C::*)() const, m, P>
+    {
+      typedef cfunc_traits<R (C::*)() const,m, P> thisclass;
+      static R flatten(C *c)
+      {
+        return (c->*m)();
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+
+    // cfunc_traits 1
+    template <typename R, typename T1, R (*f)(lua_State*,T1), typename P>
+      struct cfunc_traits<R (*)(lua_State*,T1), f, P>
+    {
+      static std::string sign(lua_State *L)
+      {
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) + ")";
+      }
+      static int call(void (*)(lua_State *,T1), lua_State *L, T1 a1)
+      {
+        (*f)(L, a1);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State *,T1), lua_State *L, T1 a1)
+      {
+        return return_traits<T0, P>::push(L, (*f)(L,a1));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, lfunc);
+        try {
+          typename param_traits<T1>::type arg1 = param_traits<T1>::get(L, 1);
+          return call(f, L, arg1);
+        }
+        catch (...) {
+          lua_error_signature_of(L, sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, R (*f)(T1), typename P>
+      struct cfunc_traits<R (*)(T1), f, P>
+    {
+      typedef cfunc_traits<R (*)(T1),f, P> thisclass;
+      static R wrap(lua_State *L, T1 a1)
+      {
+        return f(a1);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(lua_State*,T1), thisclass::wrap, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, R (C::*m)(T1), typename P>
+      struct cfunc_traits<R (C::*)(T1), m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1), m, P> thisclass;
+      static R flatten(C *c, T1 a1)
+      {
+        return (c->*m)(a1);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, R (C::*m)(T1) const, typename P>
+      struct cfunc_traits<R (C::*)(T1) const, m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1) const, m, P> thisclass;
+      static R flatten(C *c, T1 a1)
+      {
+        return (c->*m)(a1);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+
+    // cfunc_traits 2
+    template <typename R, typename T1, typename T2,
+              R (*f)(lua_State*, T1, T2), typename P>
+      struct cfunc_traits<R (*)(lua_State*, T1, T2), f, P>
+    {
+      static std::string sign(lua_State *L)
+      {
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) + ")";
+      }
+      static int call(void (*)(lua_State *,T1,T2), lua_State *L,
+                      T1 a1, T2 a2)
+      {
+        (*f)(L, a1, a2);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State *,T1,T2), lua_State *L,
+                        T1 a1, T2 a2)
+      {
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, lfunc);
+        try {
+          typename param_traits<T1>::type arg1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type arg2 = param_traits<T2>::get(L, 2);
+          return call(f, L, arg1, arg2);
+        }
+        catch (...) {
+          lua_error_signature_of(L, sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, R (*f)(T1, T2), typename P>
+      struct cfunc_traits<R (*)(T1, T2), f, P>
+    {
+      typedef cfunc_traits<R (*)(T1,T2),f, P> thisclass;
+      static R wrap(lua_State *L, T1 a1, T2 a2)
+      {
+        return f(a1, a2);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(lua_State*,T1,T2), thisclass::wrap, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2,
+              R (C::*m)(T1, T2), typename P>
+      struct cfunc_traits<R (C::*)(T1, T2), m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2),m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2)
+      {
+        return (c->*m)(a1, a2);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2,
+              R (C::*m)(T1, T2) const, typename P>
+      struct cfunc_traits<R (C::*)(T1, T2) const, m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2) const,m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2)
+      {
+        return (c->*m)(a1, a2);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+
+    // cfunc_traits 3
+    template <typename R, typename T1, typename T2, typename T3,
+              R (*f)(lua_State*, T1, T2, T3), typename P>
+      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3), f, P>
+    {
+      typedef R (*ftype)(lua_State*,T1,T2,T3);
+      static std::string sign(lua_State *L)
+      {
+       return get_typename<R>(L) +
+              " (" + get_typename<T1>(L) +
+              ", " + get_typename<T2>(L) +
+              ", " + get_typename<T3>(L) + ")";
+      }
+      static int call(void (*)(lua_State *,T1,T2,T3), lua_State *L,
+                      T1 a1, T2 a2, T3 a3)
+      {
+        (*f)(L, a1, a2, a3);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State *,T1,T2,T3), lua_State *L,
+                        T1 a1, T2 a2, T3 a3)
+      {
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, lfunc);
+        try {
+          typename param_traits<T1>::type arg1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type arg2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type arg3 = param_traits<T3>::get(L, 3);
+          return call(f, L, arg1, arg2, arg3);
+        }
+        catch (...) {
+          lua_error_signature_of(L, sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, typename T3, R (*f)(T1, T2, T3), typename P>
+      struct cfunc_traits<R (*)(T1, T2, T3), f, P>
+    {
+      typedef cfunc_traits<R (*)(T1,T2,T3),f, P> thisclass;
+      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3)
+      {
+        return f(a1, a2, a3);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3), thisclass::wrap, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              R (C::*m)(T1, T2, T3), typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3), m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3),m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3)
+      {
+        return (c->*m)(a1, a2, a3);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              R (C::*m)(T1, T2, T3) const, typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3) const, m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3) const,m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3)
+      {
+        return (c->*m)(a1, a2, a3);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+
+    // cfunc_traits 4
+    template <typename R, typename T1, typename T2, typename T3,
+              typename T4, R (*f)(lua_State*, T1, T2, T3, T4), typename P>
+      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3, T4), f, P>
+    {
+      typedef R (*ftype)(lua_State*,T1,T2,T3,T4);
+      static std::string sign(lua_State *L)
+      {
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) +
+               ", " + get_typename<T3>(L) +
+               ", " + get_typename<T4>(L) + ")";
+      }
+      static int call(void (*)(lua_State *,T1,T2,T3,T4), lua_State *L,
+                      T1 a1, T2 a2, T3 a3, T4 a4)
+      {
+        (*f)(L, a1, a2, a3, a4);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State *,T1,T2,T3,T4), lua_State *L,
+                        T1 a1, T2 a2, T3 a3, T4 a4)
+      {
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3, a4));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, lfunc);
+        try {
+          typename param_traits<T1>::type arg1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type arg2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type arg3 = param_traits<T3>::get(L, 3);
+          typename param_traits<T4>::type arg4 = param_traits<T4>::get(L, 4);
+          return call(f, L, arg1, arg2, arg3, arg4);
+        }
+        catch (...) {
+          lua_error_signature_of(L, sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, typename T3,
+              typename T4, R (*f)(T1, T2, T3, T4), typename P>
+      struct cfunc_traits<R (*)(T1, T2, T3, T4), f, P>
+    {
+      typedef cfunc_traits<R (*)(T1,T2,T3,T4),f, P> thisclass;
+      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4)
+      {
+        return f(a1, a2, a3, a4);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4), thisclass::wrap, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              typename T4, R (C::*m)(T1, T2, T3, T4), typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3, T4), m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4),m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4)
+      {
+        return (c->*m)(a1, a2, a3, a4);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3,T4), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              typename T4, R (C::*m)(T1, T2, T3, T4) const, typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3, T4) const, m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4) const,m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4)
+      {
+        return (c->*m)(a1, a2, a3, a4);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3,T4), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+
+    // cfunc_traits 5
+    template <typename R, typename T1, typename T2, typename T3, typename T4,
+              typename T5, R (*f)(lua_State*, T1, T2, T3, T4, T5), typename P>
+      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3, T4, T5), f, P>
+    {
+      typedef R (*ftype)(lua_State*,T1,T2,T3,T4,T5);
+      static std::string sign(lua_State *L)
+      {
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) +
+               ", " + get_typename<T3>(L) +
+               ", " + get_typename<T4>(L) +
+               ", " + get_typename<T5>(L) + ")";
+      }
+      static int call(void (*)(lua_State *,T1,T2,T3,T4,T5), lua_State *L,
+                      T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      {
+        (*f)(L, a1, a2, a3, a4, a5);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State *,T1,T2,T3,T4,T5), lua_State *L,
+                        T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      {
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3, a4, a5));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, lfunc);
+        try {
+          typename param_traits<T1>::type arg1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type arg2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type arg3 = param_traits<T3>::get(L, 3);
+          typename param_traits<T4>::type arg4 = param_traits<T4>::get(L, 4);
+          typename param_traits<T5>::type arg5 = param_traits<T5>::get(L, 5);
+          return call(f, L, arg1, arg2, arg3, arg4, arg5);
+        }
+        catch (...) {
+          lua_error_signature_of(L, sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, typename T3, typename T4,
+              typename T5, R (*f)(T1, T2, T3, T4, T5), typename P>
+      struct cfunc_traits<R (*)(T1, T2, T3, T4, T5), f, P>
+    {
+      typedef cfunc_traits<R (*)(T1,T2,T3,T4,T5),f, P> thisclass;
+      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      {
+        return f(a1, a2, a3, a4, a5);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5), thisclass::wrap, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              typename T4, typename T5, R (C::*m)(T1, T2, T3, T4, T5), typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5), m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5),m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      {
+        return (c->*m)(a1, a2, a3, a4, a5);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              typename T4, typename T5, R (C::*m)(T1, T2, T3, T4, T5) const, typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5) const, m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5) const,m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      {
+        return (c->*m)(a1, a2, a3, a4, a5);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+
+    // cfunc_traits 6
+    template <typename R, typename T1, typename T2, typename T3, typename T4,
+              typename T5, typename T6,
+              R (*f)(lua_State*, T1, T2, T3, T4, T5, T6), typename P>
+      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6), f, P>
+    {
+      typedef R (*ftype)(lua_State*,T1,T2,T3,T4,T5,T6);
+      static std::string sign(lua_State *L)
+      {
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) +
+               ", " + get_typename<T3>(L) +
+               ", " + get_typename<T4>(L) +
+               ", " + get_typename<T5>(L) +
+               ", " + get_typename<T6>(L) + ")";
+      }
+      static int call(void (*)(lua_State *,T1,T2,T3,T4,T5,T6), lua_State *L,
+                      T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      {
+        (*f)(L, a1, a2, a3, a4, a5, a6);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State *,T1,T2,T3,T4,T5,T6), lua_State *L,
+                        T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      {
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3, a4, a5, a6));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, lfunc);
+        try {
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type a2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type a3 = param_traits<T3>::get(L, 3);
+          typename param_traits<T4>::type a4 = param_traits<T4>::get(L, 4);
+          typename param_traits<T5>::type a5 = param_traits<T5>::get(L, 5);
+          typename param_traits<T6>::type a6 = param_traits<T6>::get(L, 6);
+          return call(f,L,a1,a2,a3,a4,a5,a6);
+        }
+        catch (...) {
+          lua_error_signature_of(L, sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, typename T3, typename T4,
+              typename T5, typename T6, R (*f)(T1, T2, T3, T4, T5, T6), typename P>
+      struct cfunc_traits<R (*)(T1, T2, T3, T4, T5, T6), f, P>
+    {
+      typedef cfunc_traits<R (*)(T1,T2,T3,T4,T5,T6),f, P> thisclass;
+      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      {
+        return f(a1, a2, a3, a4, a5, a6);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5,T6), thisclass::wrap, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              typename T4, typename T5, typename T6,
+              R (C::*m)(T1, T2, T3, T4, T5, T6), typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6), m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5,T6),m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      {
+        return (c->*m)(a1,a2,a3,a4,a5,a6);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5,T6), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              typename T4, typename T5, typename T6,
+              R (C::*m)(T1, T2, T3, T4, T5, T6) const, typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6) const, m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5,T6) const,m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      {
+        return (c->*m)(a1,a2,a3,a4,a5,a6);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5,T6), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+
+    // cfunc_traits 7
+    template <typename R, typename T1, typename T2, typename T3, typename T4,
+              typename T5, typename T6, typename T7,
+              R (*f)(lua_State*, T1, T2, T3, T4, T5, T6, T7), typename P>
+      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7), f, P>
+    {
+      typedef R (*ftype)(lua_State*,T1,T2,T3,T4,T5,T6,T7);
+      static std::string sign(lua_State *L)
+      {
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) +
+               ", " + get_typename<T3>(L) +
+               ", " + get_typename<T4>(L) +
+               ", " + get_typename<T5>(L) +
+               ", " + get_typename<T6>(L) +
+               ", " + get_typename<T7>(L) + ")";
+      }
+      static int call(void (*)(lua_State *,T1,T2,T3,T4,T5,T6,T7), lua_State *L,
+                      T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      {
+        (*f)(L, a1, a2, a3, a4, a5, a6, a7);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State *,T1,T2,T3,T4,T5,T6,T7), lua_State *L,
+                        T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      {
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3, a4, a5, a6, a7));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, lfunc);
+        try {
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type a2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type a3 = param_traits<T3>::get(L, 3);
+          typename param_traits<T4>::type a4 = param_traits<T4>::get(L, 4);
+          typename param_traits<T5>::type a5 = param_traits<T5>::get(L, 5);
+          typename param_traits<T6>::type a6 = param_traits<T6>::get(L, 6);
+          typename param_traits<T7>::type a7 = param_traits<T7>::get(L, 7);
+          return call(f,L,a1,a2,a3,a4,a5,a6,a7);
+        }
+        catch (...) {
+          lua_error_signature_of(L, sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, typename T3, typename T4,
+              typename T5, typename T6, typename T7,
+              R (*f)(T1, T2, T3, T4, T5, T6, T7), typename P>
+      struct cfunc_traits<R (*)(T1, T2, T3, T4, T5, T6, T7), f, P>
+    {
+      typedef cfunc_traits<R (*)(T1,T2,T3,T4,T5,T6,T7),f, P> thisclass;
+      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      {
+        return f(a1, a2, a3, a4, a5, a6, a7);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5,T6,T7), thisclass::wrap, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              typename T4, typename T5, typename T6, typename T7,
+              R (C::*m)(T1, T2, T3, T4, T5, T6, T7), typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7), m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5,T6,T7),m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      {
+        return (c->*m)(a1,a2,a3,a4,a5,a6,a7);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5,T6,T7), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3,
+              typename T4, typename T5, typename T6, typename T7,
+              R (C::*m)(T1, T2, T3, T4, T5, T6, T7) const, typename P>
+      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7) const, m, P>
+    {
+      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5,T6,T7) const,m, P> thisclass;
+      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      {
+        return (c->*m)(a1,a2,a3,a4,a5,a6,a7);
+      }
+      static int lfunc(lua_State *L)
+      {
+        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5,T6,T7), thisclass::flatten, P>::lfunc(L);
+      }
+    };
+
+    // shared thunks: one lua_CFunction per signature, calling the target
+    // (R (*)(lua_State*, T...)) given as the upvalue. bindings only add
+    // the small wrap/flatten functions forwarding to the C++ function.
+
+    // shared_thunk 0
+    template <typename R, typename P>
+      struct shared_thunk<R (*)(lua_State*), P>
+    {
+      typedef R (*target)(lua_State*);
+      static int call(void (*)(lua_State*), lua_State *L)
+      {
+        target f = shared_target<target>(L);
+        (*f)(L);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State*), lua_State *L)
+      {
+        target f = shared_target<target>(L);
+        return return_traits<T0, P>::push(L, (*f)(L));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, shared_target<target>(L));
+        try {
+          return call((target)NULL, L);
+        }
+        catch (...) {
+          lua_error_signature_of(L, args_traits<target>::sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, R (*f)(lua_State*), typename P>
+      struct thunk_traits<R (*)(lua_State*), f, P>
+    {
+      static shared_binding get()
+      {
+        return shared_binding(shared_thunk<R (*)(lua_State*), P>::lfunc, f);
+      }
+    };
+    template <typename R, R (*f)(), typename P>
+      struct thunk_traits<R (*)(), f, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(lua_State*), cfunc_traits<R (*)(), f>::wrap, P>::get();
+      }
+    };
+    template <typename R, typename C, R (C::*m)(), typename P>
+      struct thunk_traits<R (C::*)(), m, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(C*), cfunc_traits<R (C::*)(), m>::flatten, P>::get();
+      }
+    };
+    template <typename R, typename C, R (C::*m)() const, typename P>
+      struct thunk_traits<R (C::*)() const, m, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(C*), cfunc_traits<R (C::*)() const, m>::flatten, P>::get();
+      }
+    };
+
+    // shared_thunk 1
+    template <typename R, typename T1, typename P>
+      struct shared_thunk<R (*)(lua_State*, T1), P>
+    {
+      typedef R (*target)(lua_State*, T1);
+      static int call(void (*)(lua_State*, T1), lua_State *L, T1 a1)
+      {
+        target f = shared_target<target>(L);
+        (*f)(L, a1);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State*, T1), lua_State *L, T1 a1)
+      {
+        target f = shared_target<target>(L);
+        return return_traits<T0, P>::push(L, (*f)(L, a1));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, shared_target<target>(L));
+        try {
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          return call((target)NULL, L, a1);
+        }
+        catch (...) {
+          lua_error_signature_of(L, args_traits<target>::sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, R (*f)(lua_State*, T1), typename P>
+      struct thunk_traits<R (*)(lua_State*, T1), f, P>
+    {
+      static shared_binding get()
+      {
+        return shared_binding(shared_thunk<R (*)(lua_State*, T1), P>::lfunc, f);
+      }
+    };
+    template <typename R, typename T1, R (*f)(T1), typename P>
+      struct thunk_traits<R (*)(T1), f, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(lua_State*, T1), cfunc_traits<R (*)(T1), f>::wrap, P>::get();
+      }
+    };
+    template <typename R, typename C, typename T1, R (C::*m)(T1), typename P>
+      struct thunk_traits<R (C::*)(T1), m, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(C*, T1), cfunc_traits<R (C::*)(T1), m>::flatten, P>::get();
+      }
+    };
+    template <typename R, typename C, typename T1, R (C::*m)(T1) const, typename P>
+      struct thunk_traits<R (C::*)(T1) const, m, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(C*, T1), cfunc_traits<R (C::*)(T1) const, m>::flatten, P>::get();
+      }
+    };
+
+    // shared_thunk 2
+    template <typename R, typename T1, typename T2, typename P>
+      struct shared_thunk<R (*)(lua_State*, T1, T2), P>
+    {
+      typedef R (*target)(lua_State*, T1, T2);
+      static int call(void (*)(lua_State*, T1, T2), lua_State *L, T1 a1, T2 a2)
+      {
+        target f = shared_target<target>(L);
+        (*f)(L, a1, a2);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State*, T1, T2), lua_State *L, T1 a1, T2 a2)
+      {
+        target f = shared_target<target>(L);
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2));
+      }
+      static int lfunc(lua_State *L)
+      {
+        LUAPORT_PROFILE_BINDING(L, shared_target<target>(L));
+        try {
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type a2 = param_traits<T2>::get(L, 2);
+          return call((target)NULL, L, a1, a2);
+        }
+        catch (...) {
+          lua_error_signature_of(L, args_traits<target>::sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, R (*f)(lua_State*, T1, T2), typename P>
+      struct thunk_traits<R (*)(lua_State*, T1, T2), f, P>
+    {
+      static shared_binding get()
+      {
+        return shared_binding(shared_thunk<R (*)(lua_State*, T1, T2), P>::lfunc, f);
+      }
+    };
+    template <typename R, typename T1, typename T2, R (*f)(T1, T2), typename P>
+      struct thunk_traits<R (*)(T1, T2), f, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(lua_State*, T1, T2), cfunc_traits<R (*)(T1, T2), f>::wrap, P>::get();
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, R (C::*m)(T1, T2), typename P>
+      struct thunk_traits<R (C::*)(T1, T2), m, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(C*, T1, T2), cfunc_traits<R (C::*)(T1, T2), m>::flatten, P>::get();
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, R (C::*m)(T1, T2) const, typename P>
+      struct thunk_traits<R (C::*)(T1, T2) const, m, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(C*, T1, T2), cfunc_traits<R (C::*)(T1, T2) const, m>::flatten, P>::get();
+      }
+    };
+
+    // shared_thunk 3
+    template <typename R, typename T1, typename T2, typename T3, typename P>
+      struct shared_thunk<R (*)(lua_State*, T1, T2, T3), P>
+    {
+      typedef R (*target)(lua_State*, T1, T2, T3);
+      static int call(void (*)(lua_State*, T1, T2, T3), lua_State *L, T1 a1, T2 a2, T3 a3)
+      {
+        target f = shared_target<target>(L);
+        (*f)(L, a1, a2, a3);
+        return 0;
       }
       template <typename T0>
-        static int call(T0 (*)(lua_State *), lua_State *L)
+        static int call(T0 (*)(lua_State*, T1, T2, T3), lua_State *L, T1 a1, T2 a2, T3 a3)
       {
-        luaport::push(L, (*f)(L)) ;
-        return 1;
+        target f = shared_target<target>(L);
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3));
       }
       static int lfunc(lua_State *L)
       {
+        LUAPORT_PROFILE_BINDING(L, shared_target<target>(L));
         try {
-          return call(f, L);
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type a2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type a3 = param_traits<T3>::get(L, 3);
+          return call((target)NULL, L, a1, a2, a3);
         }
         catch (...) {
-          lua_error_signature(L, sign(L) );
+          lua_error_signature_of(L, args_traits<target>::sign);
         }
         return 0;
       }
     };
-    template <typename R, R (*f)()>
-      struct cfunc_traits<R (*)(), f>
+    template <typename R, typename T1, typename T2, typename T3, R (*f)(lua_State*, T1, T2, T3), typename P>
+      struct thunk_traits<R (*)(lua_State*, T1, T2, T3), f, P>
     {
-      typedef cfunc_traits<R (*)(),f> thisclass;
-      static R wrap(lua_State *L)
+      static shared_binding get()
       {
-        return f();
+        return shared_binding(shared_thunk<R (*)(lua_State*, T1, T2, T3), P>::lfunc, f);
       }
-      static int lfunc(lua_State *L)
+    };
+    template <typename R, typename T1, typename T2, typename T3, R (*f)(T1, T2, T3), typename P>
+      struct thunk_traits<R (*)(T1, T2, T3), f, P>
+    {
+      static shared_binding get()
       {
-        return cfunc_traits<R (*)(lua_State*), thisclass::wrap>::lfunc(L);
+        return thunk_traits<R (*)(lua_State*, T1, T2, T3), cfunc_traits<R (*)(T1, T2, T3), f>::wrap, P>::get();
       }
     };
-    template <typename R, typename C, R (C::*m)()>
-      struct cfunc_traits<R (C::*)(), m>
+    template <typename R, typename C, typename T1, typename T2, typename T3, R (C::*m)(T1, T2, T3), typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3), m, P>
     {
-      typedef cfunc_traits<R (C::*)(),m> thisclass;
-      static R flatten(C *c)
+      static shared_binding get()
       {
-        return (c->*m)();
+        return thunk_traits<R (*)(C*, T1, T2, T3), cfunc_traits<R (C::*)(T1, T2, T3), m>::flatten, P>::get();
       }
-      static int lfunc(lua_State *L)
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, R (C::*m)(T1, T2, T3) const, typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3) const, m, P>
+    {
+      static shared_binding get()
       {
-        return cfunc_traits<R (*)(C*), thisclass::flatten>::lfunc(L);
+        return thunk_traits<R (*)(C*, T1, T2, T3), cfunc_traits<R (C::*)(T1, T2, T3) const, m>::flatten, P>::get();
       }
     };
-    template <typename R, typename C, R (C::*m)() const>
-      struct cfunc_traits<R (C::*)() const, m>
+
+    // shared_thunk 4
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename P>
+      struct shared_thunk<R (*)(lua_State*, T1, T2, T3, T4), P>
     {
-      typedef cfunc_traits<R (C::*)() const,m> thisclass;
-      static R flatten(C *c)
+      typedef R (*target)(lua_State*, T1, T2, T3, T4);
+      static int call(void (*)(lua_State*, T1, T2, T3, T4), lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4)
       {
-        return (c->*m)();
+        target f = shared_target<target>(L);
+        (*f)(L, a1, a2, a3, a4);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State*, T1, T2, T3, T4), lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4)
+      {
+        target f = shared_target<target>(L);
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3, a4));
       }
       static int lfunc(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*), thisclass::flatten>::lfunc(L);
+        LUAPORT_PROFILE_BINDING(L, shared_target<target>(L));
+        try {
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type a2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type a3 = param_traits<T3>::get(L, 3);
+          typename param_traits<T4>::type a4 = param_traits<T4>::get(L, 4);
+          return call((target)NULL, L, a1, a2, a3, a4);
+        }
+        catch (...) {
+          lua_error_signature_of(L, args_traits<target>::sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, typename T3, typename T4, R (*f)(lua_State*, T1, T2, T3, T4), typename P>
+      struct thunk_traits<R (*)(lua_State*, T1, T2, T3, T4), f, P>
+    {
+      static shared_binding get()
+      {
+        return shared_binding(shared_thunk<R (*)(lua_State*, T1, T2, T3, T4), P>::lfunc, f);
       }
     };
-
-    // cfunc_traits 1
-    template <typename R, typename T1, R (*f)(lua_State*,T1)>
-      struct cfunc_traits<R (*)(lua_State*,T1), f>
+    template <typename R, typename T1, typename T2, typename T3, typename T4, R (*f)(T1, T2, T3, T4), typename P>
+      struct thunk_traits<R (*)(T1, T2, T3, T4), f, P>
     {
-      static std::string sign(lua_State *L)
+      static shared_binding get()
       {
-        return get_typename<R>(L) +
-               " (" + get_typename<T1>(L) + ")";
+        return thunk_traits<R (*)(lua_State*, T1, T2, T3, T4), cfunc_traits<R (*)(T1, T2, T3, T4), f>::wrap, P>::get();
       }
-      static int call(void (*)(lua_State *,T1), lua_State *L, T1 a1)
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, R (C::*m)(T1, T2, T3, T4), typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3, T4), m, P>
+    {
+      static shared_binding get()
       {
-        (*f)(L, a1);
+        return thunk_traits<R (*)(C*, T1, T2, T3, T4), cfunc_traits<R (C::*)(T1, T2, T3, T4), m>::flatten, P>::get();
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, R (C::*m)(T1, T2, T3, T4) const, typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3, T4) const, m, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(C*, T1, T2, T3, T4), cfunc_traits<R (C::*)(T1, T2, T3, T4) const, m>::flatten, P>::get();
+      }
+    };
+
+    // shared_thunk 5
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename P>
+      struct shared_thunk<R (*)(lua_State*, T1, T2, T3, T4, T5), P>
+    {
+      typedef R (*target)(lua_State*, T1, T2, T3, T4, T5);
+      static int call(void (*)(lua_State*, T1, T2, T3, T4, T5), lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      {
+        target f = shared_target<target>(L);
+        (*f)(L, a1, a2, a3, a4, a5);
         return 0;
       }
       template <typename T0>
-        static int call(T0 (*)(lua_State *,T1), lua_State *L, T1 a1)
+        static int call(T0 (*)(lua_State*, T1, T2, T3, T4, T5), lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
       {
-        luaport::push(L, (*f)(L,a1)) ;
-        return 1;
+        target f = shared_target<target>(L);
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3, a4, a5));
       }
       static int lfunc(lua_State *L)
       {
+        LUAPORT_PROFILE_BINDING(L, shared_target<target>(L));
         try {
-          typename type_traits<T1>::natural arg1 =
-            object_cast<typename type_traits<T1>::natural>(from_stack(L, 1));
-          return call(f, L, arg1);
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type a2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type a3 = param_traits<T3>::get(L, 3);
+          typename param_traits<T4>::type a4 = param_traits<T4>::get(L, 4);
+          typename param_traits<T5>::type a5 = param_traits<T5>::get(L, 5);
+          return call((target)NULL, L, a1, a2, a3, a4, a5);
         }
         catch (...) {
-          lua_error_signature(L, sign(L) );
+          lua_error_signature_of(L, args_traits<target>::sign);
         }
         return 0;
       }
     };
-    template <typename R, typename T1, R (*f)(T1)>
-      struct cfunc_traits<R (*)(T1), f>
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, R (*f)(lua_State*, T1, T2, T3, T4, T5), typename P>
+      struct thunk_traits<R (*)(lua_State*, T1, T2, T3, T4, T5), f, P>
     {
-      typedef cfunc_traits<R (*)(T1),f> thisclass;
-      static R wrap(lua_State *L, T1 a1)
+      static shared_binding get()
       {
-        return f(a1);
+        return shared_binding(shared_thunk<R (*)(lua_State*, T1, T2, T3, T4, T5), P>::lfunc, f);
       }
-      static int lfunc(lua_State *L)
+    };
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, R (*f)(T1, T2, T3, T4, T5), typename P>
+      struct thunk_traits<R (*)(T1, T2, T3, T4, T5), f, P>
+    {
+      static shared_binding get()
       {
-        return cfunc_traits<R (*)(lua_State*,T1), thisclass::wrap>::lfunc(L);
+        return thunk_traits<R (*)(lua_State*, T1, T2, T3, T4, T5), cfunc_traits<R (*)(T1, T2, T3, T4, T5), f>::wrap, P>::get();
       }
     };
-    template <typename R, typename C, typename T1, R (C::*m)(T1)>
-      struct cfunc_traits<R (C::*)(T1), m>
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, R (C::*m)(T1, T2, T3, T4, T5), typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3, T4, T5), m, P>
     {
-      typedef cfunc_traits<R (C::*)(T1), m> thisclass;
-      static R flatten(C *c, T1 a1)
+      static shared_binding get()
       {
-        return (c->*m)(a1);
+        return thunk_traits<R (*)(C*, T1, T2, T3, T4, T5), cfunc_traits<R (C::*)(T1, T2, T3, T4, T5), m>::flatten, P>::get();
       }
-      static int lfunc(lua_State *L)
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, R (C::*m)(T1, T2, T3, T4, T5) const, typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3, T4, T5) const, m, P>
+    {
+      static shared_binding get()
       {
-        return cfunc_traits<R (*)(C*,T1), thisclass::flatten>::lfunc(L);
+        return thunk_traits<R (*)(C*, T1, T2, T3, T4, T5), cfunc_traits<R (C::*)(T1, T2, T3, T4, T5) const, m>::flatten, P>::get();
       }
     };
-    template <typename R, typename C, typename T1, R (C::*m)(T1) const>
-      struct cfunc_traits<R (C::*)(T1) const, m>
+
+    // shared_thunk 6
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename P>
+      struct shared_thunk<R (*)(lua_State*, T1, T2, T3, T4, T5, T6), P>
     {
-      typedef cfunc_traits<R (C::*)(T1) const, m> thisclass;
-      static R flatten(C *c, T1 a1)
+      typedef R (*target)(lua_State*, T1, T2, T3, T4, T5, T6);
+      static int call(void (*)(lua_State*, T1, T2, T3, T4, T5, T6), lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
       {
-        return (c->*m)(a1);
+        target f = shared_target<target>(L);
+        (*f)(L, a1, a2, a3, a4, a5, a6);
+        return 0;
+      }
+      template <typename T0>
+        static int call(T0 (*)(lua_State*, T1, T2, T3, T4, T5, T6), lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      {
+        target f = shared_target<target>(L);
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3, a4, a5, a6));
       }
       static int lfunc(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*,T1), thisclass::flatten>::lfunc(L);
+        LUAPORT_PROFILE_BINDING(L, shared_target<target>(L));
+        try {
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type a2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type a3 = param_traits<T3>::get(L, 3);
+          typename param_traits<T4>::type a4 = param_traits<T4>::get(L, 4);
+          typename param_traits<T5>::type a5 = param_traits<T5>::get(L, 5);
+          typename param_traits<T6>::type a6 = param_traits<T6>::get(L, 6);
+          return call((target)NULL, L, a1, a2, a3, a4, a5, a6);
+        }
+        catch (...) {
+          lua_error_signature_of(L, args_traits<target>::sign);
+        }
+        return 0;
+      }
+    };
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, R (*f)(lua_State*, T1, T2, T3, T4, T5, T6), typename P>
+      struct thunk_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6), f, P>
+    {
+      static shared_binding get()
+      {
+        return shared_binding(shared_thunk<R (*)(lua_State*, T1, T2, T3, T4, T5, T6), P>::lfunc, f);
       }
     };
-
-    // cfunc_traits 2
-    template <typename R, typename T1, typename T2,
-              R (*f)(lua_State*, T1, T2)>
-      struct cfunc_traits<R (*)(lua_State*, T1, T2), f>
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, R (*f)(T1, T2, T3, T4, T5, T6), typename P>
+      struct thunk_traits<R (*)(T1, T2, T3, T4, T5, T6), f, P>
     {
-      static std::string sign(lua_State *L)
+      static shared_binding get()
       {
-        return get_typename<R>(L) +
-               " (" + get_typename<T1>(L) +
-               ", " + get_typename<T2>(L) + ")";
+        return thunk_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6), cfunc_traits<R (*)(T1, T2, T3, T4, T5, T6), f>::wrap, P>::get();
       }
-      static int call(void (*)(lua_State *,T1), lua_State *L,
-                      T1 a1, T2 a2)
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, R (C::*m)(T1, T2, T3, T4, T5, T6), typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3, T4, T5, T6), m, P>
+    {
+      static shared_binding get()
       {
-        (*f)(L, a1, a2);
+        return thunk_traits<R (*)(C*, T1, T2, T3, T4, T5, T6), cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6), m>::flatten, P>::get();
+      }
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, R (C::*m)(T1, T2, T3, T4, T5, T6) const, typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3, T4, T5, T6) const, m, P>
+    {
+      static shared_binding get()
+      {
+        return thunk_traits<R (*)(C*, T1, T2, T3, T4, T5, T6), cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6) const, m>::flatten, P>::get();
+      }
+    };
+
+    // shared_thunk 7
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename P>
+      struct shared_thunk<R (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7), P>
+    {
+      typedef R (*target)(lua_State*, T1, T2, T3, T4, T5, T6, T7);
+      static int call(void (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7), lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      {
+        target f = shared_target<target>(L);
+        (*f)(L, a1, a2, a3, a4, a5, a6, a7);
         return 0;
       }
       template <typename T0>
-        static int call(T0 (*)(lua_State *,T1), lua_State *L,
-                        T1 a1, T2 a2)
+        static int call(T0 (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7), lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
       {
-        luaport::push(L, (*f)(L, a1, a2)) ;
-        return 1;
+        target f = shared_target<target>(L);
+        return return_traits<T0, P>::push(L, (*f)(L, a1, a2, a3, a4, a5, a6, a7));
       }
       static int lfunc(lua_State *L)
       {
+        LUAPORT_PROFILE_BINDING(L, shared_target<target>(L));
         try {
-          typename type_traits<T1>::natural arg1 =
-            object_cast<typename type_traits<T1>::natural>(from_stack(L, 1));
-          typename type_traits<T2>::natural arg2 =
-            object_cast<typename type_traits<T2>::natural>(from_stack(L, 2));
-          return call(f, L, arg1, arg2);
+          typename param_traits<T1>::type a1 = param_traits<T1>::get(L, 1);
+          typename param_traits<T2>::type a2 = param_traits<T2>::get(L, 2);
+          typename param_traits<T3>::type a3 = param_traits<T3>::get(L, 3);
+          typename param_traits<T4>::type a4 = param_traits<T4>::get(L, 4);
+          typename param_traits<T5>::type a5 = param_traits<T5>::get(L, 5);
+          typename param_traits<T6>::type a6 = param_traits<T6>::get(L, 6);
+          typename param_traits<T7>::type a7 = param_traits<T7>::get(L, 7);
+          return call((target)NULL, L, a1, a2, a3, a4, a5, a6, a7);
         }
         catch (...) {
-          lua_error_signature(L, sign(L) );
+          lua_error_signature_of(L, args_traits<target>::sign);
         }
         return 0;
       }
     };
-    template <typename R, typename T1, typename T2, R (*f)(T1, T2)>
-      struct cfunc_traits<R (*)(T1, T2), f>
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, R (*f)(lua_State*, T1, T2, T3, T4, T5, T6, T7), typename P>
+      struct thunk_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7), f, P>
     {
-      typedef cfunc_traits<R (*)(T1,T2),f> thisclass;
-      static R wrap(lua_State *L, T1 a1, T2 a2)
+      static shared_binding get()
       {
-        return f(a1, a2);
+        return shared_binding(shared_thunk<R (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7), P>::lfunc, f);
       }
-      static int lfunc(lua_State *L)
+    };
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, R (*f)(T1, T2, T3, T4, T5, T6, T7), typename P>
+      struct thunk_traits<R (*)(T1, T2, T3, T4, T5, T6, T7), f, P>
+    {
+      static shared_binding get()
       {
-        return cfunc_traits<R (*)(lua_State*,T1,T2), thisclass::wrap>::lfunc(L);
+        return thunk_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7), cfunc_traits<R (*)(T1, T2, T3, T4, T5, T6, T7), f>::wrap, P>::get();
       }
     };
-    template <typename R, typename C, typename T1, typename T2,
-              R (C::*m)(T1, T2)>
-      struct cfunc_traits<R (C::*)(T1, T2), m>
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, R (C::*m)(T1, T2, T3, T4, T5, T6, T7), typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7), m, P>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2),m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2)
+      static shared_binding get()
       {
-        return (c->*m)(a1, a2);
+        return thunk_traits<R (*)(C*, T1, T2, T3, T4, T5, T6, T7), cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7), m>::flatten, P>::get();
       }
-      static int lfunc(lua_State *L)
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, R (C::*m)(T1, T2, T3, T4, T5, T6, T7) const, typename P>
+      struct thunk_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7) const, m, P>
+    {
+      static shared_binding get()
       {
-        return cfunc_traits<R (*)(C*,T1,T2), thisclass::flatten>::lfunc(L);
+        return thunk_traits<R (*)(C*, T1, T2, T3, T4, T5, T6, T7), cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7) const, m>::flatten, P>::get();
       }
     };
-    template <typename R, typename C, typename T1, typename T2,
-              R (C::*m)(T1, T2) const>
-      struct cfunc_traits<R (C::*)(T1, T2) const, m>
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+  // check_traits struct implementation
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // whether the value at idx is an instance of the class registered with
+    // the key (finalizer<managed<T>*>::lfunc), or of a derived class.
+    // the pointer converted to the class is stored in p if given
+    inline bool to_instance(lua_State *L, int idx, lua_CFunction key,
+                            void **p)
     {
-      typedef cfunc_traits<R (C::*)(T1,T2) const,m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2)
+      if (lua_type(L, idx) != LUA_TUSERDATA) { return false; }
+      idx = lua_absindex(L, idx);
+      if (! lua_getmetatable(L, idx)) { return false; }
+      lua_pushliteral(L, "luaport");
+      lua_rawget(L, -2);
+      if (! lua_toboolean(L, -1))
       {
-        return (c->*m)(a1, a2);
+        lua_pop(L, 2);
+        return false;
       }
-      static int lfunc(lua_State *L)
+      lua_pushliteral(L, "class");
+      lua_rawget(L, -3);
+      // class registered with the key, cached in the registry by newclass
+      lua_rawgetp(L, LUA_REGISTRYINDEX, (void *)key);
+      // [metatable, flag, class, target]
+      bool same = ! lua_isnil(L, -1) && lua_rawequal(L, -1, -2);
+      upcast_chain *chain = NULL;
+      if (! same && ! lua_isnil(L, -1) && lua_getmetatable(L, -2))
+      {
+        // upcasts to the ancestors are precomputed by newclass
+        lua_pushliteral(L, "upcasts");
+        lua_rawget(L, -2);
+        if (lua_istable(L, -1))
+        {
+          lua_pushvalue(L, -3);
+          lua_rawget(L, -2);
+          chain = (upcast_chain *)lua_touserdata(L, -1);
+          lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+      }
+      lua_pop(L, 4);
+      if (! same && ! chain) { return false; }
+      if (p)
+      {
+        void *q = ((managed<void> *)lua_touserdata(L, idx))->p;
+        for (int i = 0; chain && i < chain->n; i++) { q = chain->f[i](q); }
+        *p = q;
+      }
+      return true;
+    }
+
+    // cheap lua type check of the argument (used for overload resolution)
+    template <typename T, bool N>
+      struct check_traits
+    {
+      // instance of registered class (or of derived class)
+      static bool check(lua_State *L, int idx)
+      {
+        typedef typename type_traits<T>::natural natural;
+        return to_instance(L, idx, finalizer<managed<natural>*>::lfunc, NULL);
+      }
+    };
+    template <typename T>
+      struct check_traits<T, true>
+    {
+      static bool check(lua_State *L, int idx)
+      {
+        return lua_type(L, idx) == LUA_TNUMBER;
+      }
+    };
+    template <typename T>
+      struct check_traits<T *, false>
+    {
+      // nil is not converted to NULL by cast_traits<T *>
+      static bool check(lua_State *L, int idx)
+      {
+        typedef typename type_traits<T>::natural natural;
+        return to_instance(L, idx, finalizer<managed<natural>*>::lfunc, NULL);
+      }
+    };
+#ifdef LUAPORT_CXX11
+    template <typename T>
+      struct check_traits<std::shared_ptr<T>, false>
+    {
+      static bool check(lua_State *L, int idx)
+      {
+        return lua_isnil(L, idx) ||
+               to_instance(L, idx, finalizer<managed<T>*>::lfunc, NULL);
+      }
+    };
+#endif
+    template <>
+      struct check_traits<bool>
+    {
+      static bool check(lua_State *L, int idx)
+      {
+        int t = lua_type(L, idx);
+        return t == LUA_TBOOLEAN || t == LUA_TNIL;
+      }
+    };
+    template <>
+      struct check_traits<const char *>
+    {
+      static bool check(lua_State *L, int idx)
+      {
+        return lua_type(L, idx) == LUA_TSTRING;
+      }
+    };
+    template <>
+      struct check_traits<std::string>
+    {
+      static bool check(lua_State *L, int idx)
+      {
+        return lua_type(L, idx) == LUA_TSTRING;
+      }
+    };
+    template <>
+      struct check_traits<lua_CFunction>
+    {
+      static bool check(lua_State *L, int idx)
+      {
+        return lua_type(L, idx) == LUA_TFUNCTION;
+      }
+    };
+    template <>
+      struct check_traits<luaport::object>
+    {
+      static bool check(lua_State *L, int idx)
       {
-        return cfunc_traits<R (*)(C*,T1,T2), thisclass::flatten>::lfunc(L);
+        return true;
       }
     };
 
-    // cfunc_traits 3
-    template <typename R, typename T1, typename T2, typename T3,
-              R (*f)(lua_State*, T1, T2, T3)>
-      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3), f>
+    /// @endcond DETAIL
+  } // namespace detail
+
+  // stack_traits struct implementation
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // conversion of the stack value without making an object,
+    // throws std::bad_cast for a value of the wrong type
+    template <typename T>
+      struct stack_traits
     {
-      typedef R (*ftype)(lua_State*,T1,T2,T3);
-      static std::string sign(lua_State *L)
+      static T get(lua_State *L, int idx)
       {
-       return get_typename<R>(L) +
-              " (" + get_typename<T1>(L) +
-              ", " + get_typename<T2>(L) +
-              ", " + get_typename<T3>(L) + ")";
+        return object_cast<T>(from_stack(L, idx));
       }
-      static int call(void (*)(lua_State *,T1), lua_State *L,
-                      T1 a1, T2 a2, T3 a3)
+    };
+    template <typename T>
+      struct stack_number_traits
+    {
+      static T get(lua_State *L, int idx)
       {
-        (*f)(L, a1, a2, a3);
-        return 0;
+        int isnum;
+        lua_Number n = lua_tonumberx(L, idx, &isnum);
+        if (! isnum) { throw std::bad_cast(); }
+        return (T)n;
       }
-      template <typename T0>
-        static int call(T0 (*)(lua_State *,T1), lua_State *L,
-                        T1 a1, T2 a2, T3 a3)
+    };
+    template <>
+      struct stack_traits<double> : public stack_number_traits<double> { };
+    template <>
+      struct stack_traits<float> : public stack_number_traits<float> { };
+    template <>
+      struct stack_traits<int> : public stack_number_traits<int> { };
+    template <>
+      struct stack_traits<long> : public stack_number_traits<long> { };
+    template <>
+      struct stack_traits<unsigned long> : public stack_number_traits<unsigned long> { };
+    template <>
+      struct stack_traits<bool>
+    {
+      static bool get(lua_State *L, int idx)
       {
-        luaport::push(L, (*f)(L, a1, a2, a3)) ;
-        return 1;
+        if (lua_type(L, idx) != LUA_TBOOLEAN) { throw std::bad_cast(); }
+        return lua_toboolean(L, idx);
       }
-      static int lfunc(lua_State *L)
+    };
+    template <>
+      struct stack_traits<std::string>
+    {
+      static std::string get(lua_State *L, int idx)
       {
-        try {
-          typename type_traits<T1>::natural arg1 =
-            object_cast<typename type_traits<T1>::natural>(from_stack(L, 1));
-          typename type_traits<T2>::natural arg2 =
-            object_cast<typename type_traits<T2>::natural>(from_stack(L, 2));
-          typename type_traits<T3>::natural arg3 =
-            object_cast<typename type_traits<T3>::natural>(from_stack(L, 3));
-          return call(f, L, arg1, arg2, arg3);
-        }
-        catch (...) {
-          lua_error_signature(L, sign(L) );
-        }
-        return 0;
+        if (lua_type(L, idx) != LUA_TSTRING) { throw std::bad_cast(); }
+        size_t len;
+        const char *str = lua_tolstring(L, idx, &len);
+        return std::string(str, len);
+      }
+    };
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+  // args_traits struct implementation
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // args_traits 0
+    template <typename R>
+      struct args_traits<R (*)()>
+    {
+      static const int nargs = 0;
+      static bool check(lua_State *L)
+      {
+        return true;
+      }
+      static std::string sign(lua_State *L)
+      {
+        return get_typename<R>(L) + " ()";
       }
     };
-    template <typename R, typename T1, typename T2, typename T3, R (*f)(T1, T2, T3)>
-      struct cfunc_traits<R (*)(T1, T2, T3), f>
+    template <typename R>
+      struct args_traits<R (*)(lua_State*)>
+      : args_traits<R (*)()>
+    { };
+    template <typename R, typename C>
+      struct args_traits<R (C::*)()>
+      : args_traits<R (*)(C*)>
+    { };
+    template <typename R, typename C>
+      struct args_traits<R (C::*)() const>
+      : args_traits<R (*)(C*)>
+    { };
+
+    // args_traits 1
+    template <typename R, typename T1>
+      struct args_traits<R (*)(T1)>
     {
-      typedef cfunc_traits<R (*)(T1,T2,T3),f> thisclass;
-      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3)
+      static const int nargs = 1;
+      static bool check(lua_State *L)
       {
-        return f(a1, a2, a3);
+        return check_traits<typename type_traits<T1>::natural>::check(L, 1);
       }
-      static int lfunc(lua_State *L)
+      static std::string sign(lua_State *L)
       {
-        return cfunc_traits<R (*)(lua_State*,T1,T2,T3), thisclass::wrap>::lfunc(L);
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) + ")";
       }
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              R (C::*m)(T1, T2, T3)>
-      struct cfunc_traits<R (C::*)(T1, T2, T3), m>
+    template <typename R, typename T1>
+      struct args_traits<R (*)(lua_State*, T1)>
+      : args_traits<R (*)(T1)>
+    { };
+    template <typename R, typename C, typename T1>
+      struct args_traits<R (C::*)(T1)>
+      : args_traits<R (*)(C*, T1)>
+    { };
+    template <typename R, typename C, typename T1>
+      struct args_traits<R (C::*)(T1) const>
+      : args_traits<R (*)(C*, T1)>
+    { };
+
+    // args_traits 2
+    template <typename R, typename T1, typename T2>
+      struct args_traits<R (*)(T1, T2)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3),m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3)
+      static const int nargs = 2;
+      static bool check(lua_State *L)
       {
-        return (c->*m)(a1, a2, a3);
+        return check_traits<typename type_traits<T1>::natural>::check(L, 1) &&
+               check_traits<typename type_traits<T2>::natural>::check(L, 2);
       }
-      static int lfunc(lua_State *L)
+      static std::string sign(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3), thisclass::flatten>::lfunc(L);
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) + ")";
       }
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              R (C::*m)(T1, T2, T3) const>
-      struct cfunc_traits<R (C::*)(T1, T2, T3) const, m>
+    template <typename R, typename T1, typename T2>
+      struct args_traits<R (*)(lua_State*, T1, T2)>
+      : args_traits<R (*)(T1, T2)>
+    { };
+    template <typename R, typename C, typename T1, typename T2>
+      struct args_traits<R (C::*)(T1, T2)>
+      : args_traits<R (*)(C*, T1, T2)>
+    { };
+    template <typename R, typename C, typename T1, typename T2>
+      struct args_traits<R (C::*)(T1, T2) const>
+      : args_traits<R (*)(C*, T1, T2)>
+    { };
+
+    // args_traits 3
+    template <typename R, typename T1, typename T2, typename T3>
+      struct args_traits<R (*)(T1, T2, T3)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3) const,m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3)
+      static const int nargs = 3;
+      static bool check(lua_State *L)
       {
-        return (c->*m)(a1, a2, a3);
+        return check_traits<typename type_traits<T1>::natural>::check(L, 1) &&
+               check_traits<typename type_traits<T2>::natural>::check(L, 2) &&
+               check_traits<typename type_traits<T3>::natural>::check(L, 3);
       }
-      static int lfunc(lua_State *L)
+      static std::string sign(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3), thisclass::flatten>::lfunc(L);
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) +
+               ", " + get_typename<T3>(L) + ")";
       }
     };
-
-    // cfunc_traits 4
-    template <typename R, typename T1, typename T2, typename T3,
-              typename T4, R (*f)(lua_State*, T1, T2, T3, T4)>
-      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3, T4), f>
+    template <typename R, typename T1, typename T2, typename T3>
+      struct args_traits<R (*)(lua_State*, T1, T2, T3)>
+      : args_traits<R (*)(T1, T2, T3)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3>
+      struct args_traits<R (C::*)(T1, T2, T3)>
+      : args_traits<R (*)(C*, T1, T2, T3)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3>
+      struct args_traits<R (C::*)(T1, T2, T3) const>
+      : args_traits<R (*)(C*, T1, T2, T3)>
+    { };
+
+    // args_traits 4
+    template <typename R, typename T1, typename T2, typename T3, typename T4>
+      struct args_traits<R (*)(T1, T2, T3, T4)>
     {
-      typedef R (*ftype)(lua_State*,T1,T2,T3,T4);
+      static const int nargs = 4;
+      static bool check(lua_State *L)
+      {
+        return check_traits<typename type_traits<T1>::natural>::check(L, 1) &&
+               check_traits<typename type_traits<T2>::natural>::check(L, 2) &&
+               check_traits<typename type_traits<T3>::natural>::check(L, 3) &&
+               check_traits<typename type_traits<T4>::natural>::check(L, 4);
+      }
       static std::string sign(lua_State *L)
       {
         return get_typename<R>(L) +
@@ -1617,449 +4881,533 @@ namespace luaport
                ", " + get_typename<T3>(L) +
                ", " + get_typename<T4>(L) + ")";
       }
-      static int call(void (*)(lua_State *,T1), lua_State *L,
-                      T1 a1, T2 a2, T3 a3, T4 a4)
-      {
-        (*f)(L, a1, a2, a3, a4);
-        return 0;
-      }
-      template <typename T0>
-        static int call(T0 (*)(lua_State *,T1), lua_State *L,
-                        T1 a1, T2 a2, T3 a3, T4 a4)
+    };
+    template <typename R, typename T1, typename T2, typename T3, typename T4>
+      struct args_traits<R (*)(lua_State*, T1, T2, T3, T4)>
+      : args_traits<R (*)(T1, T2, T3, T4)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4>
+      struct args_traits<R (C::*)(T1, T2, T3, T4)>
+      : args_traits<R (*)(C*, T1, T2, T3, T4)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4>
+      struct args_traits<R (C::*)(T1, T2, T3, T4) const>
+      : args_traits<R (*)(C*, T1, T2, T3, T4)>
+    { };
+
+    // args_traits 5
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5>
+      struct args_traits<R (*)(T1, T2, T3, T4, T5)>
+    {
+      static const int nargs = 5;
+      static bool check(lua_State *L)
       {
-        luaport::push(L, (*f)(L, a1, a2, a3, a4)) ;
-        return 1;
+        return check_traits<typename type_traits<T1>::natural>::check(L, 1) &&
+               check_traits<typename type_traits<T2>::natural>::check(L, 2) &&
+               check_traits<typename type_traits<T3>::natural>::check(L, 3) &&
+               check_traits<typename type_traits<T4>::natural>::check(L, 4) &&
+               check_traits<typename type_traits<T5>::natural>::check(L, 5);
       }
-      static int lfunc(lua_State *L)
+      static std::string sign(lua_State *L)
       {
-        try {
-          typename type_traits<T1>::natural arg1 =
-            object_cast<typename type_traits<T1>::natural>(from_stack(L, 1));
-          typename type_traits<T2>::natural arg2 =
-            object_cast<typename type_traits<T2>::natural>(from_stack(L, 2));
-          typename type_traits<T3>::natural arg3 =
-            object_cast<typename type_traits<T3>::natural>(from_stack(L, 3));
-          typename type_traits<T4>::natural arg4 =
-            object_cast<typename type_traits<T4>::natural>(from_stack(L, 4));
-          return call(f, L, arg1, arg2, arg3, arg4);
-        }
-        catch (...) {
-          lua_error_signature(L, sign(L));
-        }
-        return 0;
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) +
+               ", " + get_typename<T3>(L) +
+               ", " + get_typename<T4>(L) +
+               ", " + get_typename<T5>(L) + ")";
       }
     };
-    template <typename R, typename T1, typename T2, typename T3,
-              typename T4, R (*f)(T1, T2, T3, T4)>
-      struct cfunc_traits<R (*)(T1, T2, T3, T4), f>
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5>
+      struct args_traits<R (*)(lua_State*, T1, T2, T3, T4, T5)>
+      : args_traits<R (*)(T1, T2, T3, T4, T5)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5>
+      struct args_traits<R (C::*)(T1, T2, T3, T4, T5)>
+      : args_traits<R (*)(C*, T1, T2, T3, T4, T5)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5>
+      struct args_traits<R (C::*)(T1, T2, T3, T4, T5) const>
+      : args_traits<R (*)(C*, T1, T2, T3, T4, T5)>
+    { };
+
+    // args_traits 6
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+      struct args_traits<R (*)(T1, T2, T3, T4, T5, T6)>
     {
-      typedef cfunc_traits<R (*)(T1,T2,T3,T4),f> thisclass;
-      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4)
+      static const int nargs = 6;
+      static bool check(lua_State *L)
       {
-        return f(a1, a2, a3, a4);
+        return check_traits<typename type_traits<T1>::natural>::check(L, 1) &&
+               check_traits<typename type_traits<T2>::natural>::check(L, 2) &&
+               check_traits<typename type_traits<T3>::natural>::check(L, 3) &&
+               check_traits<typename type_traits<T4>::natural>::check(L, 4) &&
+               check_traits<typename type_traits<T5>::natural>::check(L, 5) &&
+               check_traits<typename type_traits<T6>::natural>::check(L, 6);
       }
-      static int lfunc(lua_State *L)
+      static std::string sign(lua_State *L)
       {
-        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4), thisclass::wrap>::lfunc(L);
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) +
+               ", " + get_typename<T3>(L) +
+               ", " + get_typename<T4>(L) +
+               ", " + get_typename<T5>(L) +
+               ", " + get_typename<T6>(L) + ")";
       }
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              typename T4, R (C::*m)(T1, T2, T3, T4)>
-      struct cfunc_traits<R (C::*)(T1, T2, T3, T4), m>
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+      struct args_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6)>
+      : args_traits<R (*)(T1, T2, T3, T4, T5, T6)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+      struct args_traits<R (C::*)(T1, T2, T3, T4, T5, T6)>
+      : args_traits<R (*)(C*, T1, T2, T3, T4, T5, T6)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+      struct args_traits<R (C::*)(T1, T2, T3, T4, T5, T6) const>
+      : args_traits<R (*)(C*, T1, T2, T3, T4, T5, T6)>
+    { };
+
+    // args_traits 7
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+      struct args_traits<R (*)(T1, T2, T3, T4, T5, T6, T7)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4),m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4)
+      static const int nargs = 7;
+      static bool check(lua_State *L)
       {
-        return (c->*m)(a1, a2, a3, a4);
+        return check_traits<typename type_traits<T1>::natural>::check(L, 1) &&
+               check_traits<typename type_traits<T2>::natural>::check(L, 2) &&
+               check_traits<typename type_traits<T3>::natural>::check(L, 3) &&
+               check_traits<typename type_traits<T4>::natural>::check(L, 4) &&
+               check_traits<typename type_traits<T5>::natural>::check(L, 5) &&
+               check_traits<typename type_traits<T6>::natural>::check(L, 6) &&
+               check_traits<typename type_traits<T7>::natural>::check(L, 7);
       }
-      static int lfunc(lua_State *L)
+      static std::string sign(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3,T4), thisclass::flatten>::lfunc(L);
+        return get_typename<R>(L) +
+               " (" + get_typename<T1>(L) +
+               ", " + get_typename<T2>(L) +
+               ", " + get_typename<T3>(L) +
+               ", " + get_typename<T4>(L) +
+               ", " + get_typename<T5>(L) +
+               ", " + get_typename<T6>(L) +
+               ", " + get_typename<T7>(L) + ")";
       }
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              typename T4, R (C::*m)(T1, T2, T3, T4) const>
-      struct cfunc_traits<R (C::*)(T1, T2, T3, T4) const, m>
+    template <typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+      struct args_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7)>
+      : args_traits<R (*)(T1, T2, T3, T4, T5, T6, T7)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+      struct args_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7)>
+      : args_traits<R (*)(C*, T1, T2, T3, T4, T5, T6, T7)>
+    { };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+      struct args_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7) const>
+      : args_traits<R (*)(C*, T1, T2, T3, T4, T5, T6, T7)>
+    { };
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+  // overload_traits struct implementation
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    template <typename B1, typename B2, typename B3, typename B4,
+              typename B5, typename B6>
+      struct overload_traits
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4) const,m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4)
+      static std::string sign(lua_State *L)
       {
-        return (c->*m)(a1, a2, a3, a4);
+        std::string candidates;
+        candidates += "  " + B1::args::sign(L) + "\n";
+        candidates += "  " + B2::args::sign(L) + "\n";
+        if (B3::args::nargs >= 0) { candidates += "  " + B3::args::sign(L) + "\n"; }
+        if (B4::args::nargs >= 0) { candidates += "  " + B4::args::sign(L) + "\n"; }
+        if (B5::args::nargs >= 0) { candidates += "  " + B5::args::sign(L) + "\n"; }
+        if (B6::args::nargs >= 0) { candidates += "  " + B6::args::sign(L) + "\n"; }
+        return candidates;
       }
       static int lfunc(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3,T4), thisclass::flatten>::lfunc(L);
+        // nargs are compile-time constants, so the arity comparisons fold
+        // into a branch on lua_gettop and only the lua_type checks remain
+        const int n = lua_gettop(L);
+        if (n == B1::args::nargs && B1::args::check(L)) { return B1::lfunc(L); }
+        if (n == B2::args::nargs && B2::args::check(L)) { return B2::lfunc(L); }
+        if (n == B3::args::nargs && B3::args::check(L)) { return B3::lfunc(L); }
+        if (n == B4::args::nargs && B4::args::check(L)) { return B4::lfunc(L); }
+        if (n == B5::args::nargs && B5::args::check(L)) { return B5::lfunc(L); }
+        if (n == B6::args::nargs && B6::args::check(L)) { return B6::lfunc(L); }
+        lua_error_overload(L, sign(L));
+        return 0;
       }
     };
 
-    // cfunc_traits 5
-    template <typename R, typename T1, typename T2, typename T3, typename T4,
-              typename T5, R (*f)(lua_State*, T1, T2, T3, T4, T5)>
-      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3, T4, T5), f>
+    /// @endcond DETAIL
+  } // namespace detail
+
+  // functor_traits struct implementation
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // functor_traits 0
+    template <typename F, typename R>
+      struct functor_traits<F, R ()>
     {
-      typedef R (*ftype)(lua_State*,T1,T2,T3,T4,T5);
-      static std::string sign(lua_State *L)
+      typedef functor_traits<F, R ()> thisclass;
+      static R invoke(lua_State *L)
       {
-        return get_typename<R>(L) +
-               " (" + get_typename<T1>(L) +
-               ", " + get_typename<T2>(L) +
-               ", " + get_typename<T3>(L) +
-               ", " + get_typename<T4>(L) +
-               ", " + get_typename<T5>(L) + ")";
+        F *fn = (F *)lua_touserdata(L, lua_upvalueindex(1));
+        return (*fn)();
       }
-      static int call(void (*)(lua_State *,T1), lua_State *L,
-                      T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      static int lfunc(lua_State *L)
       {
-        (*f)(L, a1, a2, a3, a4, a5);
-        return 0;
+        return cfunc_traits<R (*)(lua_State*), thisclass::invoke>::lfunc(L);
       }
-      template <typename T0>
-        static int call(T0 (*)(lua_State *,T1), lua_State *L,
-                        T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+    };
+    template <typename R, typename C>
+      struct bound_method<R (C::*)()>
+    {
+      typedef R signature();
+      R operator()() const
       {
-        luaport::push(L, (*f)(L, a1, a2, a3, a4, a5)) ;
-        return 1;
+        return (self->*m)();
       }
-      static int lfunc(lua_State *L)
+      C *self;
+      R (C::*m)();
+    };
+    template <typename R, typename C>
+      struct bound_method<R (C::*)() const>
+    {
+      typedef R signature();
+      R operator()() const
       {
-        try {
-          typename type_traits<T1>::natural arg1 =
-            object_cast<typename type_traits<T1>::natural>(from_stack(L, 1));
-          typename type_traits<T2>::natural arg2 =
-            object_cast<typename type_traits<T2>::natural>(from_stack(L, 2));
-          typename type_traits<T3>::natural arg3 =
-            object_cast<typename type_traits<T3>::natural>(from_stack(L, 3));
-          typename type_traits<T4>::natural arg4 =
-            object_cast<typename type_traits<T4>::natural>(from_stack(L, 4));
-          typename type_traits<T5>::natural arg5 =
-            object_cast<typename type_traits<T5>::natural>(from_stack(L, 5));
-          return call(f, L, arg1, arg2, arg3, arg4, arg5);
-        }
-        catch (...) {
-          lua_error_signature(L, sign(L));
-        }
-        return 0;
+        return (self->*m)();
       }
+      C *self;
+      R (C::*m)() const;
     };
-    template <typename R, typename T1, typename T2, typename T3, typename T4,
-              typename T5, R (*f)(T1, T2, T3, T4, T5)>
-      struct cfunc_traits<R (*)(T1, T2, T3, T4, T5), f>
+
+    // functor_traits 1
+    template <typename F, typename R, typename T1>
+      struct functor_traits<F, R (T1)>
     {
-      typedef cfunc_traits<R (*)(T1,T2,T3,T4,T5),f> thisclass;
-      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      typedef functor_traits<F, R (T1)> thisclass;
+      static R invoke(lua_State *L, T1 a1)
       {
-        return f(a1, a2, a3, a4, a5);
+        F *fn = (F *)lua_touserdata(L, lua_upvalueindex(1));
+        return (*fn)(a1);
       }
       static int lfunc(lua_State *L)
       {
-        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5), thisclass::wrap>::lfunc(L);
+        return cfunc_traits<R (*)(lua_State*,T1), thisclass::invoke>::lfunc(L);
       }
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              typename T4, typename T5, R (C::*m)(T1, T2, T3, T4, T5)>
-      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5), m>
+    template <typename R, typename C, typename T1>
+      struct bound_method<R (C::*)(T1)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5),m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      typedef R signature(T1);
+      R operator()(T1 a1) const
       {
-        return (c->*m)(a1, a2, a3, a4, a5);
+        return (self->*m)(a1);
       }
-      static int lfunc(lua_State *L)
+      C *self;
+      R (C::*m)(T1);
+    };
+    template <typename R, typename C, typename T1>
+      struct bound_method<R (C::*)(T1) const>
+    {
+      typedef R signature(T1);
+      R operator()(T1 a1) const
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5), thisclass::flatten>::lfunc(L);
+        return (self->*m)(a1);
       }
+      C *self;
+      R (C::*m)(T1) const;
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              typename T4, typename T5, R (C::*m)(T1, T2, T3, T4, T5) const>
-      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5) const, m>
+
+    // functor_traits 2
+    template <typename F, typename R, typename T1, typename T2>
+      struct functor_traits<F, R (T1, T2)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5) const,m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
+      typedef functor_traits<F, R (T1,T2)> thisclass;
+      static R invoke(lua_State *L, T1 a1, T2 a2)
       {
-        return (c->*m)(a1, a2, a3, a4, a5);
+        F *fn = (F *)lua_touserdata(L, lua_upvalueindex(1));
+        return (*fn)(a1, a2);
       }
       static int lfunc(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5), thisclass::flatten>::lfunc(L);
+        return cfunc_traits<R (*)(lua_State*,T1,T2), thisclass::invoke>::lfunc(L);
       }
     };
-
-    // cfunc_traits 6
-    template <typename R, typename T1, typename T2, typename T3, typename T4,
-              typename T5, typename T6,
-              R (*f)(lua_State*, T1, T2, T3, T4, T5, T6)>
-      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6), f>
+    template <typename R, typename C, typename T1, typename T2>
+      struct bound_method<R (C::*)(T1, T2)>
     {
-      typedef R (*ftype)(lua_State*,T1,T2,T3,T4,T5,T6);
-      static std::string sign(lua_State *L)
+      typedef R signature(T1, T2);
+      R operator()(T1 a1, T2 a2) const
       {
-        return get_typename<R>(L) +
-               " (" + get_typename<T1>(L) +
-               ", " + get_typename<T2>(L) +
-               ", " + get_typename<T3>(L) +
-               ", " + get_typename<T4>(L) +
-               ", " + get_typename<T5>(L) +
-               ", " + get_typename<T6>(L) + ")";
+        return (self->*m)(a1, a2);
       }
-      static int call(void (*)(lua_State *,T1), lua_State *L,
-                      T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      C *self;
+      R (C::*m)(T1, T2);
+    };
+    template <typename R, typename C, typename T1, typename T2>
+      struct bound_method<R (C::*)(T1, T2) const>
+    {
+      typedef R signature(T1, T2);
+      R operator()(T1 a1, T2 a2) const
       {
-        (*f)(L, a1, a2, a3, a4, a5, a6);
-        return 0;
+        return (self->*m)(a1, a2);
       }
-      template <typename T0>
-        static int call(T0 (*)(lua_State *,T1), lua_State *L,
-                        T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      C *self;
+      R (C::*m)(T1, T2) const;
+    };
+
+    // functor_traits 3
+    template <typename F, typename R, typename T1, typename T2, typename T3>
+      struct functor_traits<F, R (T1, T2, T3)>
+    {
+      typedef functor_traits<F, R (T1,T2,T3)> thisclass;
+      static R invoke(lua_State *L, T1 a1, T2 a2, T3 a3)
       {
-        luaport::push(L, (*f)(L, a1, a2, a3, a4, a5, a6)) ;
-        return 1;
+        F *fn = (F *)lua_touserdata(L, lua_upvalueindex(1));
+        return (*fn)(a1, a2, a3);
       }
       static int lfunc(lua_State *L)
       {
-        try {
-          typename type_traits<T1>::natural a1 =
-            object_cast<typename type_traits<T1>::natural>(from_stack(L, 1));
-          typename type_traits<T2>::natural a2 =
-            object_cast<typename type_traits<T2>::natural>(from_stack(L, 2));
-          typename type_traits<T3>::natural a3 =
-            object_cast<typename type_traits<T3>::natural>(from_stack(L, 3));
-          typename type_traits<T4>::natural a4 =
-            object_cast<typename type_traits<T4>::natural>(from_stack(L, 4));
-          typename type_traits<T5>::natural a5 =
-            object_cast<typename type_traits<T5>::natural>(from_stack(L, 5));
-          typename type_traits<T6>::natural a6 =
-            object_cast<typename type_traits<T6>::natural>(from_stack(L, 6));
-          return call(f,L,a1,a2,a3,a4,a5,a6);
-        }
-        catch (...) {
-          lua_error_signature(L, sign(L));
-        }
-        return 0;
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3), thisclass::invoke>::lfunc(L);
       }
     };
-    template <typename R, typename T1, typename T2, typename T3, typename T4,
-              typename T5, typename T6, R (*f)(T1, T2, T3, T4, T5, T6)>
-      struct cfunc_traits<R (*)(T1, T2, T3, T4, T5, T6), f>
+    template <typename R, typename C, typename T1, typename T2, typename T3>
+      struct bound_method<R (C::*)(T1, T2, T3)>
     {
-      typedef cfunc_traits<R (*)(T1,T2,T3,T4,T5,T6),f> thisclass;
-      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      typedef R signature(T1, T2, T3);
+      R operator()(T1 a1, T2 a2, T3 a3) const
       {
-        return f(a1, a2, a3, a4, a5, a6);
+        return (self->*m)(a1, a2, a3);
       }
-      static int lfunc(lua_State *L)
+      C *self;
+      R (C::*m)(T1, T2, T3);
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3>
+      struct bound_method<R (C::*)(T1, T2, T3) const>
+    {
+      typedef R signature(T1, T2, T3);
+      R operator()(T1 a1, T2 a2, T3 a3) const
       {
-        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5,T6), thisclass::wrap>::lfunc(L);
+        return (self->*m)(a1, a2, a3);
       }
+      C *self;
+      R (C::*m)(T1, T2, T3) const;
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              typename T4, typename T5, typename T6,
-              R (C::*m)(T1, T2, T3, T4, T5, T6)>
-      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6), m>
+
+    // functor_traits 4
+    template <typename F, typename R, typename T1, typename T2, typename T3, typename T4>
+      struct functor_traits<F, R (T1, T2, T3, T4)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5,T6),m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      typedef functor_traits<F, R (T1,T2,T3,T4)> thisclass;
+      static R invoke(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4)
       {
-        return (c->*m)(a1,a2,a3,a4,a5,a6);
+        F *fn = (F *)lua_touserdata(L, lua_upvalueindex(1));
+        return (*fn)(a1, a2, a3, a4);
       }
       static int lfunc(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5,T6), thisclass::flatten>::lfunc(L);
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4), thisclass::invoke>::lfunc(L);
       }
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              typename T4, typename T5, typename T6,
-              R (C::*m)(T1, T2, T3, T4, T5, T6) const>
-      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6) const, m>
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4>
+      struct bound_method<R (C::*)(T1, T2, T3, T4)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5,T6) const,m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
+      typedef R signature(T1, T2, T3, T4);
+      R operator()(T1 a1, T2 a2, T3 a3, T4 a4) const
       {
-        return (c->*m)(a1,a2,a3,a4,a5,a6);
+        return (self->*m)(a1, a2, a3, a4);
       }
-      static int lfunc(lua_State *L)
+      C *self;
+      R (C::*m)(T1, T2, T3, T4);
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4>
+      struct bound_method<R (C::*)(T1, T2, T3, T4) const>
+    {
+      typedef R signature(T1, T2, T3, T4);
+      R operator()(T1 a1, T2 a2, T3 a3, T4 a4) const
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5,T6), thisclass::flatten>::lfunc(L);
+        return (self->*m)(a1, a2, a3, a4);
       }
+      C *self;
+      R (C::*m)(T1, T2, T3, T4) const;
     };
 
-    // cfunc_traits 7
-    template <typename R, typename T1, typename T2, typename T3, typename T4,
-              typename T5, typename T6, typename T7,
-              R (*f)(lua_State*, T1, T2, T3, T4, T5, T6, T7)>
-      struct cfunc_traits<R (*)(lua_State*, T1, T2, T3, T4, T5, T6, T7), f>
+    // functor_traits 5
+    template <typename F, typename R, typename T1, typename T2, typename T3, typename T4, typename T5>
+      struct functor_traits<F, R (T1, T2, T3, T4, T5)>
     {
-      typedef R (*ftype)(lua_State*,T1,T2,T3,T4,T5,T6,T7);
-      static std::string sign(lua_State *L)
+      typedef functor_traits<F, R (T1,T2,T3,T4,T5)> thisclass;
+      static R invoke(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5)
       {
-        return get_typename<R>(L) +
-               " (" + get_typename<T1>(L) +
-               ", " + get_typename<T2>(L) +
-               ", " + get_typename<T3>(L) +
-               ", " + get_typename<T4>(L) +
-               ", " + get_typename<T5>(L) +
-               ", " + get_typename<T6>(L) +
-               ", " + get_typename<T7>(L) + ")";
+        F *fn = (F *)lua_touserdata(L, lua_upvalueindex(1));
+        return (*fn)(a1, a2, a3, a4, a5);
       }
-      static int call(void (*)(lua_State *,T1), lua_State *L,
-                      T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      static int lfunc(lua_State *L)
       {
-        (*f)(L, a1, a2, a3, a4, a5, a6, a7);
-        return 0;
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5), thisclass::invoke>::lfunc(L);
       }
-      template <typename T0>
-        static int call(T0 (*)(lua_State *,T1), lua_State *L,
-                        T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5>
+      struct bound_method<R (C::*)(T1, T2, T3, T4, T5)>
+    {
+      typedef R signature(T1, T2, T3, T4, T5);
+      R operator()(T1 a1, T2 a2, T3 a3, T4 a4, T5 a5) const
       {
-        luaport::push(L, (*f)(L, a1, a2, a3, a4, a5, a6, a7)) ;
-        return 1;
+        return (self->*m)(a1, a2, a3, a4, a5);
       }
-      static int lfunc(lua_State *L)
+      C *self;
+      R (C::*m)(T1, T2, T3, T4, T5);
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5>
+      struct bound_method<R (C::*)(T1, T2, T3, T4, T5) const>
+    {
+      typedef R signature(T1, T2, T3, T4, T5);
+      R operator()(T1 a1, T2 a2, T3 a3, T4 a4, T5 a5) const
       {
-        try {
-          typename type_traits<T1>::natural a1 =
-            object_cast<typename type_traits<T1>::natural>(from_stack(L, 1));
-          typename type_traits<T2>::natural a2 =
-            object_cast<typename type_traits<T2>::natural>(from_stack(L, 2));
-          typename type_traits<T3>::natural a3 =
-            object_cast<typename type_traits<T3>::natural>(from_stack(L, 3));
-          typename type_traits<T4>::natural a4 =
-            object_cast<typename type_traits<T4>::natural>(from_stack(L, 4));
-          typename type_traits<T5>::natural a5 =
-            object_cast<typename type_traits<T5>::natural>(from_stack(L, 5));
-          typename type_traits<T6>::natural a6 =
-            object_cast<typename type_traits<T6>::natural>(from_stack(L, 6));
-          typename type_traits<T7>::natural a7 =
-            object_cast<typename type_traits<T7>::natural>(from_stack(L, 6));
-          return call(f,L,a1,a2,a3,a4,a5,a6,a7);
-        }
-        catch (...) {
-          lua_error_signature(L, sign(L));
-        }
-        return 0;
+        return (self->*m)(a1, a2, a3, a4, a5);
       }
+      C *self;
+      R (C::*m)(T1, T2, T3, T4, T5) const;
     };
-    template <typename R, typename T1, typename T2, typename T3, typename T4,
-              typename T5, typename T6, typename T7,
-              R (*f)(T1, T2, T3, T4, T5, T6, T7)>
-      struct cfunc_traits<R (*)(T1, T2, T3, T4, T5, T6, T7), f>
+
+    // functor_traits 6
+    template <typename F, typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+      struct functor_traits<F, R (T1, T2, T3, T4, T5, T6)>
     {
-      typedef cfunc_traits<R (*)(T1,T2,T3,T4,T5,T6,T7),f> thisclass;
-      static R wrap(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      typedef functor_traits<F, R (T1,T2,T3,T4,T5,T6)> thisclass;
+      static R invoke(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6)
       {
-        return f(a1, a2, a3, a4, a5, a6, a7);
+        F *fn = (F *)lua_touserdata(L, lua_upvalueindex(1));
+        return (*fn)(a1, a2, a3, a4, a5, a6);
       }
       static int lfunc(lua_State *L)
       {
-        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5,T6,T7), thisclass::wrap>::lfunc(L);
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5,T6), thisclass::invoke>::lfunc(L);
       }
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              typename T4, typename T5, typename T6, typename T7,
-              R (C::*m)(T1, T2, T3, T4, T5, T6, T7)>
-      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7), m>
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+      struct bound_method<R (C::*)(T1, T2, T3, T4, T5, T6)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5,T6,T7),m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      typedef R signature(T1, T2, T3, T4, T5, T6);
+      R operator()(T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6) const
       {
-        return (c->*m)(a1,a2,a3,a4,a5,a6,a7);
+        return (self->*m)(a1, a2, a3, a4, a5, a6);
       }
-      static int lfunc(lua_State *L)
+      C *self;
+      R (C::*m)(T1, T2, T3, T4, T5, T6);
+    };
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
+      struct bound_method<R (C::*)(T1, T2, T3, T4, T5, T6) const>
+    {
+      typedef R signature(T1, T2, T3, T4, T5, T6);
+      R operator()(T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6) const
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5,T6,T7), thisclass::flatten>::lfunc(L);
+        return (self->*m)(a1, a2, a3, a4, a5, a6);
       }
+      C *self;
+      R (C::*m)(T1, T2, T3, T4, T5, T6) const;
     };
-    template <typename R, typename C, typename T1, typename T2, typename T3,
-              typename T4, typename T5, typename T6, typename T7,
-              R (C::*m)(T1, T2, T3, T4, T5, T6, T7) const>
-      struct cfunc_traits<R (C::*)(T1, T2, T3, T4, T5, T6, T7) const, m>
+
+    // functor_traits 7
+    template <typename F, typename R, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+      struct functor_traits<F, R (T1, T2, T3, T4, T5, T6, T7)>
     {
-      typedef cfunc_traits<R (C::*)(T1,T2,T3,T4,T5,T6,T7) const,m> thisclass;
-      static R flatten(C *c, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
+      typedef functor_traits<F, R (T1,T2,T3,T4,T5,T6,T7)> thisclass;
+      static R invoke(lua_State *L, T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7)
       {
-        return (c->*m)(a1,a2,a3,a4,a5,a6,a7);
+        F *fn = (F *)lua_touserdata(L, lua_upvalueindex(1));
+        return (*fn)(a1, a2, a3, a4, a5, a6, a7);
       }
       static int lfunc(lua_State *L)
       {
-        return cfunc_traits<R (*)(C*,T1,T2,T3,T4,T5,T6,T7), thisclass::flatten>::lfunc(L);
+        return cfunc_traits<R (*)(lua_State*,T1,T2,T3,T4,T5,T6,T7), thisclass::invoke>::lfunc(L);
       }
     };
-
-    /// @endcond DETAIL
-  } // namespace detail
-
-  // cast_traits struct implementatioin
-  namespace detail
-  {
-    /// @cond DETAIL
-
-    template <typename T>
-      struct cast_traits
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+      struct bound_method<R (C::*)(T1, T2, T3, T4, T5, T6, T7)>
     {
-      static T cast(const object &obj)
+      typedef R signature(T1, T2, T3, T4, T5, T6, T7);
+      R operator()(T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7) const
       {
-  printf("INSTANCE CAST\n");
-        reference<T> r = obj;
-        return *r;
+        return (self->*m)(a1, a2, a3, a4, a5, a6, a7);
       }
+      C *self;
+      R (C::*m)(T1, T2, T3, T4, T5, T6, T7);
     };
-    template <>
-      struct cast_traits<bool>
+    template <typename R, typename C, typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
+      struct bound_method<R (C::*)(T1, T2, T3, T4, T5, T6, T7) const>
     {
-      static bool cast(const object &obj)
+      typedef R signature(T1, T2, T3, T4, T5, T6, T7);
+      R operator()(T1 a1, T2 a2, T3 a3, T4 a4, T5 a5, T6 a6, T7 a7) const
       {
-        lua_State *L = obj.interpreter();
-        obj.push();
-        bool b = lua_toboolean(L, -1);
-        lua_pop(L, 1);
-        return b;
+        return (self->*m)(a1, a2, a3, a4, a5, a6, a7);
       }
+      C *self;
+      R (C::*m)(T1, T2, T3, T4, T5, T6, T7) const;
     };
-    template <>
-      struct cast_traits<double>
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+  // cast_traits struct implementatioin
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    template <typename T, bool N = is_number<T>::value>
+      struct value_cast
     {
-      static double cast(const object &obj)
+      static T cast(const object &obj)
       {
-        lua_State *L = obj.interpreter();
-        obj.push();
-        double d = lua_tonumber(L, -1);
-        lua_pop(L, 1);
-        return d;
+        // copied once from the instance (T returned by value)
+        return *cast_traits<T *>::cast(obj);
       }
     };
-    template <>
-      struct cast_traits<int>
+    template <typename T>
+      struct value_cast<T, true>
     {
-      static int cast(const object &obj)
+      static T cast(const object &obj)
       {
         lua_State *L = obj.interpreter();
         obj.push();
-        int i = lua_tointeger(L, -1);
+        // integral types are read as lua integers, not truncated doubles
+        T n = (T(0.5) == T(0)) ? (T)lua_tointeger(L, -1) : (T)lua_tonumber(L, -1);
         lua_pop(L, 1);
-        return i;
+        return n;
       }
     };
-    template <>
-      struct cast_traits<long>
+    template <typename T>
+      struct cast_traits
     {
-      static long cast(const object &obj)
+      static T cast(const object &obj)
       {
-        lua_State *L = obj.interpreter();
-        obj.push();
-        long l = lua_tointeger(L, -1);
-        lua_pop(L, 1);
-        return l;
+        return value_cast<T>::cast(obj);
       }
     };
     template <>
-      struct cast_traits<unsigned char>
+      struct cast_traits<bool>
     {
-      static unsigned char cast(const object &obj)
+      static bool cast(const object &obj)
       {
         lua_State *L = obj.interpreter();
         obj.push();
-        unsigned char u = lua_tointeger(L, -1);
+        bool b = lua_toboolean(L, -1);
         lua_pop(L, 1);
-        return u;
+        return b;
       }
     };
     template <>
@@ -2105,7 +5453,7 @@ namespace luaport
     {
       static luaport::reference<T> cast(const object &obj)
       {
-  printf("CAST TO REFERENCE\n");
+  LUAPORT_TRACE(("CAST TO REFERENCE\n"));
         return obj;
       }
     };
@@ -2114,37 +5462,36 @@ namespace luaport
     {
       static T* cast(const object &obj)
       {
+        typedef typename type_traits<T>::natural natural;
         lua_State *L = obj.interpreter();
-        object m = obj.getmetatable();
-        if (! m.is_table()) { throw std::bad_cast(); }
-        if (! m["luaport"].is_valid()) { throw std::bad_cast(); }
-
-        object c = m["class"];
+        void *p = NULL;
         obj.push();
-        managed<void> *u = (managed<void> *)lua_touserdata(L, -1);
-        void *p = u->p;
+        // the class of the instance or one of its ancestors
+        bool found = to_instance(L, -1, finalizer<managed<natural>*>::lfunc, &p);
         lua_pop(L, 1);
-        for (;;)
-        {
-  printf("%s?\n", (const char *)registry(L)["luaport"]["class_to_name"][c].obj());
-          if (c == get_class<T>(L)) { break; }
-          m = c.getmetatable();
-          if (m.type() != LUA_TTABLE) { throw std::bad_cast(); }
-          c = m["__index"];
-          object(m["downcast"]).push();
-          void*(*cast)(void *) = (void* (*)(void*))lua_touserdata(L, -1);
-          lua_pop(L, 1);
-          if (cast)
-          {
-            p = cast(p);
-          }
-          else
-          {
-          }
-        }
+        if (! found) { throw std::bad_cast(); }
         return (T *)p;
       }
     };
+#ifdef LUAPORT_CXX11
+    template <typename T>
+      struct cast_traits<std::shared_ptr<T> >
+    {
+      static std::shared_ptr<T> cast(const object &obj)
+      {
+        if (obj.type() == LUA_TNIL) { return std::shared_ptr<T>(); }
+        T *p = cast_traits<T *>::cast(obj);
+        // instances pushed as raw pointers have no owner to share
+        if (! obj.getmetatable()["shared"]) { throw std::bad_cast(); }
+        lua_State *L = obj.interpreter();
+        obj.push();
+        shared_holder_base *u = (shared_holder_base *)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        // aliasing constructor, p may be adjusted by the downcast
+        return std::shared_ptr<T>(u->sp, p);
+      }
+    };
+#endif
 
     /// @endcond DETAIL
   } // namespace detail
@@ -2169,15 +5516,17 @@ namespace luaport
     template <typename T>
       inline int finalizer<T *>::lfunc(lua_State *L)
     {
-      managed<T> *u = (managed<T>*)lua_touserdata(L, 1);
+      // T is the managed<...> holder type
+      T *u = (T *)lua_touserdata(L, 1);
       object inst = from_stack(L, 1);
       object f = inst["__finalize"];
       if (f.type() == LUA_TFUNCTION)
       {
         f(inst);
       }
+      release_members(L, 1);
       // call only the dtor (not delete)
-      u->~managed();
+      u->~T();
       // lua will release the memory
       return 0;
     }
@@ -2191,86 +5540,691 @@ namespace luaport
     template <typename T>
       managed<T>::~managed()
     {
-      printf("RELEASE UDATA!\n");
+      LUAPORT_TRACE(("RELEASE UDATA!\n"));
+      count_release(counter, adopt ? &instance_counter::adopted : &instance_counter::borrowed,
+                    sizeof(managed<T>));
       if (adopt)
       {
         object ref = registry(L)["luaport"]["references"];
         object count = ref[lightuserdata(L, p)];
         if (! count)
         {
-          printf("ERROR!\n");
+          LUAPORT_TRACE(("ERROR!\n"));
         }
         int c = object_cast<int>(count);
-        printf("COUNT DOWN (BEFORE): %d\n", c);
+        LUAPORT_TRACE(("COUNT DOWN (BEFORE): %d\n", c));
         c--;
-        printf("COUNT DOWN (ATER): %d\n", c);
+        LUAPORT_TRACE(("COUNT DOWN (ATER): %d\n", c));
         ref[lightuserdata(L, p)] = c;
         if (c == 0)
         {
-          ref[lightuserdata(L, p)] = object();
-          printf("RELEASE THE INSTANCE\n");
-          delete p;
+          ref[lightuserdata(L, p)] = object();
+          account_external(L, p, false);
+          LUAPORT_TRACE(("RELEASE THE INSTANCE\n"));
+          finalize_queue *q = get_finalize_queue(L);
+          if (q) { q->push(p, destroy); }
+          else { delete p; }
+        }
+      }
+    }
+
+
+    // placement new
+    template <typename T>
+      void* managed<T>::operator new(std::size_t, lua_State *L)
+    {
+      return lua_newuserdata(L, sizeof(managed<T>));
+    }
+
+    // the instance itself is destroyed with the holder
+    template <typename T>
+      value_holder<T>::~value_holder()
+    {
+      count_release(counter, &instance_counter::adopted, sizeof(value_holder<T>));
+    }
+
+    template <typename T>
+      inline std::string type_traits<T>::name(lua_State *L)
+    {
+      object fmap = registry(L)["luaport"]["func_to_name"];
+      object str = fmap[finalizer<T>::lfunc];
+      if (str) { return str.tostring(); }
+      str = fmap[finalizer<managed<T>*>::lfunc];
+      if (str) { return str.tostring(); }
+      return "[unknown]";
+    }
+    template <typename T>
+      inline std::string type_traits<T &>::name(lua_State *L)
+    {
+      return type_traits<T>::name(L) + "&";
+    }
+    template <typename T>
+      inline std::string type_traits<const T>::name(lua_State *L)
+    {
+      return "const " + type_traits<T>::name(L);
+    }
+    template <typename T>
+      inline std::string type_traits<const T &>::name(lua_State *L)
+    {
+      return "const " + type_traits<T>::name(L) + "&";
+    }
+    template <typename A, typename B>
+      inline std::string type_traits<std::pair<A, B> >::name(lua_State *L)
+    {
+      return type_traits<A>::name(L) + ", " + type_traits<B>::name(L);
+    }
+#ifdef LUAPORT_CXX11
+    template <typename... E>
+      inline std::string type_traits<std::tuple<E...> >::name(lua_State *L)
+    {
+      std::string names[] = { std::string(), type_traits<E>::name(L)... };
+      std::string joined;
+      for (std::size_t i = 1; i < sizeof(names) / sizeof(names[0]); i++)
+      {
+        if (i > 1) { joined += ", "; }
+        joined += names[i];
+      }
+      return joined;
+    }
+#endif
+
+  }
+
+  // state_copier class implementation
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // copies the value on the stack of L onto the stack of D
+    class state_copier
+    {
+      public:
+        state_copier(lua_State *L, lua_State *D)
+          : L(L), D(D), seen(0), copies(0), next_id(0), depth(0)
+        { }
+
+        void run(int idx)
+        {
+          idx = lua_absindex(L, idx);
+          int top = lua_gettop(L);
+          int dst_top = lua_gettop(D);
+          try {
+            luaL_checkstack(D, 8, "copy_to");
+            lua_newtable(L);
+            seen = lua_gettop(L);
+            lua_newtable(D);
+            copies = lua_gettop(D);
+            value(idx);
+            lua_remove(D, copies);
+          }
+          catch (...) {
+            lua_settop(L, top);
+            lua_settop(D, dst_top);
+            throw;
+          }
+          lua_settop(L, top);
+        }
+
+      private:
+        // pushes already copied table/instance
+        bool ref(int idx)
+        {
+          lua_pushvalue(L, idx);
+          lua_rawget(L, seen);
+          if (lua_isnumber(L, -1))
+          {
+            lua_rawgeti(D, copies, (int)lua_tointeger(L, -1));
+            lua_pop(L, 1);
+            return true;
+          }
+          lua_pop(L, 1);
+          return false;
+        }
+
+        // remembers the copy on the top of D
+        void mark(int idx)
+        {
+          lua_pushvalue(L, idx);
+          lua_pushinteger(L, ++next_id);
+          lua_rawset(L, seen);
+          lua_pushvalue(D, -1);
+          lua_rawseti(D, copies, next_id);
+        }
+
+        void table(int idx)
+        {
+          if (ref(idx)) { return; }
+          int narr = (int)lua_rawlen(L, idx);
+          int total = 0;
+          lua_pushnil(L);
+          while (lua_next(L, idx))
+          {
+            total++;
+            lua_pop(L, 1);
+          }
+          lua_createtable(D, narr, total > narr ? total - narr : 0);
+          mark(idx);
+          int t = lua_gettop(D);
+          lua_pushnil(L);
+          while (lua_next(L, idx))
+          {
+            int k = lua_gettop(L) - 1;
+            value(k);
+            value(k + 1);
+            lua_rawset(D, t);
+            lua_pop(L, 1);
+          }
+        }
+
+        void instance(int idx)
+        {
+          if (ref(idx)) { return; }
+          instance_pusher pusher = NULL;
+          if (lua_getmetatable(L, idx))
+          {
+            lua_getfield(L, -1, "luaport");
+            lua_getfield(L, -2, "__gc");
+            lua_CFunction gc = lua_tocfunction(L, -1);
+            if (lua_toboolean(L, -2) && gc)
+            {
+              lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+              lua_getfield(L, -1, "func_to_push");
+              lua_pushcfunction(L, gc);
+              lua_rawget(L, -2);
+              pusher = (instance_pusher)lua_touserdata(L, -1);
+              lua_pop(L, 3);
+            }
+            lua_pop(L, 3);
+          }
+          if (! pusher)
+          {
+            throw luaport::exception("error on object::copy_to - unregistered userdata");
+          }
+          pusher(D, lua_touserdata(L, idx));
+          mark(idx);
+        }
+
+        void value(int idx)
+        {
+          if (++depth > 1000)
+          {
+            throw luaport::exception("error on object::copy_to - nesting too deep");
+          }
+          luaL_checkstack(L, 8, "copy_to");
+          luaL_checkstack(D, 8, "copy_to");
+          switch (lua_type(L, idx))
+          {
+            case LUA_TNIL:
+              lua_pushnil(D);
+              break;
+            case LUA_TBOOLEAN:
+              lua_pushboolean(D, lua_toboolean(L, idx));
+              break;
+            case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+              if (lua_isinteger(L, idx))
+              {
+                lua_pushinteger(D, lua_tointeger(L, idx));
+                break;
+              }
+#endif
+              lua_pushnumber(D, lua_tonumber(L, idx));
+              break;
+            case LUA_TSTRING:
+            {
+              size_t len;
+              const char *str = lua_tolstring(L, idx, &len);
+              lua_pushlstring(D, str, len);
+              break;
+            }
+            case LUA_TLIGHTUSERDATA:
+              lua_pushlightuserdata(D, lua_touserdata(L, idx));
+              break;
+            case LUA_TFUNCTION:
+            {
+              lua_CFunction f = lua_tocfunction(L, idx);
+              // only C functions without upvalues are context free
+              if (! f || lua_getupvalue(L, idx, 1) != NULL)
+              {
+                throw luaport::exception("error on object::copy_to - unable to copy function");
+              }
+              lua_pushcfunction(D, f);
+              break;
+            }
+            case LUA_TTABLE:
+              table(idx);
+              break;
+            case LUA_TUSERDATA:
+              instance(idx);
+              break;
+            default:
+              throw luaport::exception(std::string("error on object::copy_to - unable to copy ") +
+                                       luaL_typename(L, idx));
+          }
+          depth--;
+        }
+
+        lua_State *L;
+        lua_State *D;
+        int seen;
+        int copies;
+        int next_id;
+        int depth;
+    };
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+} // namespace luaport
+
+// -----------------------------------------------------
+// library function implementation
+// -----------------------------------------------------
+namespace luaport
+{
+  using namespace detail;
+
+  template <typename T>
+    inline std::string get_typename(lua_State *L)
+  {
+    return type_traits<T>::name(L);
+  }
+
+
+  template <typename T>
+    inline object get_class(lua_State *L)
+  {
+    // cached by newclass (same as registry.luaport.func_to_class[key])
+    lua_rawgetp(L, LUA_REGISTRYINDEX, (void *)finalizer<managed<T>*>::lfunc);
+    object c = from_stack(L, -1);
+    lua_pop(L, 1);
+    return c;
+  }
+
+
+  template <typename T>
+    inline void set_external_size(lua_State *L, std::size_t (*size)(const T *))
+  {
+    object func_to_size = registry(L)["luaport"]["func_to_size"];
+    func_to_size[finalizer<managed<T>*>::lfunc] = lightuserdata(L, size);
+  }
+
+
+  template <typename T>
+    inline std::size_t external_size(lua_State *L)
+  {
+    object func_to_bytes = registry(L)["luaport"]["func_to_bytes"];
+    return (std::size_t)object_cast<double>(
+      func_to_bytes[finalizer<managed<T>*>::lfunc]);
+  }
+
+
+  inline std::size_t external_size(lua_State *L)
+  {
+    return (std::size_t)object_cast<double>(
+      registry(L)["luaport"]["external_bytes"]);
+  }
+
+
+  namespace detail
+  {
+    inline class_stats make_class_stats(lua_State *L, lua_CFunction key)
+    {
+      object port = registry(L)["luaport"];
+      class_stats s;
+      s.name = object_cast<std::string>(port["func_to_name"][key]);
+      s.live = s.pushes = s.adopted = s.borrowed = s.shared = 0;
+      s.instance_bytes = s.member_bytes = 0;
+      std::size_t bytes = 0;
+      instance_counter *n = get_instance_counter(L, key);
+      if (n)
+      {
+        s.live = n->live;
+        s.pushes = n->pushes;
+        s.adopted = n->adopted;
+        s.borrowed = n->borrowed;
+        s.shared = n->shared;
+        s.instance_bytes = n->instance_bytes;
+        s.member_bytes = n->member_bytes;
+        bytes = n->bytes;
+      }
+      s.external_bytes = (std::size_t)object_cast<double>(port["func_to_bytes"][key]);
+      s.bytes = bytes + s.member_bytes + s.external_bytes;
+      return s;
+    }
+  }
+
+
+  template <typename T>
+    inline class_stats get_class_stats(lua_State *L)
+  {
+    return detail::make_class_stats(L, finalizer<managed<T>*>::lfunc);
+  }
+
+
+  inline std::vector<class_stats> get_class_stats(lua_State *L)
+  {
+    std::vector<class_stats> all;
+    lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+    if (! lua_istable(L, -1))
+    {
+      lua_pop(L, 1);
+      return all;
+    }
+    lua_getfield(L, -1, "func_to_class");
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+      lua_CFunction key = lua_tocfunction(L, -2);
+      lua_pop(L, 1);
+      if (key) { all.push_back(detail::make_class_stats(L, key)); }
+    }
+    lua_pop(L, 2);
+    return all;
+  }
+
+
+  namespace detail
+  {
+    inline bool heap_by_bytes(const heap_entry &a, const heap_entry &b)
+    {
+      return a.bytes > b.bytes;
+    }
+
+    inline std::string heap_key_path(lua_State *L, int idx)
+    {
+      char buf[32];
+      switch (lua_type(L, idx))
+      {
+        case LUA_TSTRING:
+        {
+          std::string key = lua_tostring(L, idx);
+          bool ident = ! key.empty() && ! (key[0] >= '0' && key[0] <= '9');
+          for (std::size_t i = 0; i < key.size() && ident; i++)
+          {
+            char c = key[i];
+            ident = c == '_' || (c >= 'a' && c <= 'z') ||
+                    (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+          }
+          if (ident) { return "." + key; }
+          if (key.size() > 32) { key = key.substr(0, 29) + "..."; }
+          return "[\"" + key + "\"]";
+        }
+        case LUA_TNUMBER:
+          std::sprintf(buf, "[%.14g]", lua_tonumber(L, idx));
+          return buf;
+        default:
+          return std::string("[") + luaL_typename(L, idx) + "]";
+      }
+    }
+
+    class heap_walker
+    {
+      public:
+        heap_walker(lua_State *L) : L(L)
+        {
+          r.table_count = r.table_bytes = 0;
+          r.string_count = r.string_bytes = 0;
+        }
+
+        heap_report walk(std::size_t top)
+        {
+          luaL_checkstack(L, 8, "heap_dump");
+          base = lua_gettop(L);
+          lua_newtable(L);
+          seen = lua_gettop(L);
+          lua_newtable(L);
+          queue = lua_gettop(L);
+          lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+          visit("_G");
+          lua_pushvalue(L, LUA_REGISTRYINDEX);
+          visit("registry");
+          lua_pushthread(L);
+          visit("<running>");
+          for (std::size_t head = 0; head < paths.size(); head++)
+          {
+            lua_rawgeti(L, queue, (int)head + 1);
+            // copied, as visit() grows paths
+            std::string path = paths[head];
+            scan(lua_gettop(L), path);
+            lua_pop(L, 1);
+          }
+          lua_settop(L, base);
+          select(r.tables, top);
+          select(r.strings, top);
+          return r;
+        }
+
+      private:
+        static void select(std::vector<heap_entry> &v, std::size_t top)
+        {
+          if (v.size() > top)
+          {
+            std::partial_sort(v.begin(), v.begin() + top, v.end(), heap_by_bytes);
+            v.resize(top);
+          }
+          else
+          {
+            std::sort(v.begin(), v.end(), heap_by_bytes);
+          }
+        }
+
+        // records (and queues) the value on the top, and pops it
+        void visit(const std::string &path)
+        {
+          int t = lua_type(L, -1);
+          if (t != LUA_TSTRING && t != LUA_TTABLE && t != LUA_TFUNCTION &&
+              t != LUA_TUSERDATA && t != LUA_TTHREAD)
+          {
+            lua_pop(L, 1);
+            return;
+          }
+          lua_pushvalue(L, -1);
+          lua_rawget(L, seen);
+          bool found = lua_toboolean(L, -1) != 0;
+          lua_pop(L, 1);
+          if (found)
+          {
+            lua_pop(L, 1);
+            return;
+          }
+          lua_pushvalue(L, -1);
+          lua_pushboolean(L, 1);
+          lua_rawset(L, seen);
+          if (t == LUA_TSTRING)
+          {
+            heap_entry e;
+            e.path = path;
+            e.length = lua_rawlen(L, -1);
+            e.bytes = heap_string_size + e.length + 1;
+            r.strings.push_back(e);
+            r.string_count++;
+            r.string_bytes += e.bytes;
+            lua_pop(L, 1);
+            return;
+          }
+          lua_rawseti(L, queue, (int)paths.size() + 1);
+          paths.push_back(path);
+        }
+
+        void scan(int idx, const std::string &path)
+        {
+          switch (lua_type(L, idx))
+          {
+            case LUA_TTABLE:
+            {
+              std::size_t narray = 0;
+              for (;; narray++)
+              {
+                lua_rawgeti(L, idx, (int)narray + 1);
+                bool nil = lua_isnil(L, -1);
+                lua_pop(L, 1);
+                if (nil) { break; }
+              }
+              std::size_t n = 0;
+              lua_pushnil(L);
+              while (lua_next(L, idx))
+              {
+                n++;
+                std::string sub = path + heap_key_path(L, -2);
+                visit(sub);
+                lua_pushvalue(L, -1);
+                visit(sub + "<key>");
+              }
+              std::size_t nodes = 0;
+              if (n > narray)
+              {
+                for (nodes = 1; nodes < n - narray; nodes <<= 1) { }
+              }
+              heap_entry e;
+              e.path = path;
+              e.length = n;
+              e.bytes = heap_table_size + narray * heap_array_slot +
+                        nodes * heap_node_size;
+              r.tables.push_back(e);
+              r.table_count++;
+              r.table_bytes += e.bytes;
+              if (lua_getmetatable(L, idx)) { visit(path + "<metatable>"); }
+              break;
+            }
+            case LUA_TFUNCTION:
+            {
+              const char *name;
+              for (int i = 1; (name = lua_getupvalue(L, idx, i)); i++)
+              {
+                visit(path + "<upvalue " + (*name ? name : "?") + ">");
+              }
+              break;
+            }
+            case LUA_TUSERDATA:
+              if (lua_getmetatable(L, idx)) { visit(path + "<metatable>"); }
+              lua_getuservalue(L, idx);
+              visit(path + "<uservalue>");
+              break;
+            case LUA_TTHREAD:
+              scan_thread(lua_tothread(L, idx), path);
+              break;
+          }
+        }
+
+        // values of a thread are moved to L and visited
+        void scan_thread(lua_State *co, const std::string &path)
+        {
+          if (! lua_checkstack(co, 2)) { return; }
+          char buf[32];
+          // on the running thread, the frame of the walker is skipped
+          // except the slots below it
+          int slots = (co == L) ? base : lua_gettop(co);
+          for (int i = 1; i <= slots; i++)
+          {
+            lua_pushvalue(co, i);
+            lua_xmove(co, L, 1);
+            std::sprintf(buf, "<stack %d>", i);
+            visit(path + buf);
+          }
+          lua_Debug ar;
+          for (int level = (co == L) ? 1 : 0; lua_getstack(co, level, &ar); level++)
+          {
+            std::sprintf(buf, "<level %d>", level);
+            lua_getinfo(co, "f", &ar);
+            lua_xmove(co, L, 1);
+            visit(path + buf + "<function>");
+            const char *name;
+            for (int i = 1; (name = lua_getlocal(co, &ar, i)); i++)
+            {
+              lua_xmove(co, L, 1);
+              visit(path + buf + "<local " + name + ">");
+            }
+          }
         }
-      }
-    }
 
+        lua_State *L;
+        int base;
+        int seen;
+        int queue;
+        std::vector<std::string> paths;
+        heap_report r;
+    };
 
-    // placement new
-    template <typename T>
-      void* managed<T>::operator new(std::size_t, lua_State *L)
+    inline int lua_heap_classes(lua_State *L)
     {
-      return lua_newuserdata(L, sizeof(managed<T>));
+      std::vector<class_stats> all = get_class_stats(L);
+      lua_createtable(L, (int)all.size(), 0);
+      for (std::size_t i = 0; i < all.size(); i++)
+      {
+        lua_createtable(L, 0, 10);
+        lua_pushstring(L, all[i].name.c_str());
+        lua_setfield(L, -2, "name");
+        lua_pushnumber(L, (lua_Number)all[i].live);
+        lua_setfield(L, -2, "live");
+        lua_pushnumber(L, (lua_Number)all[i].pushes);
+        lua_setfield(L, -2, "pushes");
+        lua_pushnumber(L, (lua_Number)all[i].adopted);
+        lua_setfield(L, -2, "adopted");
+        lua_pushnumber(L, (lua_Number)all[i].borrowed);
+        lua_setfield(L, -2, "borrowed");
+        lua_pushnumber(L, (lua_Number)all[i].shared);
+        lua_setfield(L, -2, "shared");
+        lua_pushnumber(L, (lua_Number)all[i].instance_bytes);
+        lua_setfield(L, -2, "instance_bytes");
+        lua_pushnumber(L, (lua_Number)all[i].member_bytes);
+        lua_setfield(L, -2, "member_bytes");
+        lua_pushnumber(L, (lua_Number)all[i].external_bytes);
+        lua_setfield(L, -2, "external_bytes");
+        lua_pushnumber(L, (lua_Number)all[i].bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_rawseti(L, -2, (int)i + 1);
+      }
+      return 1;
     }
 
-    template <typename T>
-      inline std::string type_traits<T>::name(lua_State *L)
-    {
-      object fmap = registry(L)["luaport"]["func_to_name"];
-      object str = fmap[finalizer<T>::lfunc];
-      if (str) { return str.tostring(); }
-      str = fmap[finalizer<managed<T>*>::lfunc];
-      if (str) { return str.tostring(); }
-      return "[unknown]";
-    }
-    template <typename T>
-      inline std::string type_traits<T &>::name(lua_State *L)
-    {
-      return type_traits<T>::name(L) + "&";
-    }
-    template <typename T>
-      inline std::string type_traits<const T>::name(lua_State *L)
+    inline void push_heap_entries(lua_State *L, const std::vector<heap_entry> &v)
     {
-      return "const " + type_traits<T>::name(L);
+      lua_createtable(L, (int)v.size(), 0);
+      for (std::size_t i = 0; i < v.size(); i++)
+      {
+        lua_createtable(L, 0, 3);
+        lua_pushstring(L, v[i].path.c_str());
+        lua_setfield(L, -2, "path");
+        lua_pushnumber(L, (lua_Number)v[i].bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushnumber(L, (lua_Number)v[i].length);
+        lua_setfield(L, -2, "length");
+        lua_rawseti(L, -2, (int)i + 1);
+      }
     }
-    template <typename T>
-      inline std::string type_traits<const T &>::name(lua_State *L)
+
+    inline int lua_heap_dump(lua_State *L)
     {
-      return "const " + type_traits<T>::name(L) + "&";
+      std::size_t top = (std::size_t)luaL_optinteger(L, 1, 20);
+      heap_report r;
+      try {
+        r = heap_dump(L, top);
+      }
+      catch (std::exception &e) {
+        return luaL_error(L, "%s", e.what());
+      }
+      lua_createtable(L, 0, 6);
+      push_heap_entries(L, r.tables);
+      lua_setfield(L, -2, "tables");
+      push_heap_entries(L, r.strings);
+      lua_setfield(L, -2, "strings");
+      lua_pushnumber(L, (lua_Number)r.table_count);
+      lua_setfield(L, -2, "table_count");
+      lua_pushnumber(L, (lua_Number)r.table_bytes);
+      lua_setfield(L, -2, "table_bytes");
+      lua_pushnumber(L, (lua_Number)r.string_count);
+      lua_setfield(L, -2, "string_count");
+      lua_pushnumber(L, (lua_Number)r.string_bytes);
+      lua_setfield(L, -2, "string_bytes");
+      return 1;
     }
-
-  }
-
-} // namespace luaport
-
-// -----------------------------------------------------
-// library function implementation
-// -----------------------------------------------------
-namespace luaport
-{
-  using namespace detail;
-
-  template <typename T>
-    inline std::string get_typename(lua_State *L)
-  {
-    return type_traits<T>::name(L);
   }
 
 
-  template <typename T>
-    inline object get_class(lua_State *L)
+  inline heap_report heap_dump(lua_State *L, std::size_t top)
   {
-    object func_to_class = registry(L)["luaport"]["func_to_class"];
-    return func_to_class[finalizer<managed<T>*>::lfunc];
+    return detail::heap_walker(L).walk(top);
   }
 
 
@@ -2344,10 +6298,28 @@ namespace luaport
       class_to_name[c] = name;
       object func_to_class = registry(L)["luaport"]["func_to_class"];
       func_to_class[finalizer<managed<T>*>::lfunc] = c;
+      // cached with the raw key for the casts of the instances
+      c.push();
+      lua_rawsetp(L, LUA_REGISTRYINDEX, (void *)finalizer<managed<T>*>::lfunc);
       object func_to_name = registry(L)["luaport"]["func_to_name"];
       func_to_name[finalizer<managed<T>*>::lfunc] = name;
+      object func_to_push = registry(L)["luaport"]["func_to_push"];
+      func_to_push[finalizer<managed<T>*>::lfunc] =
+        lightuserdata(L, push_instance<T>);
+#ifdef LUAPORT_CXX11
+      func_to_push[finalizer<shared_holder<T>*>::lfunc] =
+        lightuserdata(L, push_shared_instance<T>);
+#endif
       object name_to_class = registry(L)["luaport"]["name_to_class"];
       name_to_class[name] = c;
+      m["__newindex"] = lua_class_define;
+      // read by push and the finalizers without the registry lookups
+      instance_counter *n = get_instance_counter(L, finalizer<managed<T>*>::lfunc);
+      if (n)
+      {
+        n->instance_bytes = heap_udata_size + sizeof(managed<T>);
+        m["counter"] = lightuserdata(L, n);
+      }
       c.setmetatable(m);
       return c;
     }
@@ -2359,7 +6331,6 @@ namespace luaport
   template <typename Derived, typename Base>
     inline object newclass(lua_State *L, const std::string &name)
   {
-    return newclass<Derived>(L, name);
     object b = get_class<Base>(L);
     if (! b)
     {
@@ -2367,10 +6338,78 @@ namespace luaport
       throw luaport::exception(msg + typeid(Base).name());
     }
     object d = newclass<Derived>(L, name);
-printf("D RETURN\n");
+LUAPORT_TRACE(("D RETURN\n"));
     object m = d.getmetatable();
+    object bm = b.getmetatable();
+    // members defined in the base later are still found through __index
     m["__index"] = b;
     m["downcast"] = lightuserdata(L, downcast<Derived, Base>);
+    if (bm["properties"]) { m["properties"] = true; }
+    // getters defined on the base later are enabled for Derived as well
+    object derived = bm.table("derived");
+    derived.push();
+    d.push();
+    lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+    lua_pop(L, 1);
+    object base_metamethods = bm["metamethods"];
+    if (base_metamethods.is_table())
+    {
+      object metamethods = m.table("metamethods");
+      base_metamethods.push();
+      lua_pushnil(L);
+      while (lua_next(L, -2))
+      {
+        metamethods[object(from_stack(L, -2))] = object(from_stack(L, -1));
+        lua_pop(L, 1);
+      }
+      lua_pop(L, 1);
+    }
+
+    luaL_checkstack(L, 8, "newclass");
+    // flatten: copy the members of the base (already flattened)
+    d.push();
+    b.push();
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, -5);
+    }
+    lua_pop(L, 2);
+
+    // precompute the upcasts to all the ancestors
+    upcast_chain direct;
+    direct.n = 1;
+    direct.f[0] = downcast<Derived, Base>;
+    object upcasts = newtable(L);
+    upcasts.push();
+    b.push();
+    *(upcast_chain *)lua_newuserdata(L, sizeof(upcast_chain)) = direct;
+    lua_rawset(L, -3);
+    object(bm["upcasts"]).push();
+    if (lua_istable(L, -1))
+    {
+      lua_pushnil(L);
+      while (lua_next(L, -2))
+      {
+        upcast_chain *rest = (upcast_chain *)lua_touserdata(L, -1);
+        if (rest->n >= upcast_chain::max_depth)
+        {
+          lua_pop(L, 4);
+          throw luaport::exception("error on luaport::newclass - too deep hierarchy");
+        }
+        upcast_chain *chain = (upcast_chain *)lua_newuserdata(L, sizeof(upcast_chain));
+        *chain = direct;
+        for (int i = 0; i < rest->n; i++) { chain->f[chain->n++] = rest->f[i]; }
+        lua_replace(L, -2);
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -5);
+      }
+    }
+    lua_pop(L, 2);
+    m["upcasts"] = upcasts;
     return d;
   }
 
@@ -2384,6 +6423,161 @@ printf("D RETURN\n");
   }
 
 
+  template <typename B1, typename B2>
+    inline lua_CFunction overload(B1 b1, B2 b2)
+  {
+    return overload_traits<B1,B2>::lfunc;
+  }
+  template <typename B1, typename B2, typename B3>
+    inline lua_CFunction overload(B1 b1, B2 b2, B3 b3)
+  {
+    return overload_traits<B1,B2,B3>::lfunc;
+  }
+  template <typename B1, typename B2, typename B3, typename B4>
+    inline lua_CFunction overload(B1 b1, B2 b2, B3 b3, B4 b4)
+  {
+    return overload_traits<B1,B2,B3,B4>::lfunc;
+  }
+  template <typename B1, typename B2, typename B3, typename B4,
+            typename B5>
+    inline lua_CFunction overload(B1 b1, B2 b2, B3 b3, B4 b4, B5 b5)
+  {
+    return overload_traits<B1,B2,B3,B4,B5>::lfunc;
+  }
+  template <typename B1, typename B2, typename B3, typename B4,
+            typename B5, typename B6>
+    inline lua_CFunction overload(B1 b1, B2 b2, B3 b3, B4 b4, B5 b5, B6 b6)
+  {
+    return overload_traits<B1,B2,B3,B4,B5,B6>::lfunc;
+  }
+
+
+  template <typename F>
+    inline void set_metamethod(const object &c, const std::string &event,
+                               const F &f)
+  {
+    if (event == "__gc" || event == "__index" || event == "__newindex")
+    {
+      throw luaport::exception("error on set_metamethod - " + event +
+                               " is reserved");
+    }
+    object m = c.getmetatable();
+    if (! m.is_table())
+    {
+      throw luaport::exception("error on set_metamethod - not a class");
+    }
+    lua_State *L = m.interpreter();
+    int top = lua_gettop(L);
+    luaL_checkstack(L, 4, "set_metamethod");
+    m.push();
+    lua_pushliteral(L, "metamethods");
+    lua_rawget(L, top + 1);
+    if (lua_istable(L, -1)) { lua_getfield(L, -1, event.c_str()); }
+    else { lua_pushnil(L); }
+    lua_replace(L, top + 2);
+    luaport::push(L, f);
+    detail::set_class_metamethod(L, top + 1, event.c_str(), top + 3, top + 2);
+    lua_settop(L, top);
+  }
+
+
+  /// bindings of C++ operators, for set_metamethod
+  /**
+   * the results are usable as lua_CFunction and as arguments of
+   * overload(), e.g. for both (Vec, double) and (double, Vec) operands:
+   * set_metamethod(c, "__mul", overload(op::mul<Vec, const Vec&, double>(),
+   *                                     op::mul<Vec, double, const Vec&>()))
+   * results of class types are moved into new userdata.
+   * @param R : result type of the operator
+   * @param A : type of the left (or only) operand
+   * @param B : type of the right operand
+   */
+  namespace op
+  {
+    #define LUAPORT_BINARY_OP(name) \
+      template <typename R, typename A, typename B> \
+        inline binding<R (*)(A, B), &binary_operators<R,A,B>::name> name() \
+      { \
+        return binding<R (*)(A, B), &binary_operators<R,A,B>::name>(); \
+      }
+    LUAPORT_BINARY_OP(add)
+    LUAPORT_BINARY_OP(sub)
+    LUAPORT_BINARY_OP(mul)
+    LUAPORT_BINARY_OP(div)
+    LUAPORT_BINARY_OP(mod)
+    #undef LUAPORT_BINARY_OP
+
+    #define LUAPORT_COMPARE_OP(name) \
+      template <typename A, typename B> \
+        inline binding<bool (*)(A, B), &compare_operators<A,B>::name> name() \
+      { \
+        return binding<bool (*)(A, B), &compare_operators<A,B>::name>(); \
+      }
+    LUAPORT_COMPARE_OP(eq)
+    LUAPORT_COMPARE_OP(lt)
+    LUAPORT_COMPARE_OP(le)
+    #undef LUAPORT_COMPARE_OP
+
+    /// -a
+    template <typename R, typename A>
+      inline binding<R (*)(A), &unary_operators<R,A>::unm> unm()
+    {
+      return binding<R (*)(A), &unary_operators<R,A>::unm>();
+    }
+
+    /// #a, by a.size()
+    template <typename A>
+      inline binding<unsigned long (*)(A), &object_operators<A>::len> len()
+    {
+      return binding<unsigned long (*)(A), &object_operators<A>::len>();
+    }
+
+    /// tostring(a), by operator<<(std::ostream&, A)
+    template <typename A>
+      inline binding<std::string (*)(A), &object_operators<A>::tostring> tostring()
+    {
+      return binding<std::string (*)(A), &object_operators<A>::tostring>();
+    }
+
+    /// a .. b, by the __tostring of the instances
+    inline lua_CFunction concat()
+    {
+      return lua_op_concat;
+    }
+  }
+
+
+  template <typename S, typename F>
+    inline object closure(lua_State *L, const F &fn)
+  {
+    new(lua_newuserdata(L, sizeof(F))) F(fn);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, functor_holder<F>::gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_pushcclosure(L, functor_traits<F, S>::lfunc, 1);
+    object f = from_stack(L, -1);
+    lua_pop(L, 1);
+    return f;
+  }
+#ifdef LUAPORT_CXX11
+  template <typename F>
+    inline object closure(lua_State *L, const F &fn)
+  {
+    typedef typename bound_method<decltype(&F::operator())>::signature S;
+    return closure<S>(L, fn);
+  }
+#endif
+  template <typename C, typename M>
+    inline object closure(lua_State *L, C *self, M m)
+  {
+    bound_method<M> b;
+    b.self = self;
+    b.m = m;
+    return closure<typename bound_method<M>::signature>(L, b);
+  }
+
+
   template <typename T>
     inline T object_cast(const object &obj)
   {
@@ -2397,18 +6591,81 @@ printf("D RETURN\n");
     object class_to_name = port.table("class_to_name");
     object class_to_func = port.table("class_to_func");
     object func_to_name = port.table("func_to_name");
+    object func_to_push = port.table("func_to_push");
     object func_to_class = port.table("func_to_class");
     object name_to_class = port.table("name_to_class");
     object references = port.table("references");
+    object func_to_size = port.table("func_to_size");
+    object func_to_bytes = port.table("func_to_bytes");
+    object external_sizes = port.table("external_sizes");
+    object func_to_stats = port.table("func_to_stats");
+    if (! port["external_bytes"]) { port["external_bytes"] = 0; }
+    if (! port["external_debt"]) { port["external_debt"] = 0; }
 
     func_to_name[finalizer<void>::lfunc] = "void";
+    func_to_name[finalizer<bool>::lfunc] = "bool";
     func_to_name[finalizer<int>::lfunc] = "int";
     func_to_name[finalizer<float>::lfunc] = "float";
     func_to_name[finalizer<double>::lfunc] = "double";
     func_to_name[finalizer<long>::lfunc] = "long";
+    func_to_name[finalizer<char>::lfunc] = "char";
+    func_to_name[finalizer<short>::lfunc] = "short";
+    func_to_name[finalizer<unsigned char>::lfunc] = "unsigned char";
+    func_to_name[finalizer<unsigned short>::lfunc] = "unsigned short";
+    func_to_name[finalizer<unsigned int>::lfunc] = "unsigned int";
+    func_to_name[finalizer<unsigned long>::lfunc] = "unsigned long";
     func_to_name[finalizer<std::string>::lfunc] = "string";
 
     globals(L)["class"] = lua_newclass;
+    object heap = globals(L).table("heap");
+    heap["classes"] = lua_heap_classes;
+    heap["dump"] = lua_heap_dump;
+#ifdef LUAPORT_PROFILE
+    object profile = globals(L).table("profile");
+    profile["snapshot"] = lua_profile_snapshot;
+    profile["reset"] = lua_profile_reset;
+#endif
+  }
+
+
+  inline void set_finalize_queue(lua_State *L, finalize_queue *q)
+  {
+    lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+    lua_getfield(L, -1, "finalize_queue");
+    finalize_token *t = (finalize_token *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (! t)
+    {
+      if (! q)
+      {
+        lua_pop(L, 1);
+        return;
+      }
+      t = (finalize_token *)lua_newuserdata(L, sizeof(finalize_token));
+      t->q = NULL;
+      lua_newtable(L);
+      lua_pushcfunction(L, finalize_token::gc);
+      lua_setfield(L, -2, "__gc");
+      lua_setmetatable(L, -2);
+      lua_setfield(L, -2, "finalize_queue");
+    }
+    lua_pop(L, 1);
+    t->set(q);
+  }
+
+
+  inline finalize_queue *get_finalize_queue(lua_State *L)
+  {
+    lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+    if (! lua_istable(L, -1))
+    {
+      lua_pop(L, 1);
+      return NULL;
+    }
+    lua_getfield(L, -1, "finalize_queue");
+    finalize_token *t = (finalize_token *)lua_touserdata(L, -1);
+    lua_pop(L, 2);
+    return t ? t->q : NULL;
   }
 
 
@@ -2418,6 +6675,230 @@ printf("D RETURN\n");
   }
 
 
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    // calls func for in[first] ... in[first + n - 1] into the same positions
+    // of out, both indexed so std::vector<bool> works as well as pointers
+    template <typename R, typename In, typename Out>
+      inline std::size_t call_batch_range(const object &func, const In &in,
+                                          std::size_t first, std::size_t n,
+                                          Out &out, std::vector<batch_error> *errors)
+    {
+      lua_State *L = func.interpreter();
+      if (! L) { throw luaport::exception("given invalid interpreter"); }
+      luaL_checkstack(L, 4, "call_batch");
+      int top = lua_gettop(L);
+      func.push();
+      int f = top + 1;
+      std::size_t succeeded = 0;
+      try {
+        for (std::size_t i = first; i < first + n; i++)
+        {
+          lua_pushvalue(L, f);
+          luaport::push(L, in[i]);
+          if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+          {
+            if (errors)
+            {
+              batch_error e;
+              e.index = i;
+              const char *msg = lua_tostring(L, -1);
+              e.message = msg ? msg : "(error object is not a string)";
+              errors->push_back(e);
+            }
+            lua_settop(L, f);
+            continue;
+          }
+          try {
+            out[i] = stack_traits<R>::get(L, -1);
+            succeeded++;
+          }
+          catch (std::exception &) {
+            if (errors)
+            {
+              batch_error e;
+              e.index = i;
+              e.message = std::string("unable to convert ") + luaL_typename(L, -1) +
+                          " into " + get_typename<R>(L);
+              errors->push_back(e);
+            }
+          }
+          lua_settop(L, f);
+        }
+      }
+      catch (...) {
+        // e.g. unable to push the input, don't leave the function pinned
+        lua_settop(L, top);
+        throw;
+      }
+      lua_settop(L, top);
+      return succeeded;
+    }
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+
+  template <typename R, typename T>
+    inline std::size_t call_batch(const object &func, const T *in,
+                                  std::size_t n, R *out,
+                                  std::vector<batch_error> *errors)
+  {
+    return detail::call_batch_range<R>(func, in, 0, n, out, errors);
+  }
+
+
+  template <typename R, typename T>
+    inline std::vector<R> call_batch(const object &func,
+                                     const std::vector<T> &in,
+                                     std::vector<batch_error> *errors)
+  {
+    std::vector<R> out(in.size());
+    detail::call_batch_range<R>(func, in, 0, in.size(), out, errors);
+    return out;
+  }
+
+
+#ifdef LUAPORT_PROFILE
+  inline double profile_bucket_ns(int i)
+  {
+    return (double)(1ULL << i) * profile_ns_per_tick();
+  }
+
+
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    inline void profile_merge(profile_record &r, const profile_entry &e)
+    {
+      if (r.buckets.empty())
+      {
+        r.name = e.name;
+        r.calls = 0;
+        r.total_ns = 0;
+        r.buckets.resize(profile_nbuckets);
+      }
+      r.calls += e.calls.load(std::memory_order_relaxed);
+      r.total_ns += e.ticks.load(std::memory_order_relaxed);
+      for (int b = 0; b < profile_nbuckets; b++)
+      {
+        r.buckets[b] += e.buckets[b].load(std::memory_order_relaxed);
+      }
+    }
+
+    inline void profile_clear(profile_entry &e)
+    {
+      e.calls.store(0, std::memory_order_relaxed);
+      e.ticks.store(0, std::memory_order_relaxed);
+      for (int b = 0; b < profile_nbuckets; b++)
+      {
+        e.buckets[b].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+
+  inline std::vector<profile_record> profile_snapshot()
+  {
+    // merge by key, the same binding has an entry per thread, bindings by
+    // the C function and callbacks by the name
+    typedef std::pair<const void *, std::string> merge_key;
+    std::map<merge_key, profile_record> merged;
+    {
+      profile_threads &all = profile_all();
+      std::lock_guard<std::mutex> lock(all.mutex);
+      for (std::size_t t = 0; t < all.list.size(); t++)
+      {
+        profile_thread &th = *all.list[t];
+        std::lock_guard<std::mutex> lock(th.mutex);
+        std::unordered_map<const void *, std::unique_ptr<profile_entry> >::iterator i;
+        for (i = th.entries.begin(); i != th.entries.end(); ++i)
+        {
+          profile_merge(merged[merge_key(i->first, std::string())], *i->second);
+        }
+        std::unordered_map<std::string, std::unique_ptr<profile_entry> >::iterator j;
+        for (j = th.callbacks.begin(); j != th.callbacks.end(); ++j)
+        {
+          profile_merge(merged[merge_key(NULL, j->first)], *j->second);
+        }
+      }
+    }
+    double ratio = profile_ns_per_tick();
+    std::vector<profile_record> records;
+    std::map<merge_key, profile_record>::iterator i;
+    for (i = merged.begin(); i != merged.end(); ++i)
+    {
+      profile_record &r = i->second;
+      r.total_ns *= ratio;
+      r.p50_ns = r.p99_ns = 0;
+      unsigned long long seen = 0;
+      for (int b = 0; b < profile_nbuckets; b++)
+      {
+        seen += r.buckets[b];
+        if (r.p50_ns == 0 && seen * 100 >= r.calls * 50) { r.p50_ns = profile_bucket_ns(b); }
+        if (r.p99_ns == 0 && seen * 100 >= r.calls * 99) { r.p99_ns = profile_bucket_ns(b); }
+      }
+      records.push_back(r);
+    }
+    struct by_total
+    {
+      static bool cmp(const profile_record &a, const profile_record &b)
+      {
+        return a.total_ns > b.total_ns;
+      }
+    };
+    std::sort(records.begin(), records.end(), by_total::cmp);
+    return records;
+  }
+
+
+  inline void profile_reset()
+  {
+    profile_threads &all = profile_all();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    for (std::size_t t = 0; t < all.list.size(); t++)
+    {
+      profile_thread &th = *all.list[t];
+      std::lock_guard<std::mutex> lock(th.mutex);
+      std::unordered_map<const void *, std::unique_ptr<profile_entry> >::iterator i;
+      for (i = th.entries.begin(); i != th.entries.end(); ++i)
+      {
+        profile_clear(*i->second);
+      }
+      std::unordered_map<std::string, std::unique_ptr<profile_entry> >::iterator j;
+      for (j = th.callbacks.begin(); j != th.callbacks.end(); ++j)
+      {
+        profile_clear(*j->second);
+      }
+    }
+  }
+
+
+  inline object profile_snapshot(lua_State *L)
+  {
+    std::vector<profile_record> records = profile_snapshot();
+    object t = newtable(L);
+    for (std::size_t i = 0; i < records.size(); i++)
+    {
+      object r = newtable(L);
+      r["name"] = records[i].name;
+      r["calls"] = (double)records[i].calls;
+      r["total_ns"] = records[i].total_ns;
+      r["p50_ns"] = records[i].p50_ns;
+      r["p99_ns"] = records[i].p99_ns;
+      t[(int)i + 1] = r;
+    }
+    return t;
+  }
+
+#endif
+
+
   inline object registry(lua_State *L)
   {
     lua_pushnil(L);
@@ -2577,16 +7058,50 @@ namespace luaport
   }
 
 
+#ifdef LUAPORT_CXX11
+  template <typename T>
+    inline object::object(lua_State *L, std::unique_ptr<T> &&ptr)
+    : L(L), ref(LUA_REFNIL)
+  {
+    if (L)
+    {
+      luaport::push(L, std::move(ptr));
+      ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  }
+#endif
+
+
+  inline object object::copy_to(lua_State *dst) const
+  {
+    if (! L) { throw luaport::exception("given invalid interpreter"); }
+    assert(dst != NULL);
+
+    this->push();
+    try {
+      detail::state_copier(L, dst).run(-1);
+    }
+    catch (...) {
+      lua_pop(L, 1);
+      throw;
+    }
+    lua_pop(L, 1);
+    object result = from_stack(dst, -1);
+    lua_pop(dst, 1);
+    return result;
+  }
+
+
   inline bool object::is_class() const
   {
-printf("IS CLASS?\n");
+LUAPORT_TRACE(("IS CLASS?\n"));
     object name = registry(L)["luaport"]["class_to_name"][*this];
     return name.type() == LUA_TSTRING;
   }
 
   inline bool object::is_instance() const
   {
-printf("IS INSTANCE?\n");
+LUAPORT_TRACE(("IS INSTANCE?\n"));
     object m = getmetatable();
     if (! m.is_table()) { return false; }
     if (! m["luaport"]) { return false; }
@@ -2614,7 +7129,7 @@ printf("IS INSTANCE?\n");
 
     for (;;)
     {
-printf("%s?\n", (const char *)registry(L)["luaport"]["class_to_name"][c].obj());
+LUAPORT_TRACE(("%s?\n", (const char *)registry(L)["luaport"]["class_to_name"][c].obj()));
       if (c == get_class<T>(L)) { return true; }
       m = c.getmetatable();
       if (m.type() != LUA_TTABLE) { return false; }
@@ -2663,6 +7178,7 @@ printf("%s?\n", (const char *)registry(L)["luaport"]["class_to_name"][c].obj());
   inline object object::operator()()
   {
     this->push();
+    LUAPORT_PROFILE_CALLBACK(L);
     lua_call(L, 0, 1);
     object result = from_stack(L, -1);
     lua_pop(L, 1);
@@ -2672,6 +7188,7 @@ printf("%s?\n", (const char *)registry(L)["luaport"]["class_to_name"][c].obj());
     inline object object::operator()(T1 arg1)
   {
     this->push();
+    LUAPORT_PROFILE_CALLBACK(L);
     luaport::push(L, arg1);
     lua_call(L, 1, 1);
     object result = from_stack(L, -1);
@@ -2682,6 +7199,7 @@ printf("%s?\n", (const char *)registry(L)["luaport"]["class_to_name"][c].obj());
     inline object object::operator()(T1 arg1, T2 arg2)
   {
     this->push();
+    LUAPORT_PROFILE_CALLBACK(L);
     luaport::push(L, arg1);
     luaport::push(L, arg2);
     lua_call(L, 2, 1);
@@ -2693,6 +7211,7 @@ printf("%s?\n", (const char *)registry(L)["luaport"]["class_to_name"][c].obj());
     inline object object::operator()(T1 arg1, T2 arg2, T3 arg3)
   {
     this->push();
+    LUAPORT_PROFILE_CALLBACK(L);
     luaport::push(L, arg1);
     luaport::push(L, arg2);
     luaport::push(L, arg3);
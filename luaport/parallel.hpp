@@ -0,0 +1,314 @@
+#ifndef _LUAPORT_PARALLEL_HPP
+#define _LUAPORT_PARALLEL_HPP
+
+/////////////////////////////////////////////////////////////////////////////
+/// @file        parallel.hpp
+/// @brief       data-parallel map of a lua function on worker interpreters
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @author      spinor (\@tplantd)
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus < 201103L
+#  error "luaport/parallel.hpp requires C++11"
+#endif
+
+// standard headers first, as luaport.hpp defines function(func) macro
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "luaport.hpp"
+
+namespace luaport
+{
+
+  /// interpreters (one per thread) running map jobs
+  /**
+   * the input is cut into chunks, each worker first takes the chunks of its
+   * own contiguous share and then steals the remaining chunks of the other
+   * workers from the back. the interpreters and their threads are kept
+   * between jobs, so the initialization and the loaded script are reused and
+   * a job only wakes the sleeping threads. map() calls on the same pool are
+   * serialized.
+   */
+  class worker_pool
+  {
+    public:
+      typedef std::function<void (lua_State *)> callback;
+
+      /// Constructor
+      /**
+       * @param n : number of workers (0 for the number of cores)
+       * @param init : called once for each interpreter (luaport::open,
+       *               bindings, ...), after luaL_openlibs
+       */
+      explicit worker_pool(std::size_t n = 0, const callback &init = callback())
+        : job(NULL), pending(0), generation(0), stopping(false)
+      {
+        if (n == 0) { n = std::thread::hardware_concurrency(); }
+        if (n == 0) { n = 1; }
+        try {
+          for (std::size_t i = 0; i < n; i++)
+          {
+            std::unique_ptr<worker> w(new worker());
+            w->L = luaL_newstate();
+            if (! w->L) { throw luaport::exception("error on worker_pool - failed to create state"); }
+            luaL_openlibs(w->L);
+            workers.push_back(std::move(w));
+            if (init) { init(workers.back()->L); }
+            lua_settop(workers.back()->L, 0);
+          }
+          for (std::size_t i = 0; i < n; i++)
+          {
+            workers[i]->thread = std::thread(&worker_pool::run, this, i);
+          }
+        }
+        catch (...) {
+          close_all();
+          throw;
+        }
+      }
+
+      ~worker_pool() { close_all(); }
+
+      /// number of workers
+      std::size_t size() const { return workers.size(); }
+
+      /// apply the lua function to each input in parallel
+      /**
+       * the chunk is run once on each interpreter (again only when it
+       * changes) and should define the global function. results are in the
+       * order of the inputs. errors of the elements are reported as in
+       * call_batch, errors of loading the chunk are thrown.
+       * @param R : result type
+       * @param chunk : lua script defining the function
+       * @param name : global name of the function
+       * @param in : inputs
+       * @param errors : errors are appended to it if given (sorted by index)
+       * @param grain : inputs per chunk (0 for automatic)
+       * @return results (value initialized on errors)
+       */
+      template <typename R, typename T>
+        std::vector<R> map(const std::string &chunk, const std::string &name,
+                           const std::vector<T> &in,
+                           std::vector<batch_error> *errors = NULL,
+                           std::size_t grain = 0)
+      {
+        // the shares of the workers belong to one job at a time
+        std::lock_guard<std::mutex> serial(mapping);
+        std::size_t n = in.size();
+        std::size_t nworkers = workers.size();
+        if (grain == 0)
+        {
+          grain = n / (nworkers * 16);
+          if (grain < 1) { grain = 1; }
+          if (grain > 4096) { grain = 4096; }
+        }
+        std::size_t nchunks = (n + grain - 1) / grain;
+        // contiguous shares of the chunks
+        for (std::size_t i = 0; i < nworkers; i++)
+        {
+          workers[i]->next = nchunks * i / nworkers;
+          workers[i]->end = nchunks * (i + 1) / nworkers;
+        }
+
+        std::unique_ptr<R[]> out(new R[n]());
+        std::vector<batch_error> errs;
+        std::exception_ptr failure;
+        std::mutex shared;
+        dispatch([&](std::size_t i) {
+          try {
+            lua_State *L = workers[i]->L;
+            load(*workers[i], chunk);
+            object func = globals(L)[name];
+            if (func.type() != LUA_TFUNCTION)
+            {
+              throw luaport::exception("error on worker_pool::map - " + name +
+                                       " is not a function");
+            }
+            std::vector<batch_error> local;
+            std::size_t c;
+            while (take(i, c))
+            {
+              std::size_t begin = c * grain;
+              std::size_t len = std::min(grain, n - begin);
+              R *dest = out.get();
+              detail::call_batch_range<R>(func, in, begin, len, dest,
+                                          errors ? &local : NULL);
+            }
+            if (! local.empty())
+            {
+              std::lock_guard<std::mutex> lock(shared);
+              errs.insert(errs.end(), local.begin(), local.end());
+            }
+          }
+          catch (...) {
+            std::lock_guard<std::mutex> lock(shared);
+            if (! failure) { failure = std::current_exception(); }
+            // let the others finish the remaining chunks
+          }
+        });
+        if (failure) { std::rethrow_exception(failure); }
+        if (errors)
+        {
+          std::sort(errs.begin(), errs.end(), by_index);
+          errors->insert(errors->end(), errs.begin(), errs.end());
+        }
+        return std::vector<R>(std::make_move_iterator(out.get()),
+                              std::make_move_iterator(out.get() + n));
+      }
+
+    private:
+      struct worker
+      {
+        worker() : L(NULL), next(0), end(0) { }
+        lua_State *L;
+        std::thread thread;
+        std::string chunk;  // the chunk loaded last
+        std::mutex mutex;   // guards next and end
+        std::size_t next;
+        std::size_t end;
+      };
+
+      worker_pool(const worker_pool &);
+      worker_pool& operator=(const worker_pool &);
+
+      static bool by_index(const batch_error &a, const batch_error &b)
+      {
+        return a.index < b.index;
+      }
+
+      static void load(worker &w, const std::string &chunk)
+      {
+        if (w.chunk == chunk && ! chunk.empty()) { return; }
+        lua_State *L = w.L;
+        w.chunk.clear();
+        object f = luaport::load(L, chunk);
+        if (f.type() != LUA_TFUNCTION)
+        {
+          throw luaport::exception("error on worker_pool::map - failed to compile the chunk");
+        }
+        f.push();
+        if (lua_pcall(L, 0, 0, 0) != LUA_OK)
+        {
+          std::string msg = lua_tostring(L, -1) ? lua_tostring(L, -1) : "";
+          lua_settop(L, 0);
+          throw luaport::exception("error on worker_pool::map - " + msg);
+        }
+        w.chunk = chunk;
+      }
+
+      // runs the job on every worker thread and waits for all of them
+      // (called by map() holding the mapping lock)
+      void dispatch(const std::function<void (std::size_t)> &f)
+      {
+        std::unique_lock<std::mutex> lock(control);
+        job = &f;
+        pending = workers.size();
+        generation++;
+        job_ready.notify_all();
+        job_done.wait(lock, [this] { return pending == 0; });
+        job = NULL;
+      }
+
+      // thread of the i-th worker, sleeps between the jobs
+      void run(std::size_t i)
+      {
+        std::size_t seen = 0;
+        for (;;)
+        {
+          const std::function<void (std::size_t)> *f;
+          {
+            std::unique_lock<std::mutex> lock(control);
+            job_ready.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) { return; }
+            seen = generation;
+            f = job;
+          }
+          (*f)(i);
+          std::lock_guard<std::mutex> lock(control);
+          if (--pending == 0) { job_done.notify_one(); }
+        }
+      }
+
+      // takes the next own chunk, or steals the last chunk of another worker
+      bool take(std::size_t self, std::size_t &c)
+      {
+        {
+          worker &w = *workers[self];
+          std::lock_guard<std::mutex> lock(w.mutex);
+          if (w.next < w.end)
+          {
+            c = w.next++;
+            return true;
+          }
+        }
+        for (std::size_t k = 1; k < workers.size(); k++)
+        {
+          worker &v = *workers[(self + k) % workers.size()];
+          std::lock_guard<std::mutex> lock(v.mutex);
+          if (v.next < v.end)
+          {
+            c = --v.end;
+            return true;
+          }
+        }
+        return false;
+      }
+
+      void close_all()
+      {
+        {
+          std::lock_guard<std::mutex> lock(control);
+          stopping = true;
+        }
+        job_ready.notify_all();
+        for (std::size_t i = 0; i < workers.size(); i++)
+        {
+          if (workers[i]->thread.joinable()) { workers[i]->thread.join(); }
+          if (workers[i]->L) { lua_close(workers[i]->L); }
+        }
+        workers.clear();
+      }
+
+      std::vector<std::unique_ptr<worker> > workers;
+      std::mutex mapping;   // serializes map()
+      std::mutex control;   // guards the fields below
+      std::condition_variable job_ready;
+      std::condition_variable job_done;
+      const std::function<void (std::size_t)> *job;
+      std::size_t pending;
+      std::size_t generation;
+      bool stopping;
+  };
+
+
+  /// apply the lua function to each input in parallel
+  /**
+   * makes a temporary worker_pool, use worker_pool directly to keep the
+   * interpreters between calls.
+   * @see worker_pool::map
+   */
+  template <typename R, typename T>
+    inline std::vector<R> parallel_map(const std::string &chunk,
+                                       const std::string &name,
+                                       const std::vector<T> &in,
+                                       const worker_pool::callback &init = worker_pool::callback(),
+                                       std::vector<batch_error> *errors = NULL)
+  {
+    worker_pool pool(0, init);
+    return pool.map<R>(chunk, name, in, errors);
+  }
+
+} // namespace luaport
+
+#endif // _LUAPORT_PARALLEL_HPP
@@ -0,0 +1,290 @@
+#ifndef _LUAPORT_POOL_HPP
+#define _LUAPORT_POOL_HPP
+
+/////////////////////////////////////////////////////////////////////////////
+/// @file        pool.hpp
+/// @brief       pool of prepared lua interpreters shared by worker threads
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @author      spinor (\@tplantd)
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus < 201103L
+#  error "luaport/pool.hpp requires C++11"
+#endif
+
+// standard headers first, as luaport.hpp defines function(func) macro
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "luaport.hpp"
+
+namespace luaport
+{
+
+  /// pool of lua interpreters
+  /**
+   * creates the interpreters up front, prepares each of them with the
+   * warm-up callback (luaport::open, bindings, loading scripts, ...) and
+   * lends them to one thread at a time. an interpreter is used only by the
+   * thread holding its lease.
+   */
+  class state_pool
+  {
+    public:
+      typedef std::function<void (lua_State *)> callback;
+
+      /// utilization counters
+      struct stats
+      {
+        std::size_t size;         ///< number of interpreters
+        std::size_t in_use;       ///< currently checked out
+        std::size_t peak_in_use;  ///< maximum of in_use
+        unsigned long checkouts;  ///< successful checkouts
+        unsigned long waits;      ///< checkouts which had to wait
+        unsigned long timeouts;   ///< checkouts given up
+        double wait_seconds;      ///< total time spent waiting
+      };
+
+      /// checked out interpreter, returned to the pool on destruction
+      class lease
+      {
+        public:
+          lease() : pool(NULL), L(NULL) { }
+          lease(lease &&src) : pool(src.pool), L(src.L)
+          {
+            src.pool = NULL;
+            src.L = NULL;
+          }
+          ~lease() { release(); }
+
+          lease& operator=(lease &&src)
+          {
+            if (this != &src)
+            {
+              release();
+              pool = src.pool;
+              L = src.L;
+              src.pool = NULL;
+              src.L = NULL;
+            }
+            return *this;
+          }
+
+          /// return the interpreter to the pool now
+          void release()
+          {
+            if (pool && L) { pool->checkin(L); }
+            pool = NULL;
+            L = NULL;
+          }
+
+          lua_State *get() const { return L; }
+          operator lua_State *() const { return L; }
+          explicit operator bool() const { return L != NULL; }
+
+        private:
+          friend class state_pool;
+          lease(state_pool *pool, lua_State *L) : pool(pool), L(L) { }
+          lease(const lease &);
+          lease& operator=(const lease &);
+
+          state_pool *pool;
+          lua_State *L;
+      };
+
+      /// Constructor
+      /**
+       * throws the exception thrown by the warm-up after closing the
+       * interpreters already created.
+       * @param n : number of interpreters
+       * @param warmup : called once for each new interpreter
+       * @param reset : called on each checkin (e.g. restoring globals or
+       *                lua_gc), the stack is always cleared
+       */
+      state_pool(std::size_t n, const callback &warmup,
+                 const callback &reset = callback())
+        : reset(reset), size(n), peak(0), checkouts(0), waits(0),
+          timeouts(0), wait_ns(0)
+      {
+        states.reserve(n);
+        try {
+          for (std::size_t i = 0; i < n; i++)
+          {
+            lua_State *L = luaL_newstate();
+            if (! L) { throw luaport::exception("error on state_pool - failed to create state"); }
+            states.push_back(L);
+            if (warmup) { warmup(L); }
+            lua_settop(L, 0);
+          }
+        }
+        catch (...) {
+          close_all();
+          throw;
+        }
+        all = states;
+      }
+
+      /// Destructor
+      /**
+       * all leases should be released before, the interpreters are closed.
+       */
+      ~state_pool()
+      {
+        assert(states.size() == size);
+        close_all();
+      }
+
+      /// take an interpreter, waiting until one is available
+      lease checkout()
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (states.empty())
+        {
+          std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+          waits++;
+          available.wait(lock, [this] { return ! states.empty(); });
+          wait_ns += elapsed_ns(start);
+        }
+        return take();
+      }
+
+      /// take an interpreter, waiting at most for the given time
+      /**
+       * @return lease (empty on timeout)
+       */
+      template <typename Rep, typename Period>
+        lease checkout_for(const std::chrono::duration<Rep, Period> &timeout)
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (states.empty())
+        {
+          std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+          waits++;
+          bool ok = available.wait_for(lock, timeout, [this] { return ! states.empty(); });
+          wait_ns += elapsed_ns(start);
+          if (! ok)
+          {
+            timeouts++;
+            return lease();
+          }
+        }
+        return take();
+      }
+
+      /// take an interpreter if one is available
+      /**
+       * @return lease (empty if all are in use)
+       */
+      lease try_checkout()
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (states.empty()) { return lease(); }
+        return take();
+      }
+
+      /// get the utilization counters
+      stats get_stats() const
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats s;
+        s.size = size;
+        s.in_use = size - states.size();
+        s.peak_in_use = peak;
+        s.checkouts = checkouts;
+        s.waits = waits;
+        s.timeouts = timeouts;
+        s.wait_seconds = wait_ns / 1e9;
+        return s;
+      }
+
+      /// call the function on every interpreter (e.g. reloading scripts)
+      /**
+       * waits until all the interpreters are checked in.
+       */
+      void for_each(const callback &fn)
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        all_idle.wait(lock, [this] { return states.size() == size; });
+        for (std::size_t i = 0; i < all.size(); i++)
+        {
+          fn(all[i]);
+          lua_settop(all[i], 0);
+        }
+      }
+
+    private:
+      state_pool(const state_pool &);
+      state_pool& operator=(const state_pool &);
+
+      static double elapsed_ns(std::chrono::steady_clock::time_point start)
+      {
+        return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count();
+      }
+
+      // called with the lock held and states not empty
+      lease take()
+      {
+        // LIFO, the most recently used interpreter has warm caches
+        lua_State *L = states.back();
+        states.pop_back();
+        checkouts++;
+        std::size_t in_use = size - states.size();
+        if (in_use > peak) { peak = in_use; }
+        return lease(this, L);
+      }
+
+      void checkin(lua_State *L)
+      {
+        // reset outside of the lock
+        lua_settop(L, 0);
+        if (reset)
+        {
+          // called from the lease destructor, errors can't be reported
+          try { reset(L); }
+          catch (...) { }
+          lua_settop(L, 0);
+        }
+        bool idle;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          states.push_back(L);
+          idle = states.size() == size;
+        }
+        // one interpreter returned, so one waiting checkout can take it
+        available.notify_one();
+        if (idle) { all_idle.notify_all(); }
+      }
+
+      void close_all()
+      {
+        for (std::size_t i = 0; i < states.size(); i++)
+        {
+          lua_close(states[i]);
+        }
+        states.clear();
+        all.clear();
+      }
+
+      callback reset;
+      std::vector<lua_State *> states;
+      std::vector<lua_State *> all;
+      std::size_t size;
+      std::size_t peak;
+      unsigned long checkouts;
+      unsigned long waits;
+      unsigned long timeouts;
+      double wait_ns;
+      mutable std::mutex mutex;
+      std::condition_variable available;  // for checkout
+      std::condition_variable all_idle;   // for for_each
+  };
+
+} // namespace luaport
+
+#endif // _LUAPORT_POOL_HPP
@@ -0,0 +1,249 @@
+#ifndef _LUAPORT_SAMPLER_HPP
+#define _LUAPORT_SAMPLER_HPP
+
+/////////////////////////////////////////////////////////////////////////////
+/// @file        sampler.hpp
+/// @brief       sampling profiler of lua code producing folded stacks
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @author      spinor (\@tplantd)
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+//
+// usage:
+//   luaport::sampler s(L, 1000);  // sample every 1000 instructions
+//   ... run scripts ...
+//   s.stop();
+//   std::ofstream("out.folded") << s.folded();
+//   // flamegraph.pl out.folded > out.svg
+//
+// each line of the output is "root;...;leaf weight". frames are
+//   function@source:line   (lua functions, main@source for chunks)
+//   Class.method [C]       (methods of classes registered by newclass)
+//   name [C]               (other C/C++ functions)
+// the weight is the time (microseconds) since the previous sample, or the
+// number of samples. samples are taken by a count hook, so the time spent
+// in a C++ binding is charged to the stack sampled after it returns. a
+// hook already set on the thread (e.g. budget) is chained and still called
+// at its own count while the sampler runs; stop the sampler before the
+// hook's owner restores its previous hook.
+
+#include "luaport.hpp"
+
+#include <cstdio>
+#include <map>
+
+namespace luaport
+{
+
+  /// sampling profiler of the lua thread (coroutines created while it
+  /// runs are sampled too)
+  class sampler
+  {
+    public:
+      /// Constructor (starts sampling)
+      /**
+       * @param L : lua thread
+       * @param period : instructions between samples
+       * @param by_time : weight samples by the elapsed time instead of 1
+       * @param max_depth : frames kept from the leaf side
+       */
+      sampler(lua_State *L, int period = 1000, bool by_time = true,
+              int max_depth = 64)
+        : L(L), period(period > 0 ? period : 1), by_time(by_time),
+          max_depth(max_depth), running(false), count(0), last(0),
+          tick(0), since_sample(0), since_prev(0), prev(NULL), outer(NULL),
+          prev_hook(NULL), prev_mask(0), prev_count(0)
+      {
+        start();
+      }
+
+      ~sampler() { stop(); }
+
+      /// (re)start sampling
+      void start()
+      {
+        if (running) { return; }
+        prev_hook = lua_gethook(L);
+        prev_mask = prev_hook ? lua_gethookmask(L) : 0;
+        prev_count = lua_gethookcount(L);
+        // both counts are reached exactly by steps of their gcd
+        tick = period;
+        if ((prev_mask & LUA_MASKCOUNT) && prev_count > 0)
+        {
+          tick = gcd(period, prev_count);
+        }
+        since_sample = since_prev = 0;
+        prev = (sampler *)detail::get_thread_object(L, samplers(), L);
+        outer = (sampler *)detail::get_thread_object(L, samplers(), NULL);
+        detail::set_thread_object(L, samplers(), L, this);
+        detail::set_thread_object(L, samplers(), NULL, this);
+        last = detail::clock_seconds();
+        lua_sethook(L, hook, LUA_MASKCOUNT | prev_mask, tick);
+        running = true;
+      }
+
+      /// stop sampling and restore the previous hook
+      void stop()
+      {
+        if (! running) { return; }
+        detail::set_thread_object(L, samplers(), L, prev);
+        detail::set_thread_object(L, samplers(), NULL, outer);
+        lua_sethook(L, prev_hook, prev_mask, prev_count);
+        running = false;
+      }
+
+      /// number of samples taken
+      unsigned long samples() const { return count; }
+
+      /// drop the samples
+      void clear()
+      {
+        stacks.clear();
+        count = 0;
+      }
+
+      /// folded stacks ("root;...;leaf weight" per line)
+      std::string folded() const
+      {
+        std::string out;
+        char buf[32];
+        std::map<std::string, double>::const_iterator i;
+        for (i = stacks.begin(); i != stacks.end(); ++i)
+        {
+          std::sprintf(buf, " %.0f\n", i->second);
+          out += i->first;
+          out += buf;
+        }
+        return out;
+      }
+
+    private:
+      sampler(const sampler &);
+      sampler& operator=(const sampler &);
+
+      // registry[&samplers] is the table of thread -> sampler
+      // (see detail::set_thread_object)
+      static char *samplers()
+      {
+        static char tag;
+        return &tag;
+      }
+
+      static int gcd(int a, int b)
+      {
+        while (b) { int r = a % b; a = b; b = r; }
+        return a;
+      }
+
+      // "Class.method [C]" or "name [C]" of the C function of the frame
+      static std::string c_frame(lua_State *L, lua_Debug *ar)
+      {
+        std::string name = ar->name ? ar->name : "?";
+        if (ar->namewhat && std::string(ar->namewhat) == "method" &&
+            lua_getlocal(L, ar, 1))
+        {
+          if (lua_getmetatable(L, -1))
+          {
+            lua_getfield(L, -1, "class");
+            lua_getfield(L, LUA_REGISTRYINDEX, "luaport");
+            if (lua_istable(L, -1))
+            {
+              lua_getfield(L, -1, "class_to_name");
+              lua_pushvalue(L, -3);
+              lua_rawget(L, -2);
+              if (lua_isstring(L, -1))
+              {
+                name = std::string(lua_tostring(L, -1)) + "." + name;
+              }
+              lua_pop(L, 2);
+            }
+            lua_pop(L, 3);
+          }
+          lua_pop(L, 1);
+        }
+        return name + " [C]";
+      }
+
+      static std::string lua_frame(lua_Debug *ar)
+      {
+        char line[32];
+        std::sprintf(line, ":%d", ar->linedefined);
+        std::string name;
+        if (ar->what && std::string(ar->what) == "main") { name = "main"; }
+        else { name = ar->name ? ar->name : "?"; }
+        return name + "@" + ar->short_src + line;
+      }
+
+      void sample(lua_State *L)
+      {
+        std::string stack;
+        lua_Debug ar;
+        for (int level = 0; level < max_depth && lua_getstack(L, level, &ar); level++)
+        {
+          if (! lua_getinfo(L, "Sn", &ar)) { break; }
+          std::string frame;
+          if (ar.what && std::string(ar.what) == "C") { frame = c_frame(L, &ar); }
+          else { frame = lua_frame(&ar); }
+          // ';' separates the frames
+          for (std::size_t i = 0; i < frame.size(); i++)
+          {
+            if (frame[i] == ';') { frame[i] = ','; }
+          }
+          stack = level == 0 ? frame : frame + ";" + stack;
+        }
+        double t = detail::clock_seconds();
+        stacks[stack] += by_time ? (t - last) * 1e6 : 1;
+        last = t;
+        count++;
+      }
+
+      static void hook(lua_State *L, lua_Debug *ar)
+      {
+        // coroutines inheriting the hook are sampled by the innermost sampler
+        sampler *s = (sampler *)detail::find_thread_object(L, samplers());
+        if (! s) { return; }
+        if (ar->event != LUA_HOOKCOUNT)
+        {
+          if (s->prev_hook) { s->prev_hook(L, ar); }
+          return;
+        }
+        s->since_sample += s->tick;
+        if (s->since_sample >= s->period)
+        {
+          s->since_sample = 0;
+          s->sample(L);
+        }
+        if (s->prev_mask & LUA_MASKCOUNT)
+        {
+          s->since_prev += s->tick;
+          if (s->since_prev >= s->prev_count)
+          {
+            // called last, the chained hook may raise an error or yield
+            s->since_prev = 0;
+            s->prev_hook(L, ar);
+          }
+        }
+      }
+
+      lua_State *L;
+      int period;
+      bool by_time;
+      int max_depth;
+      bool running;
+      unsigned long count;
+      double last;
+      int tick;
+      int since_sample;
+      int since_prev;
+      sampler *prev;
+      sampler *outer;
+      std::map<std::string, double> stacks;
+      lua_Hook prev_hook;
+      int prev_mask;
+      int prev_count;
+  };
+
+} // namespace luaport
+
+#endif // _LUAPORT_SAMPLER_HPP
@@ -0,0 +1,753 @@
+#ifndef _LUAPORT_SERIALIZE_HPP
+#define _LUAPORT_SERIALIZE_HPP
+
+/////////////////////////////////////////////////////////////////////////////
+/// @file        serialize.hpp
+/// @brief       binary serializer of lua values reachable from an object
+/// @author      Akiva Miura <akiva.miura@gmail.com>
+/// @author      spinor (\@tplantd)
+/// @par Copyright: (C) 2013 Akiva Miura, spinor
+/// @par Licence:   MIT License
+/////////////////////////////////////////////////////////////////////////////
+//
+// format (all integers are LEB128 varints unless noted):
+//   stream   := "LPS1" value
+//   value    := nil | false | true | integer | float | string
+//             | table | instance | ref
+//   integer  := 0x03 zigzag(int64)
+//   float    := 0x04 8 bytes (IEEE 754 double, little endian)
+//   string   := 0x05 length bytes
+//   table    := 0x06 narr nhash value{narr} (value value){nhash}
+//   instance := 0x07 length class-name value
+//   ref      := 0x08 id
+// tables and instances get ids (0, 1, 2, ...) in the order they are
+// written, ref refers to an already written one (shared and cyclic
+// references). instances of classes registered with newclass are written
+// through the hooks of the class:
+//   class.__serialize(instance) -> value
+//   class.__deserialize(value) -> instance
+// an instance gets its id after its value, since it is created from the
+// whole value on reading. so an instance can't be reached from its own
+// value (instance cycles), serialize throws for such instances.
+
+#include "luaport.hpp"
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+namespace luaport
+{
+
+  /// output stream interface for serialize
+  class sink
+  {
+    public:
+      virtual ~sink() { }
+
+      /// write the data
+      /**
+       * should throw luaport::exception on failure
+       * @param data : bytes to write
+       * @param len : number of bytes
+       */
+      virtual void write(const char *data, size_t len) = 0;
+  };
+
+
+  /// input stream interface for deserialize
+  class source
+  {
+    public:
+      virtual ~source() { }
+
+      /// read at most len bytes
+      /**
+       * @param buf : destination
+       * @param len : capacity of buf
+       * @return number of read bytes (0 at the end of data)
+       */
+      virtual size_t read(char *buf, size_t len) = 0;
+  };
+
+
+  /// sink appending to std::string
+  class string_sink : public sink
+  {
+    public:
+      string_sink(std::string &str) : str(str) { }
+
+      virtual void write(const char *data, size_t len)
+      {
+        str.append(data, len);
+      }
+
+    private:
+      std::string &str;
+  };
+
+
+  /// sink writing to std::ostream
+  class ostream_sink : public sink
+  {
+    public:
+      ostream_sink(std::ostream &os) : os(os) { }
+
+      virtual void write(const char *data, size_t len)
+      {
+        os.write(data, len);
+        if (! os) { throw luaport::exception("error on ostream_sink::write"); }
+      }
+
+    private:
+      std::ostream &os;
+  };
+
+
+  /// source reading from memory
+  class string_source : public source
+  {
+    public:
+      string_source(const char *data, size_t len)
+        : data(data), len(len), pos(0)
+      { }
+      string_source(const std::string &str)
+        : data(str.data()), len(str.length()), pos(0)
+      { }
+
+      virtual size_t read(char *buf, size_t n)
+      {
+        if (n > len - pos) { n = len - pos; }
+        std::memcpy(buf, data + pos, n);
+        pos += n;
+        return n;
+      }
+
+    private:
+      const char *data;
+      size_t len;
+      size_t pos;
+  };
+
+
+  /// source reading from std::istream
+  class istream_source : public source
+  {
+    public:
+      istream_source(std::istream &is) : is(is) { }
+
+      virtual size_t read(char *buf, size_t n)
+      {
+        is.read(buf, n);
+        return is.gcount();
+      }
+
+    private:
+      std::istream &is;
+  };
+
+
+  /// serialize the value into the sink
+  /**
+   * supports nil, booleans, numbers, strings, tables (including shared and
+   * cyclic ones) and instances of registered classes defining
+   * __serialize. throws luaport::exception for other values and for
+   * instances reachable from their own __serialize value.
+   * @param obj : value to serialize
+   * @param out : output stream
+   */
+  extern void serialize(const object &obj, sink &out);
+  /// @overload
+  /**
+   * @return serialized data
+   */
+  extern std::string serialize(const object &obj);
+
+  /// rebuild the value written by serialize
+  /**
+   * @param L : lua interpreter to create the value in
+   * @param in : input stream
+   * @return deserialized value
+   */
+  extern object deserialize(lua_State *L, source &in);
+  /// @overload
+  extern object deserialize(lua_State *L, const std::string &data);
+
+
+  namespace detail
+  {
+    /// @cond DETAIL
+
+    enum serial_tag
+    {
+      serial_nil = 0,
+      serial_false = 1,
+      serial_true = 2,
+      serial_integer = 3,
+      serial_float = 4,
+      serial_string = 5,
+      serial_table = 6,
+      serial_instance = 7,
+      serial_ref = 8
+    };
+
+    const char serial_magic[] = "LPS1";
+    const int serial_max_depth = 1000;
+
+    // writes the value on the stack through a buffer
+    class serializer
+    {
+      public:
+        serializer(lua_State *L, sink &out)
+          : L(L), out(out), used(0), seen(0), next_id(0), depth(0)
+        { }
+
+        void run(int idx)
+        {
+          idx = lua_absindex(L, idx);
+          int top = lua_gettop(L);
+          try {
+            put(serial_magic, 4);
+            lua_newtable(L);
+            seen = lua_gettop(L);
+            value(idx);
+            flush();
+          }
+          catch (...) {
+            lua_settop(L, top);
+            throw;
+          }
+          lua_settop(L, top);
+        }
+
+      private:
+        void flush()
+        {
+          if (used > 0) { out.write(buf, used); }
+          used = 0;
+        }
+
+        void put(char c)
+        {
+          if (used == sizeof(buf)) { flush(); }
+          buf[used++] = c;
+        }
+
+        void put(const char *data, size_t len)
+        {
+          if (len > sizeof(buf) - used)
+          {
+            flush();
+            if (len >= sizeof(buf))
+            {
+              out.write(data, len);
+              return;
+            }
+          }
+          std::memcpy(buf + used, data, len);
+          used += len;
+        }
+
+        void varint(unsigned long long v)
+        {
+          while (v >= 0x80)
+          {
+            put((char)(v | 0x80));
+            v >>= 7;
+          }
+          put((char)v);
+        }
+
+        void number(int idx)
+        {
+#if LUA_VERSION_NUM >= 503
+          if (lua_isinteger(L, idx))
+          {
+            long long i = lua_tointeger(L, idx);
+            put((char)serial_integer);
+            varint(((unsigned long long)i << 1) ^ (unsigned long long)(i >> 63));
+            return;
+          }
+#endif
+          double d = lua_tonumber(L, idx);
+#if LUA_VERSION_NUM < 503
+          // integral values are written compactly (except -0.0),
+          // lua 5.3 keeps the float subtype of 1.0 instead
+          if (d >= -9.2e18 && d <= 9.2e18 && d == (double)(long long)d)
+          {
+            unsigned long long bits;
+            std::memcpy(&bits, &d, sizeof(d));
+            if (d != 0 || bits == 0)
+            {
+              long long i = (long long)d;
+              put((char)serial_integer);
+              varint(((unsigned long long)i << 1) ^ (unsigned long long)(i >> 63));
+              return;
+            }
+          }
+#endif
+          unsigned long long bits;
+          std::memcpy(&bits, &d, sizeof(d));
+          put((char)serial_float);
+          for (int i = 0; i < 8; i++)
+          {
+            put((char)(bits >> (i * 8)));
+          }
+        }
+
+        void string(int idx)
+        {
+          size_t len;
+          const char *str = lua_tolstring(L, idx, &len);
+          put((char)serial_string);
+          varint(len);
+          put(str, len);
+        }
+
+        // writes ref if the table/instance is already written
+        bool ref(int idx)
+        {
+          lua_pushvalue(L, idx);
+          lua_rawget(L, seen);
+          if (lua_isnumber(L, -1))
+          {
+            put((char)serial_ref);
+            varint((unsigned long long)lua_tonumber(L, -1));
+            lua_pop(L, 1);
+            return true;
+          }
+          if (lua_toboolean(L, -1))
+          {
+            // instance being written, it has no id yet
+            throw luaport::exception("unable to serialize instance referring to itself "
+                                     "through its __serialize value");
+          }
+          lua_pop(L, 1);
+          return false;
+        }
+
+        void mark(int idx)
+        {
+          lua_pushvalue(L, idx);
+          lua_pushnumber(L, next_id++);
+          lua_rawset(L, seen);
+        }
+
+        void table(int idx)
+        {
+          if (ref(idx)) { return; }
+          mark(idx);
+
+          // count the hash entries first so that the reader can presize
+          size_t narr = lua_rawlen(L, idx);
+          size_t total = 0;
+          size_t in_array = 0;
+          lua_pushnil(L);
+          while (lua_next(L, idx))
+          {
+            total++;
+            lua_pop(L, 1);
+          }
+          for (size_t i = 1; i <= narr; i++)
+          {
+            lua_rawgeti(L, idx, i);
+            if (! lua_isnil(L, -1)) { in_array++; }
+            lua_pop(L, 1);
+          }
+
+          put((char)serial_table);
+          varint(narr);
+          varint(total - in_array);
+          for (size_t i = 1; i <= narr; i++)
+          {
+            lua_rawgeti(L, idx, i);
+            value(lua_gettop(L));
+            lua_pop(L, 1);
+          }
+          lua_pushnil(L);
+          while (lua_next(L, idx))
+          {
+            int k = lua_gettop(L) - 1;
+            if (lua_type(L, k) == LUA_TNUMBER)
+            {
+              lua_Number n = lua_tonumber(L, k);
+              if (n >= 1 && n <= narr && n == (lua_Number)(size_t)n)
+              {
+                // already written in the array part
+                lua_pop(L, 1);
+                continue;
+              }
+            }
+            value(k);
+            value(k + 1);
+            lua_pop(L, 1);
+          }
+        }
+
+        void instance(int idx)
+        {
+          if (ref(idx)) { return; }
+          if (! lua_getmetatable(L, idx))
+          {
+            throw luaport::exception("unable to serialize unregistered userdata");
+          }
+          lua_getfield(L, -1, "luaport");
+          lua_getfield(L, -2, "class");
+          if (! lua_toboolean(L, -2) || ! lua_istable(L, -1))
+          {
+            throw luaport::exception("unable to serialize unregistered userdata");
+          }
+          int c = lua_gettop(L);
+          object name = registry(L)["luaport"]["class_to_name"][object(from_stack(L, c))];
+          std::string cname = name.tostring();
+          lua_getfield(L, c, "__serialize");
+          if (! lua_isfunction(L, -1))
+          {
+            throw luaport::exception("class " + cname + " does not define __serialize");
+          }
+          // mark as being written to detect the instance cycles
+          lua_pushvalue(L, idx);
+          lua_pushboolean(L, 1);
+          lua_rawset(L, seen);
+          lua_pushvalue(L, idx);
+          if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+          {
+            const char *msg = lua_tostring(L, -1);
+            throw luaport::exception("error on " + cname + ".__serialize: " +
+                                     (msg ? msg : "(error object is not a string)"));
+          }
+          put((char)serial_instance);
+          varint(cname.length());
+          put(cname.data(), cname.length());
+          value(lua_gettop(L));
+          // ids of instances are given after their contents
+          mark(idx);
+          lua_pop(L, 4); // pop result, class, luaport, metatable
+        }
+
+        void value(int idx)
+        {
+          if (++depth > serial_max_depth)
+          {
+            throw luaport::exception("error on serialize - nesting too deep");
+          }
+          luaL_checkstack(L, 8, "serialize");
+          switch (lua_type(L, idx))
+          {
+            case LUA_TNIL:
+              put((char)serial_nil);
+              break;
+            case LUA_TBOOLEAN:
+              put((char)(lua_toboolean(L, idx) ? serial_true : serial_false));
+              break;
+            case LUA_TNUMBER:
+              number(idx);
+              break;
+            case LUA_TSTRING:
+              string(idx);
+              break;
+            case LUA_TTABLE:
+              table(idx);
+              break;
+            case LUA_TUSERDATA:
+              instance(idx);
+              break;
+            default:
+              throw luaport::exception(std::string("unable to serialize ") +
+                                       luaL_typename(L, idx));
+          }
+          depth--;
+        }
+
+        lua_State *L;
+        sink &out;
+        char buf[16384];
+        size_t used;
+        int seen;
+        long next_id;
+        int depth;
+    };
+
+
+    // pushes the value read from the source
+    class deserializer
+    {
+      public:
+        deserializer(lua_State *L, source &in)
+          : L(L), in(in), pos(0), len(0), ids(0), next_id(0), depth(0)
+        { }
+
+        void run()
+        {
+          int top = lua_gettop(L);
+          try {
+            char magic[4];
+            get(magic, 4);
+            if (std::memcmp(magic, serial_magic, 4) != 0)
+            {
+              throw luaport::exception("error on deserialize - bad header");
+            }
+            lua_newtable(L);
+            ids = lua_gettop(L);
+            value();
+            lua_remove(L, ids);
+          }
+          catch (...) {
+            lua_settop(L, top);
+            throw;
+          }
+        }
+
+      private:
+        void fill()
+        {
+          pos = 0;
+          len = in.read(buf, sizeof(buf));
+          if (len == 0)
+          {
+            throw luaport::exception("error on deserialize - unexpected end of data");
+          }
+        }
+
+        unsigned char get()
+        {
+          if (pos == len) { fill(); }
+          return (unsigned char)buf[pos++];
+        }
+
+        void get(char *dest, size_t n)
+        {
+          while (n > 0)
+          {
+            if (pos == len) { fill(); }
+            size_t chunk = len - pos < n ? len - pos : n;
+            std::memcpy(dest, buf + pos, chunk);
+            pos += chunk;
+            dest += chunk;
+            n -= chunk;
+          }
+        }
+
+        unsigned long long varint()
+        {
+          unsigned long long v = 0;
+          for (int shift = 0; shift < 64; shift += 7)
+          {
+            unsigned char c = get();
+            v |= (unsigned long long)(c & 0x7f) << shift;
+            if (! (c & 0x80)) { return v; }
+          }
+          throw luaport::exception("error on deserialize - bad varint");
+        }
+
+        void string()
+        {
+          unsigned long long v = varint();
+          if (v > (unsigned long long)(scratch.max_size() >> 1))
+          {
+            throw luaport::exception("error on deserialize - bad string length");
+          }
+          size_t n = (size_t)v;
+          if (n <= sizeof(buf) && n <= len - pos)
+          {
+            // whole string is in the buffer
+            lua_pushlstring(L, buf + pos, n);
+            pos += n;
+            return;
+          }
+          // the length is not trusted, the scratch grows with the data
+          // actually read (end of data is reached first for broken input)
+          scratch.clear();
+          while (n > 0)
+          {
+            if (pos == len) { fill(); }
+            size_t chunk = len - pos < n ? len - pos : n;
+            scratch.append(buf + pos, chunk);
+            pos += chunk;
+            n -= chunk;
+          }
+          lua_pushlstring(L, scratch.data(), scratch.size());
+        }
+
+        void table()
+        {
+          size_t narr = varint();
+          size_t nhash = varint();
+          lua_createtable(L, narr > 0x10000000 ? 0 : (int)narr,
+                             nhash > 0x10000000 ? 0 : (int)nhash);
+          int t = lua_gettop(L);
+          lua_pushvalue(L, t);
+          lua_rawseti(L, ids, ++next_id);
+          for (size_t i = 1; i <= narr; i++)
+          {
+            value();
+            if (lua_isnil(L, -1)) { lua_pop(L, 1); }
+            else { lua_rawseti(L, t, i); }
+          }
+          for (size_t i = 0; i < nhash; i++)
+          {
+            value();
+            value();
+            if (lua_isnil(L, -2))
+            {
+              throw luaport::exception("error on deserialize - nil key");
+            }
+            lua_rawset(L, t);
+          }
+        }
+
+        void instance()
+        {
+          size_t n = varint();
+          std::string cname(n, '\0');
+          if (n > 0) { get(&cname[0], n); }
+          object c = registry(L)["luaport"]["name_to_class"][cname];
+          if (! c.is_table())
+          {
+            throw luaport::exception("error on deserialize - unregistered class: " + cname);
+          }
+          c.push();
+          lua_getfield(L, -1, "__deserialize");
+          lua_remove(L, -2);
+          if (! lua_isfunction(L, -1))
+          {
+            throw luaport::exception("class " + cname + " does not define __deserialize");
+          }
+          value();
+          if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+          {
+            const char *msg = lua_tostring(L, -1);
+            throw luaport::exception("error on " + cname + ".__deserialize: " +
+                                     (msg ? msg : "(error object is not a string)"));
+          }
+          lua_pushvalue(L, -1);
+          lua_rawseti(L, ids, ++next_id);
+        }
+
+        void value()
+        {
+          if (++depth > serial_max_depth)
+          {
+            throw luaport::exception("error on deserialize - nesting too deep");
+          }
+          luaL_checkstack(L, 8, "deserialize");
+          int tag = get();
+          switch (tag)
+          {
+            case serial_nil:
+              lua_pushnil(L);
+              break;
+            case serial_false:
+              lua_pushboolean(L, 0);
+              break;
+            case serial_true:
+              lua_pushboolean(L, 1);
+              break;
+            case serial_integer:
+            {
+              unsigned long long z = varint();
+              long long i = (long long)(z >> 1) ^ -(long long)(z & 1);
+#if LUA_VERSION_NUM >= 503
+              lua_pushinteger(L, i);
+#else
+              lua_pushnumber(L, (lua_Number)i);
+#endif
+              break;
+            }
+            case serial_float:
+            {
+              unsigned char b[8];
+              get((char *)b, 8);
+              unsigned long long bits = 0;
+              for (int i = 0; i < 8; i++)
+              {
+                bits |= (unsigned long long)b[i] << (i * 8);
+              }
+              double d;
+              std::memcpy(&d, &bits, sizeof(d));
+              lua_pushnumber(L, d);
+              break;
+            }
+            case serial_string:
+              string();
+              break;
+            case serial_table:
+              table();
+              break;
+            case serial_instance:
+              instance();
+              break;
+            case serial_ref:
+            {
+              unsigned long long id = varint();
+              if (id >= (unsigned long long)next_id)
+              {
+                throw luaport::exception("error on deserialize - bad reference");
+              }
+              lua_rawgeti(L, ids, (int)id + 1);
+              break;
+            }
+            default:
+              throw luaport::exception("error on deserialize - unknown tag");
+          }
+          depth--;
+        }
+
+        lua_State *L;
+        source &in;
+        char buf[16384];
+        size_t pos;
+        size_t len;
+        std::string scratch;
+        int ids;
+        int next_id;
+        int depth;
+    };
+
+    /// @endcond DETAIL
+  } // namespace detail
+
+
+  inline void serialize(const object &obj, sink &out)
+  {
+    lua_State *L = obj.interpreter();
+    if (! L) { throw luaport::exception("given invalid interpreter"); }
+    obj.push();
+    try {
+      detail::serializer(L, out).run(-1);
+    }
+    catch (...) {
+      lua_pop(L, 1);
+      throw;
+    }
+    lua_pop(L, 1);
+  }
+
+
+  inline std::string serialize(const object &obj)
+  {
+    std::string data;
+    string_sink out(data);
+    serialize(obj, out);
+    return data;
+  }
+
+
+  inline object deserialize(lua_State *L, source &in)
+  {
+    detail::deserializer(L, in).run();
+    object result = from_stack(L, -1);
+    lua_pop(L, 1);
+    return result;
+  }
+
+
+  inline object deserialize(lua_State *L, const std::string &data)
+  {
+    string_source in(data);
+    return deserialize(L, in);
+  }
+
+} // namespace luaport
+
+#endif // _LUAPORT_SERIALIZE_HPP